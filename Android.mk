@@ -1,20 +1,92 @@
 LOCAL_PATH := $(call my-dir)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := libcanhazaxs.c
+LOCAL_MODULE := libcanhazaxs
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := libcanhazaxs.c
+LOCAL_MODULE := libcanhazaxs-shared
+LOCAL_MODULE_FILENAME := libcanhazaxs
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)
+include $(BUILD_SHARED_LIBRARY)
+
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := canhazaxs.c
+LOCAL_STATIC_LIBRARIES := libcanhazaxs
 LOCAL_MODULE := charm-static
 include $(BUILD_STATIC_EXECUTABLE)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := canhazaxs.c
+LOCAL_STATIC_LIBRARIES := libcanhazaxs
 LOCAL_MODULE := charm
 include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := canhazaxs.c
+LOCAL_STATIC_LIBRARIES := libcanhazaxs
 LOCAL_MODULE := charm-pie
 LOCAL_CFLAGS += -Wall -pie -fPIE
 LOCAL_LDFLAGS += -pie -fPIE
 include $(BUILD_EXECUTABLE)
 
+# optimized variants of the above, the library is built again with LTO so
+# the walker can be inlined into the executables
+CHAX_RELEASE_CFLAGS := -O2 -flto
+CHAX_RELEASE_LDFLAGS := -flto
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := libcanhazaxs.c
+LOCAL_MODULE := libcanhazaxs-release
+LOCAL_CFLAGS += $(CHAX_RELEASE_CFLAGS)
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := canhazaxs.c
+LOCAL_STATIC_LIBRARIES := libcanhazaxs-release
+LOCAL_MODULE := charm-static-release
+LOCAL_CFLAGS += $(CHAX_RELEASE_CFLAGS)
+LOCAL_LDFLAGS += $(CHAX_RELEASE_LDFLAGS)
+include $(BUILD_STATIC_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := canhazaxs.c
+LOCAL_STATIC_LIBRARIES := libcanhazaxs-release
+LOCAL_MODULE := charm-release
+LOCAL_CFLAGS += $(CHAX_RELEASE_CFLAGS)
+LOCAL_LDFLAGS += $(CHAX_RELEASE_LDFLAGS)
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := canhazaxs.c
+LOCAL_STATIC_LIBRARIES := libcanhazaxs-release
+LOCAL_MODULE := charm-pie-release
+LOCAL_CFLAGS += -Wall -pie -fPIE $(CHAX_RELEASE_CFLAGS)
+LOCAL_LDFLAGS += -pie -fPIE $(CHAX_RELEASE_LDFLAGS)
+include $(BUILD_EXECUTABLE)
+
+# static and size-optimized for pushing to many devices. bionic resolves
+# the android ids itself, so unlike "make tiny" this keeps the libc lookups.
+CHAX_TINY_CFLAGS := -Os -ffunction-sections -fdata-sections -fno-asynchronous-unwind-tables
+CHAX_TINY_LDFLAGS := -Wl,--gc-sections -s
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := libcanhazaxs.c
+LOCAL_MODULE := libcanhazaxs-tiny
+LOCAL_CFLAGS += $(CHAX_TINY_CFLAGS)
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := canhazaxs.c
+LOCAL_STATIC_LIBRARIES := libcanhazaxs-tiny
+LOCAL_MODULE := charm-tiny
+LOCAL_CFLAGS += $(CHAX_TINY_CFLAGS)
+LOCAL_LDFLAGS += $(CHAX_TINY_LDFLAGS)
+include $(BUILD_STATIC_EXECUTABLE)
+
 include $(call all-makefiles-under,$(LOCAL_PATH))
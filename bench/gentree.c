@@ -0,0 +1,281 @@
+/*
+ * generate a synthetic file system tree for benchmarking canhazaxs.
+ *
+ * the shape is fully determined by the options and the seed, so the same
+ * command line always produces the same tree (and the same findings).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+/*
+ * file modes roughly as seen on an Android /system + /data + /dev mix. the
+ * interesting ones are rare, like on a real device.
+ */
+typedef struct __stru_mode_pattern {
+    mode_t mode;
+    unsigned int weight;
+} mode_pattern_t;
+
+mode_pattern_t g_file_modes[] = {
+    { 0644, 600 },
+    { 0755, 200 },
+    { 0600, 100 },
+    { 0640, 50 },
+    { 0660, 30 },
+    { 0666, 10 },
+    { 0664, 6 },
+    { 04755, 2 },
+    { 02755, 1 },
+    { 06755, 1 },
+};
+
+mode_pattern_t g_dir_modes[] = {
+    { 0755, 700 },
+    { 0771, 150 },
+    { 0700, 100 },
+    { 0750, 40 },
+    { 0777, 8 },
+    { 01777, 2 },
+};
+
+/* owners used when running as root, otherwise everything is ours */
+uid_t g_owners[] = { 0, 1000, 1001, 1007, 2000, 9997, 10001, 10050 };
+
+int g_depth = 4;
+int g_fanout = 8;
+int g_files = 16;
+int g_flat = 0;
+int g_chain = 0;
+int g_chown = 0;
+unsigned int g_seed = 1;
+unsigned long long g_created = 0;
+
+
+unsigned int
+next_rand(void)
+{
+    /* xorshift32, deterministic across libcs unlike rand() */
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 17;
+    g_seed ^= g_seed << 5;
+    return g_seed;
+}
+
+
+mode_t
+pick_mode(mode_pattern_t *patterns, int count)
+{
+    unsigned int total = 0, r;
+    int i;
+
+    for (i = 0; i < count; i++)
+        total += patterns[i].weight;
+    r = next_rand() % total;
+    for (i = 0; i < count; i++) {
+        if (r < patterns[i].weight)
+            return patterns[i].mode;
+        r -= patterns[i].weight;
+    }
+    return patterns[0].mode;
+}
+
+
+void
+set_owner(const char *path)
+{
+    uid_t owner;
+    gid_t group;
+
+    if (!g_chown)
+        return;
+    owner = g_owners[next_rand() % (sizeof(g_owners) / sizeof(g_owners[0]))];
+    group = g_owners[next_rand() % (sizeof(g_owners) / sizeof(g_owners[0]))];
+    if (lchown(path, owner, group) == -1) {
+        perror(path);
+        exit(1);
+    }
+}
+
+
+void
+make_file(const char *path)
+{
+    int fd;
+
+    if ((fd = open(path, O_CREAT | O_WRONLY | O_EXCL, 0600)) == -1) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+    set_owner(path);
+    /* chown clears set-id bits, so the mode goes last */
+    if (chmod(path, pick_mode(g_file_modes, sizeof(g_file_modes) / sizeof(g_file_modes[0]))) == -1) {
+        perror(path);
+        exit(1);
+    }
+    g_created++;
+}
+
+
+/*
+ * directories are created searchable and only get their final mode once
+ * everything below them exists.
+ */
+void
+make_dir(const char *path)
+{
+    if (mkdir(path, 0700) == -1) {
+        perror(path);
+        exit(1);
+    }
+    set_owner(path);
+    g_created++;
+}
+
+
+void
+finish_dir(const char *path)
+{
+    if (chmod(path, pick_mode(g_dir_modes, sizeof(g_dir_modes) / sizeof(g_dir_modes[0]))) == -1) {
+        perror(path);
+        exit(1);
+    }
+}
+
+
+void
+gen_level(char *path, size_t len, int depth)
+{
+    int i;
+
+    for (i = 0; i < g_files; i++) {
+        snprintf(path + len, PATH_MAX - len, "/f%d", i);
+        make_file(path);
+    }
+    if (depth >= g_depth)
+        return;
+    for (i = 0; i < g_fanout; i++) {
+        size_t sublen = len + snprintf(path + len, PATH_MAX - len, "/d%d", i);
+
+        make_dir(path);
+        gen_level(path, sublen, depth + 1);
+        path[sublen] = '\0';
+        finish_dir(path);
+    }
+}
+
+
+void
+usage(char *argv[])
+{
+    fprintf(stderr,
+        "usage: %s [opts] <root>\n"
+        "\n"
+        "supported options:\n"
+        "-d <n>   \tdepth of the balanced tree (default 4)\n"
+        "-f <n>   \tsubdirectories per directory (default 8)\n"
+        "-n <n>   \tfiles per directory (default 16)\n"
+        "-F <n>   \talso create one flat directory holding n files\n"
+        "-c <n>   \talso create a chain of n nested directories\n"
+        "-o       \trandomize owners and groups (needs root or a user namespace\n"
+        "         \twith those ids mapped)\n"
+        "-s <n>   \trandom seed (default 1)\n"
+        , argv[0]);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    char path[PATH_MAX+1];
+    size_t len;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "d:f:n:F:c:os:")) != -1) {
+        switch (opt) {
+            case 'd':
+                g_depth = atoi(optarg);
+                break;
+            case 'f':
+                g_fanout = atoi(optarg);
+                break;
+            case 'n':
+                g_files = atoi(optarg);
+                break;
+            case 'F':
+                g_flat = atoi(optarg);
+                break;
+            case 'c':
+                g_chain = atoi(optarg);
+                break;
+            case 'o':
+                g_chown = 1;
+                break;
+            case 's':
+                g_seed = strtoul(optarg, NULL, 0);
+                if (!g_seed)
+                    g_seed = 1;
+                break;
+            default:
+                usage(argv);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv);
+        return 1;
+    }
+
+    umask(0);
+    len = snprintf(path, sizeof(path), "%s", argv[optind]);
+    if (mkdir(path, 0755) == -1) {
+        perror(path);
+        return 1;
+    }
+
+    len += snprintf(path + len, PATH_MAX - len, "/tree");
+    make_dir(path);
+    gen_level(path, len, 0);
+    path[len] = '\0';
+    finish_dir(path);
+
+    if (g_flat) {
+        len = snprintf(path, sizeof(path), "%s/flat", argv[optind]);
+        make_dir(path);
+        for (i = 0; i < g_flat; i++) {
+            snprintf(path + len, PATH_MAX - len, "/f%d", i);
+            make_file(path);
+        }
+        path[len] = '\0';
+        chmod(path, 0755);
+    }
+
+    if (g_chain) {
+        len = snprintf(path, sizeof(path), "%s/chain", argv[optind]);
+        make_dir(path);
+        for (i = 0; i < g_chain && len + 3 < PATH_MAX; i++) {
+            len += snprintf(path + len, PATH_MAX - len, "/c");
+            make_dir(path);
+        }
+        snprintf(path + len, PATH_MAX - len, "/leaf");
+        make_file(path);
+
+        /* keep the chain searchable so its full depth is walked */
+        for (; i >= 0; i--, len -= 2) {
+            path[len] = '\0';
+            chmod(path, 0755);
+        }
+    }
+
+    printf("%llu\n", g_created);
+    return 0;
+}
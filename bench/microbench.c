@@ -0,0 +1,253 @@
+/*
+ * CPU-only microbenchmarks for the classification, group lookup, storage
+ * and report paths. synthetic stat records are fed straight in, so the
+ * numbers don't depend on any file system.
+ *
+ * canhazaxs.c is included directly to get at its globals and helpers.
+ */
+#define CANHAZAXS_NO_MAIN
+#include "../canhazaxs.c"
+
+
+#define MB_PATH "/data/local/tmp/synthetic/entry"
+
+unsigned int g_mb_seed = 1;
+struct stat *g_records;
+gid_t *g_probe_gids;
+int g_nrecords = 1000000;
+/* the report resolves names for every row, which is far slower */
+int g_nreport = 10000;
+int g_rounds = 5;
+
+
+unsigned int
+mb_rand(void)
+{
+    g_mb_seed ^= g_mb_seed << 13;
+    g_mb_seed ^= g_mb_seed >> 17;
+    g_mb_seed ^= g_mb_seed << 5;
+    return g_mb_seed;
+}
+
+
+/*
+ * owners and groups come from a small pool that overlaps with the identity
+ * so every branch of chax_classify() gets exercised.
+ */
+void
+mb_make_records(void)
+{
+    static const mode_t modes[] = {
+        S_IFREG | 0644, S_IFREG | 0755, S_IFREG | 0600, S_IFREG | 0660,
+        S_IFREG | 0666, S_IFREG | 04755, S_IFREG | 02755, S_IFDIR | 0755,
+        S_IFDIR | 0771, S_IFDIR | 0700, S_IFCHR | 0660, S_IFSOCK | 0666,
+    };
+    int i;
+
+    g_records = (struct stat *)calloc(g_nrecords, sizeof(struct stat));
+    g_probe_gids = (gid_t *)calloc(g_nrecords, sizeof(gid_t));
+    if (!g_records || !g_probe_gids) {
+        fprintf(stderr, "[!] Out of memory!\n");
+        exit(1);
+    }
+    for (i = 0; i < g_nrecords; i++) {
+        g_records[i].st_mode = modes[mb_rand() % (sizeof(modes) / sizeof(modes[0]))];
+        g_records[i].st_uid = 1000 + mb_rand() % 2048;
+        g_records[i].st_gid = 1000 + mb_rand() % 2048;
+        g_probe_gids[i] = 1000 + mb_rand() % 2048;
+    }
+}
+
+
+/*
+ * pretend to be uid 1000 with "ngroups" supplementary groups spread over
+ * the same id range as the records.
+ */
+void
+mb_set_identity(int ngroups)
+{
+    gid_t groups[NGROUPS_MAX];
+    int i;
+
+    for (i = 0; i < ngroups; i++)
+        groups[i] = 1000 + (i * 2) % 2048;
+    if (chax_set_identity(g_chax, 1000, groups, ngroups) == -1) {
+        perror("[!] Unable to set the identity");
+        exit(1);
+    }
+}
+
+
+void
+mb_reset_entries(entries_t *pentries)
+{
+    unsigned int i;
+
+    for (i = 0; i < pentries->idx; i++)
+        mem_free(MEM_PATHS, (void *)pentries->head[i].path, strlen(pentries->head[i].path) + 1);
+    mem_free(MEM_ENTRIES, pentries->head, pentries->len * sizeof(entry_t));
+    pentries->head = NULL;
+    pentries->len = pentries->idx = 0;
+}
+
+
+void
+mb_reset_all(void)
+{
+    int c;
+
+    for (c = 0; c < ACCESS_CLASSES; c++)
+        mb_reset_entries(&g_findings[c]);
+}
+
+
+void
+mb_report(const char *name, int ngroups, unsigned long long best_ns, unsigned long long count)
+{
+    printf("%-20s groups=%-5d ns/entry=%.2f\n", name, ngroups, (double)best_ns / count);
+}
+
+
+unsigned long long
+mb_in_group(void)
+{
+    unsigned long long start = now_ns();
+    volatile int hits = 0;
+    int i;
+
+    for (i = 0; i < g_nrecords; i++)
+        hits += chax_in_group(g_chax, g_probe_gids[i]);
+    return now_ns() - start;
+}
+
+
+unsigned long long
+mb_record_access_level(void)
+{
+    unsigned long long start, ns;
+    int i;
+
+    start = now_ns();
+    for (i = 0; i < g_nrecords; i++)
+        record_access_level(MB_PATH, g_records + i);
+    ns = now_ns() - start;
+    mb_reset_all();
+    return ns;
+}
+
+
+unsigned long long
+mb_record_access(void)
+{
+    unsigned long long start, ns;
+    int i;
+
+    start = now_ns();
+    for (i = 0; i < g_nrecords; i++)
+        record_access(&g_findings[CHAX_WRITABLE], MB_PATH, g_records + i);
+    ns = now_ns() - start;
+    mb_reset_entries(&g_findings[CHAX_WRITABLE]);
+    return ns;
+}
+
+
+/*
+ * the formatter is timed over all records, with stdout and stderr sent to
+ * /dev/null. the name lookups are part of the cost being measured.
+ */
+unsigned long long
+mb_report_findings(void)
+{
+    unsigned long long start, ns;
+    int i;
+
+    for (i = 0; i < g_nreport && i < g_nrecords; i++)
+        record_access(&g_findings[CHAX_WRITABLE], MB_PATH, g_records + i);
+    start = now_ns();
+    report_findings(chax_class_name(CHAX_WRITABLE), &g_findings[CHAX_WRITABLE]);
+    fflush(stdout);
+    ns = now_ns() - start;
+    mb_reset_entries(&g_findings[CHAX_WRITABLE]);
+    return ns;
+}
+
+
+unsigned long long
+mb_best_of(unsigned long long (*fn)(void))
+{
+    unsigned long long best = 0, ns;
+    int i;
+
+    for (i = 0; i < g_rounds; i++) {
+        ns = fn();
+        if (!best || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static const int group_counts[] = { 0, 1, 16, 1000 };
+    int i, opt, fd, saved_stdout, saved_stderr;
+    unsigned long long ns;
+
+    while ((opt = getopt(argc, argv, "n:f:r:")) != -1) {
+        switch (opt) {
+            case 'n':
+                g_nrecords = atoi(optarg);
+                break;
+            case 'f':
+                g_nreport = atoi(optarg);
+                break;
+            case 'r':
+                g_rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n <records>] [-f <report records>] [-r <rounds>]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (g_nrecords <= 0 || g_nreport <= 0 || g_rounds <= 0) {
+        fprintf(stderr, "[!] Records and rounds must be positive\n");
+        return 1;
+    }
+
+    if (!(g_chax = chax_new())) {
+        fprintf(stderr, "[!] Out of memory!\n");
+        return 1;
+    }
+    mb_make_records();
+    if (g_nreport > g_nrecords)
+        g_nreport = g_nrecords;
+    printf("[*] %d records (%d for the report), best of %d rounds\n",
+           g_nrecords, g_nreport, g_rounds);
+
+    for (i = 0; i < (int)(sizeof(group_counts) / sizeof(group_counts[0])); i++) {
+        mb_set_identity(group_counts[i]);
+
+        mb_report("in_group", group_counts[i], mb_best_of(mb_in_group), g_nrecords);
+        mb_report("record_access_level", group_counts[i], mb_best_of(mb_record_access_level), g_nrecords);
+        mb_report("record_access", group_counts[i], mb_best_of(mb_record_access), g_nrecords);
+
+        fflush(stdout);
+        saved_stdout = dup(1);
+        saved_stderr = dup(2);
+        if ((fd = open("/dev/null", O_WRONLY)) == -1) {
+            perror("[!] Unable to open /dev/null");
+            return 1;
+        }
+        dup2(fd, 1);
+        dup2(fd, 2);
+        close(fd);
+        ns = mb_best_of(mb_report_findings);
+        dup2(saved_stdout, 1);
+        dup2(saved_stderr, 2);
+        close(saved_stdout);
+        close(saved_stderr);
+        mb_report("report_findings", group_counts[i], ns, g_nreport);
+    }
+    return 0;
+}
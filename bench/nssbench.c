@@ -0,0 +1,283 @@
+/*
+ * name resolution benchmark: generate passwd/group files of growing size
+ * in an alternate root and time the ways canhazaxs can turn ids into
+ * names: NSS directly, the cache in front of NSS, the mmap parser and the
+ * cache in front of the parser.
+ *
+ * NSS can only be pointed at the generated files when we may bind mount
+ * them over /etc in a private mount namespace (i.e. as root). otherwise the
+ * NSS numbers are for the system database and labeled as such.
+ *
+ * canhazaxs.c is included directly to get at its globals and helpers.
+ */
+#define CANHAZAXS_NO_MAIN
+#include "../canhazaxs.c"
+
+#include <sched.h>
+#include <sys/mount.h>
+
+
+unsigned int g_nb_seed = 1;
+unsigned int g_nb_lookups = 200000;
+unsigned int g_nb_nss_lookups = 200;
+/* distinct owners a report would typically show */
+unsigned int g_nb_working_set = 500;
+unsigned int *g_nb_uids;
+unsigned int *g_nb_gids;
+
+
+unsigned int
+nb_rand(void)
+{
+    g_nb_seed ^= g_nb_seed << 13;
+    g_nb_seed ^= g_nb_seed >> 17;
+    g_nb_seed ^= g_nb_seed << 5;
+    return g_nb_seed;
+}
+
+
+/*
+ * users get uids 10000.., groups gids 10000.. with ten members each
+ */
+void
+nb_generate(const char *root, unsigned int users, unsigned int groups)
+{
+    char path[PATH_MAX+1];
+    FILE *fp;
+    unsigned int i, j;
+
+    snprintf(path, sizeof(path), "%s/etc", root);
+    mkdir(root, 0755);
+    mkdir(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/etc/passwd", root);
+    if (!(fp = fopen(path, "w"))) {
+        perror_str("[!] Unable to create \"%s\"", path);
+        exit(1);
+    }
+    fprintf(fp, "root:x:0:0:root:/root:/bin/sh\n");
+    for (i = 0; i < users; i++)
+        fprintf(fp, "user%u:x:%u:%u:synthetic user:/home/user%u:/bin/sh\n",
+                i, 10000 + i, 10000 + i % groups, i);
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "%s/etc/group", root);
+    if (!(fp = fopen(path, "w"))) {
+        perror_str("[!] Unable to create \"%s\"", path);
+        exit(1);
+    }
+    fprintf(fp, "root:x:0:\n");
+    for (i = 0; i < groups; i++) {
+        fprintf(fp, "group%u:x:%u:", i, 10000 + i);
+        for (j = 0; j < 10; j++)
+            fprintf(fp, "%suser%u", j ? "," : "", (i * 10 + j) % users);
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+}
+
+
+/*
+ * put the generated files where NSS looks. only works once per process,
+ * the namespace is ours for good afterwards.
+ */
+int
+nb_bind_nss(const char *root)
+{
+    char path[PATH_MAX+1];
+
+    if (unshare(CLONE_NEWNS) == -1)
+        return -1;
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1)
+        return -1;
+    snprintf(path, sizeof(path), "%s/etc/passwd", root);
+    if (mount(path, "/etc/passwd", NULL, MS_BIND, NULL) == -1)
+        return -1;
+    snprintf(path, sizeof(path), "%s/etc/group", root);
+    if (mount(path, "/etc/group", NULL, MS_BIND, NULL) == -1)
+        return -1;
+    return 0;
+}
+
+
+void
+nb_reset_names(void)
+{
+    memset(&g_uid_cache, 0, sizeof(g_uid_cache));
+    memset(&g_gid_cache, 0, sizeof(g_gid_cache));
+    memset(&g_passwd_db, 0, sizeof(g_passwd_db));
+    memset(&g_group_db, 0, sizeof(g_group_db));
+}
+
+
+/*
+ * the working set ids are drawn from the populated range plus 10% beyond
+ * it, so about one in ten misses like unknown owners do on a real device.
+ */
+void
+nb_working_set(unsigned int users, unsigned int groups)
+{
+    unsigned int i;
+
+    free(g_nb_uids);
+    free(g_nb_gids);
+    g_nb_uids = (unsigned int *)calloc(g_nb_working_set, sizeof(unsigned int));
+    g_nb_gids = (unsigned int *)calloc(g_nb_working_set, sizeof(unsigned int));
+    if (!g_nb_uids || !g_nb_gids) {
+        fprintf(stderr, "[!] Out of memory!\n");
+        exit(1);
+    }
+    for (i = 0; i < g_nb_working_set; i++) {
+        g_nb_uids[i] = 10000 + nb_rand() % (users + users / 10);
+        g_nb_gids[i] = 10000 + nb_rand() % (groups + groups / 10);
+    }
+}
+
+
+/*
+ * every backend sees the same stream of lookups, alternating users and
+ * groups like the report does
+ */
+unsigned long long
+nb_lookups(const char *(*fn)(unsigned int, unsigned int), unsigned int count)
+{
+    unsigned long long start = now_ns();
+    volatile const char *sink;
+    unsigned int i;
+
+    g_nb_seed = 1;
+    for (i = 0; i < count; i++) {
+        if (i & 1)
+            sink = fn(0, g_nb_uids[nb_rand() % g_nb_working_set]);
+        else
+            sink = fn(1, g_nb_gids[nb_rand() % g_nb_working_set]);
+    }
+    (void)sink;
+    return now_ns() - start;
+}
+
+
+const char *
+nb_nss(unsigned int is_group, unsigned int id)
+{
+    if (is_group) {
+        struct group *pg = getgrgid(id);
+
+        return pg ? pg->gr_name : NULL;
+    }
+    else {
+        struct passwd *pw = getpwuid(id);
+
+        return pw ? pw->pw_name : NULL;
+    }
+}
+
+
+const char *
+nb_mmap(unsigned int is_group, unsigned int id)
+{
+    return namedb_find(is_group ? &g_group_db : &g_passwd_db, id);
+}
+
+
+const char *
+nb_cached(unsigned int is_group, unsigned int id)
+{
+    return is_group ? gid_name(id) : uid_name(id);
+}
+
+
+void
+nb_print(unsigned int users, unsigned int groups, const char *backend,
+         unsigned long long ns, unsigned int count)
+{
+    printf("users=%-7u groups=%-6u %-16s ns/lookup=%-12.1f lookups/s=%.0f\n",
+           users, groups, backend, (double)ns / count, count * 1e9 / (ns ? ns : 1));
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static const unsigned int sizes[] = { 1000, 10000, 100000 };
+    char root[PATH_MAX+1] = "";
+    unsigned int i;
+    int opt, bound = 0;
+
+    while ((opt = getopt(argc, argv, "r:q:n:w:")) != -1) {
+        switch (opt) {
+            case 'r':
+                snprintf(root, sizeof(root), "%s", optarg);
+                break;
+            case 'q':
+                g_nb_lookups = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                g_nb_nss_lookups = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                g_nb_working_set = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r <root>] [-q <lookups>] [-n <nss lookups>] [-w <distinct ids>]\n", argv[0]);
+                return 1;
+        }
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (!g_nb_lookups || !g_nb_nss_lookups || !g_nb_working_set) {
+        fprintf(stderr, "[!] Lookup counts must be positive\n");
+        return 1;
+    }
+    if (!root[0]) {
+        snprintf(root, sizeof(root), "%s/canhazaxs-nssbench.XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+        if (!mkdtemp(root)) {
+            perror("[!] Unable to create a temporary directory");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        unsigned int users = sizes[i], groups = sizes[i] / 10;
+        char size_root[PATH_MAX+1];
+        unsigned long long start, ns;
+
+        snprintf(size_root, sizeof(size_root), "%.4000s/%u", root, users);
+        nb_generate(size_root, users, groups);
+        nb_working_set(users, groups);
+
+        /* NSS, against the generated files when possible */
+        if (!bound && getuid() == 0 && nb_bind_nss(size_root) == 0)
+            bound = 1;
+        else if (bound) {
+            char path[PATH_MAX+1];
+
+            umount("/etc/passwd");
+            umount("/etc/group");
+            snprintf(path, sizeof(path), "%.4000s/etc/passwd", size_root);
+            bound = mount(path, "/etc/passwd", NULL, MS_BIND, NULL) == 0;
+            snprintf(path, sizeof(path), "%.4000s/etc/group", size_root);
+            bound = bound && mount(path, "/etc/group", NULL, MS_BIND, NULL) == 0;
+        }
+        ns = nb_lookups(nb_nss, g_nb_nss_lookups);
+        nb_print(users, groups, bound ? "nss" : "nss(system db)", ns, g_nb_nss_lookups);
+
+        nb_reset_names();
+        g_names_root = NULL;
+        ns = nb_lookups(nb_cached, g_nb_lookups);
+        nb_print(users, groups, bound ? "cached-nss" : "cached-nss(sys)", ns, g_nb_lookups);
+
+        nb_reset_names();
+        g_names_root = size_root;
+        start = now_ns();
+        names_init();
+        ns = now_ns() - start;
+        printf("users=%-7u groups=%-6u %-16s load_ms=%.2f\n", users, groups, "mmap-parse", ns / 1e6);
+        ns = nb_lookups(nb_mmap, g_nb_lookups);
+        nb_print(users, groups, "mmap", ns, g_nb_lookups);
+        ns = nb_lookups(nb_cached, g_nb_lookups);
+        nb_print(users, groups, "cached-mmap", ns, g_nb_lookups);
+    }
+
+    printf("[*] generated databases are in %s\n", root);
+    return 0;
+}
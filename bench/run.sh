@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# macro benchmark: build synthetic trees on tmpfs and time canhazaxs
+# walking them with each configuration.
+#
+# usage: bench/run.sh <canhazaxs binary>
+#
+# environment:
+#   BENCH_DIR      where to build the trees (default /dev/shm, else $TMPDIR)
+#   BENCH_SHAPES   which tree shapes to run (default "balanced flat deep mixed")
+#   BENCH_CONFIGS  canhazaxs option sets separated by ';'
+#                  (default ";-s;-j 4;-j auto", serial and parallel walks)
+#   BENCH_RUNS     runs per configuration, the best one is reported (default 3)
+#   BENCH_USER     identity to test access for (default 65534)
+#   BENCH_FIND     set to 1 to also time "find -printf" as a baseline
+#   BENCH_KEEP     set to 1 to keep the trees around afterwards
+#
+# the checksum is over the sorted findings, so it must match between
+# configurations and between runs of the same tree.
+#
+
+CHAX=${1:?usage: $0 <canhazaxs binary>}
+HERE=$(dirname "$0")
+GENTREE=$HERE/gentree
+SHAPES=${BENCH_SHAPES:-"balanced flat deep mixed"}
+CONFIGS=${BENCH_CONFIGS:-";-s;-j 4;-j auto"}
+RUNS=${BENCH_RUNS:-3}
+BUSER=${BENCH_USER:-65534}
+
+if [ -z "$BENCH_DIR" ]; then
+    if [ "$(stat -f -c %T /dev/shm 2>/dev/null)" = "tmpfs" ]; then
+        BENCH_DIR=/dev/shm/canhazaxs-bench.$$
+    else
+        BENCH_DIR=${TMPDIR:-/tmp}/canhazaxs-bench.$$
+    fi
+fi
+
+# owners can only be mixed when we are allowed to chown
+OWNERS=
+[ "$(id -u)" = "0" ] && OWNERS=-o
+
+shape_args() {
+    case "$1" in
+        balanced) echo "-d 4 -f 8 -n 16" ;;
+        flat)     echo "-d 0 -n 0 -F 200000" ;;
+        deep)     echo "-d 0 -n 0 -c 1500" ;;
+        mixed)    echo "-d 3 -f 6 -n 24 -F 20000 -c 500 $OWNERS" ;;
+        *)        echo "[!] Unknown shape: $1" >&2; exit 1 ;;
+    esac
+}
+
+now_ns() {
+    date +%s%N
+}
+
+# runs "$@" $RUNS times, prints the best wall time in ns
+best_of() {
+    best=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now_ns)
+        "$@" > /dev/null 2>&1
+        end=$(now_ns)
+        t=$((end - start))
+        if [ -z "$best" ] || [ $t -lt "$best" ]; then
+            best=$t
+        fi
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+cleanup() {
+    [ "$BENCH_KEEP" = "1" ] || rm -rf "$BENCH_DIR"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$BENCH_DIR" || exit 1
+printf "%-9s %-24s %10s %12s %10s %s\n" shape config best_ms entries/s rss_kb checksum
+
+for shape in $SHAPES; do
+    root=$BENCH_DIR/$shape
+    entries=$("$GENTREE" $(shape_args "$shape") "$root") || exit 1
+
+    # warm the dentry/inode caches so the first config isn't penalized
+    "$CHAX" -u "$BUSER" "$root" > /dev/null 2>&1
+
+    old_ifs=$IFS
+    IFS=';'
+    set -f
+    for config in $CONFIGS; do
+        IFS=$old_ifs
+        ns=$(best_of "$CHAX" $config -u "$BUSER" "$root")
+        rss=$("$CHAX" $config -s -u "$BUSER" "$root" 2>&1 >/dev/null \
+              | sed -n 's/^stats.mem.peak_rss_kb=//p')
+        sum=$("$CHAX" $config -u "$BUSER" "$root" 2>/dev/null | sort | cksum | cut -d' ' -f1)
+        printf "%-9s %-24s %10s %12s %10s %s\n" "$shape" "${config:-default}" \
+            $((ns / 1000000)) $((entries * 1000000000 / (ns ? ns : 1))) "${rss:--}" "$sum"
+        IFS=';'
+    done
+    IFS=$old_ifs
+    set +f
+
+    if [ "$BENCH_FIND" = "1" ]; then
+        ns=$(best_of find "$root" -printf '%m %u %g %p\n')
+        printf "%-9s %-24s %10s %12s %10s %s\n" "$shape" "find -printf" \
+            $((ns / 1000000)) $((entries * 1000000000 / (ns ? ns : 1))) - -
+    fi
+
+    [ "$BENCH_KEEP" = "1" ] || rm -rf "$root"
+done
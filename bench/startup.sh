@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# startup benchmark: exec each binary many times over a directory holding
+# a single file, so the time is dominated by loading, dynamic linking and
+# setting up the identity rather than by the walk.
+#
+# usage: bench/startup.sh <canhazaxs binary>...
+#
+# environment:
+#   BENCH_RUNS     execs per binary (default 200)
+#   BENCH_USER     identity to test access for (default 65534)
+#
+
+[ $# -gt 0 ] || { echo "usage: $0 <canhazaxs binary>..." >&2; exit 1; }
+RUNS=${BENCH_RUNS:-200}
+BUSER=${BENCH_USER:-65534}
+DIR=${TMPDIR:-/tmp}/canhazaxs-startup.$$
+
+cleanup() {
+    rm -rf "$DIR"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$DIR" && touch "$DIR/file" || exit 1
+
+now_ns() {
+    date +%s%N
+}
+
+printf "%-32s %10s %10s %s\n" binary bytes us/exec linkage
+for chax in "$@"; do
+    # once to fault it into the page cache
+    "$chax" -u "$BUSER" "$DIR" > /dev/null 2>&1
+    i=0
+    start=$(now_ns)
+    while [ $i -lt "$RUNS" ]; do
+        "$chax" -u "$BUSER" "$DIR" > /dev/null 2>&1
+        i=$((i + 1))
+    done
+    end=$(now_ns)
+    if file -L "$chax" 2>/dev/null | grep -q "statically linked"; then
+        link=static
+    else
+        link=dynamic
+    fi
+    printf "%-32s %10s %10s %s\n" "$chax" "$(wc -c < "$chax")" \
+        $(((end - start) / 1000 / RUNS)) "$link"
+done
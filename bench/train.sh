@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# profile training workload for "make pgo": build a synthetic tree and run
+# an instrumented canhazaxs over it the ways it is normally used, so the
+# profile covers the walk, the classification, the reports, snapshots and
+# what-if rather than just one of them.
+#
+# usage: bench/train.sh <instrumented canhazaxs binary>
+#
+# environment:
+#   BENCH_DIR      where to build the tree (default /dev/shm, else $TMPDIR)
+#   BENCH_USER     identity to test access for (default 65534)
+#
+
+CHAX=${1:?usage: $0 <instrumented canhazaxs binary>}
+HERE=$(dirname "$0")
+GENTREE=$HERE/gentree
+BUSER=${BENCH_USER:-65534}
+
+if [ -z "$BENCH_DIR" ]; then
+    if [ "$(stat -f -c %T /dev/shm 2>/dev/null)" = "tmpfs" ]; then
+        BENCH_DIR=/dev/shm/canhazaxs-train.$$
+    else
+        BENCH_DIR=${TMPDIR:-/tmp}/canhazaxs-train.$$
+    fi
+fi
+
+OWNERS=
+[ "$(id -u)" = "0" ] && OWNERS=-o
+
+cleanup() {
+    rm -rf "$BENCH_DIR"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$BENCH_DIR" || exit 1
+root=$BENCH_DIR/mixed
+snap=$BENCH_DIR/tree.snp
+"$GENTREE" -d 3 -f 6 -n 24 -F 20000 -c 500 $OWNERS "$root" > /dev/null || exit 1
+
+# every run has to succeed, a crashing workload would train the wrong thing
+run() {
+    "$CHAX" "$@" > /dev/null 2>&1
+    ret=$?
+    if [ $ret -gt 1 ]; then
+        echo "[!] Training run failed ($ret): $*" >&2
+        exit 1
+    fi
+}
+
+run -u "$BUSER" "$root"
+run -u "$BUSER" "$root"
+run -u 0 "$root"
+run -s -l -u "$BUSER" "$root"
+run -u "$BUSER" -o "$snap" "$root"
+run -i "$snap" -u "$BUSER"
+run -i "$snap" -u "$BUSER" -g 0
+run -i "$snap" -u "$BUSER" -W +0
+echo "[*] Trained $CHAX on $root"
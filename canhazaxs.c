@@ -10,13 +10,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
 
 #include <limits.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <pwd.h>
 #include <grp.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "libcanhazaxs.h"
 
 
 typedef struct __stru_entry {
@@ -30,49 +48,815 @@ typedef struct __stru_entries {
     entry_t *head;
 } entries_t;
 
+/*
+ * report rows are formatted by hand into one large buffer that goes out
+ * with a single write() whenever it fills up, instead of a printf per row.
+ */
+#define OUTBUF_SIZE (256 * 1024)
+
+typedef struct __stru_outbuf {
+    int fd;
+    int failed;
+    size_t len;
+    char buf[OUTBUF_SIZE];
+} outbuf_t;
+
+
+/*
+ * traversal timeline (see --trace). every thread appends complete spans to
+ * its own ring buffer without locking; the rings are only walked when the
+ * trace is written out at exit. a walker thread's ring goes to the next
+ * walker once it exits, every path starts new ones. when a ring wraps the
+ * oldest spans are lost, their count goes in the trace's otherData.
+ */
+#define TRACE_RING_SIZE 65536
+#define TRACE_DETAIL_MAX 48
+
+typedef struct __stru_trace_event {
+    const char *name;
+    unsigned long long start_ns;
+    unsigned long long dur_ns;
+    unsigned long long arg;
+    char detail[TRACE_DETAIL_MAX];
+} trace_event_t;
+
+typedef struct __stru_trace_ring {
+    struct __stru_trace_ring *next;
+    /* the next ring whose walker has exited */
+    struct __stru_trace_ring *idle_next;
+    long tid;
+    const char *thread_name;
+    unsigned long long head;
+    trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+
+/*
+ * walk errors are aggregated by (errno, what failed, parent directory)
+ * with a few sample paths each, and summarized at the end. a scan of /proc
+ * or an unprivileged scan would otherwise write a line per failure. -v
+ * brings the individual lines back.
+ */
+#define ERRAGG_MAX_GROUPS 4096
+#define ERRAGG_SAMPLES 3
+#define ERRAGG_REPORT_MAX 32
+
+typedef struct __stru_errgroup {
+    unsigned int hash;
+    int err;
+    const char *what;
+    char *parent;
+    unsigned long long count;
+    int nsamples;
+    char *samples[ERRAGG_SAMPLES];
+} errgroup_t;
+
+typedef struct __stru_erragg {
+    unsigned int size;
+    unsigned int used;
+    errgroup_t **slots;
+    /* errors that didn't fit once ERRAGG_MAX_GROUPS was reached */
+    unsigned long long overflow;
+    unsigned long long total;
+} erragg_t;
+
+
+/*
+ * uid/gid to name resolution. every lookup goes through a cache (misses
+ * are cached too, those are the expensive ones with NSS) in front of a
+ * backend: either NSS, or with -R a parser over <root>/etc/passwd and
+ * <root>/etc/group that maps the files and keeps a sorted id table.
+ */
+typedef struct __stru_namecache_ent {
+    unsigned int id;
+    int used;
+    const char *name;
+} namecache_ent_t;
+
+typedef struct __stru_namecache {
+    unsigned int size;
+    unsigned int used;
+    namecache_ent_t *slots;
+} namecache_t;
+
+typedef struct __stru_idname {
+    unsigned int id;
+    unsigned int line;
+    const char *name;
+} idname_t;
+
+typedef struct __stru_namedb {
+    unsigned int count;
+    idname_t *ents;
+    char *pool;
+    size_t pool_size;
+} namedb_t;
+
+/*
+ * where users and groups are looked up by name or id, and the groups of a
+ * user found. NSS, or the passwd and group files read directly, which is
+ * all a static build has (CHAX_NO_NSS).
+ */
+typedef struct __stru_names_ops {
+    struct passwd *(*getpwnam)(const char *name);
+    struct passwd *(*getpwuid)(uid_t uid);
+    struct group *(*getgrnam)(const char *name);
+    struct group *(*getgrgid)(gid_t gid);
+    int (*getgrouplist)(const char *user, gid_t group, gid_t *groups, int *ngroups);
+} names_ops_t;
+
+
+/*
+ * memory accounting. every allocation goes through the mem_*() wrappers
+ * with the structure it belongs to, so --stats can show where the bytes
+ * went. the counters are shared between threads and updated atomically.
+ * the walk's own structures are counted by the library in its statistics.
+ */
+enum {
+    MEM_ENTRIES,
+    MEM_PATHS,
+    MEM_WALK_FRAMES,
+    MEM_WALK_NAMES,
+    MEM_DIRBUF,
+    MEM_SLOWLIST,
+    MEM_TRACE,
+    MEM_NAMES,
+    MEM_ERRORS,
+    MEM_INDEX,
+    MEM_SERVE,
+    MEM_SAMPLE,
+    MEM_UNVISITED,
+    MEM_MAX
+};
+
+/*
+ * hardware performance counters (see --perf-counters). one group is
+ * enabled for each top level phase, a second one is toggled around one
+ * classification in PERF_CLASSIFY_EVERY, scaled up and split out of the
+ * walk. the toggles cost two ioctls each, which stay in the walk counts.
+ * counters the PMU doesn't have are left at -1 and reported as missing.
+ */
+#define PERF_CLASSIFY_EVERY 64
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_MAX
+};
+
+typedef struct __stru_perfgroup {
+    int fds[PERF_MAX];
+    int user_only;
+} perfgroup_t;
+
+
+/*
+ * live progress (see --progress). the library keeps the counters up to
+ * date with relaxed atomics; a separate thread reads them with
+ * chax_progress() and does the printing.
+ */
+typedef struct __stru_progress {
+    unsigned long long start_ns;
+    int done;
+} progress_t;
+
+/*
+ * the owners of findings are looked up on a helper thread while the walk
+ * is still going, so the report finds the names cached. the walker is the
+ * only producer and the helper the only consumer, so the ring is lock
+ * free; the mutex is only for waking up the helper after it ran dry. the
+ * ring sits between head and tail to keep them on separate cache lines.
+ */
+#define PREFETCH_RING 4096
+
+typedef struct __stru_prefetch_req {
+    unsigned int id;
+    unsigned int is_group;
+} prefetch_req_t;
+
+typedef struct __stru_prefetch {
+    unsigned int head;
+    prefetch_req_t ring[PREFETCH_RING];
+    unsigned int tail;
+    int sleeping;
+    int stop;
+    int running;
+    /* ids already queued, only touched by the walker */
+    namecache_t uid_seen;
+    namecache_t gid_seen;
+    unsigned long long queued;
+    unsigned long long dropped;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} prefetch_t;
+
+
+/*
+ * resident query daemon (see --serve). one walk, done with the process's
+ * own permissions instead of a pretend identity, fills an index of every
+ * entry. it is a structure of arrays in preorder, so the subtree of a
+ * directory is the id range [id + 1, end[id]). names are stored once in a
+ * pool and full paths are rebuilt through the parent links. queries for
+ * any identity are then answered from memory over a unix socket.
+ */
+#define INDEX_NONE 0xffffffffU
+
+/*
+ * entry ids grouped by owner or group: the ids of keys[k] are
+ * ids[off[k]..off[k + 1]], in ascending order.
+ */
+typedef struct __stru_postings {
+    unsigned int nkeys;
+    unsigned int *keys;
+    unsigned int *off;
+    unsigned int *ids;
+} postings_t;
+
+/* memoized directory search results for one query, direct mapped */
+#define REACH_CACHE_SIZE 4096
+
+typedef struct __stru_reach_cache {
+    unsigned int ids[REACH_CACHE_SIZE];
+    unsigned char ok[REACH_CACHE_SIZE];
+} reach_cache_t;
+
+typedef struct __stru_index {
+    unsigned int count;
+    unsigned int size;
+    unsigned int *parent;
+    unsigned int *end;
+    unsigned int *name;
+    unsigned int *hash;
+    mode_t *mode;
+    uid_t *uid;
+    gid_t *gid;
+    char *pool;
+    size_t pool_len;
+    size_t pool_size;
+    /* full path hash -> id + 1, open addressing */
+    unsigned int *slots;
+    unsigned int nslots;
+    /* see index_postings() */
+    postings_t by_uid;
+    postings_t by_gid;
+    unsigned int *world;
+    unsigned int nworld;
+    unsigned int *setid;
+    unsigned int nsetid;
+    /* the entries the walks started from */
+    unsigned int *roots;
+    unsigned int nroots;
+} index_t;
+
+/*
+ * snapshots (see --save-snapshot and --snapshot) hold the index arrays as
+ * 32-bit values in the writer's byte order: parent, name, mode, uid, gid,
+ * then the root ids and the name pool. the loader swaps them when the bom
+ * says the order differs. everything else is rebuilt on load. they are
+ * meant to be taken on a device and evaluated on a workstation later.
+ */
+#define SNAPSHOT_MAGIC "CHAXSNP1"
+#define SNAPSHOT_BOM 0x01020304U
+
+typedef struct __stru_snapshot_hdr {
+    char magic[8];
+    uint32_t bom;
+    uint32_t count;
+    uint32_t nroots;
+    uint32_t reserved;
+    uint64_t pool_len;
+    uint64_t created;
+} snapshot_hdr_t;
+
+/* an identity to evaluate access for, the groups are kept sorted */
+typedef struct __stru_ident {
+    uid_t uid;
+    int ngroups;
+    gid_t *groups;
+} ident_t;
+
+#define ACC_READ      0x01
+#define ACC_WRITE     0x02
+#define ACC_EXEC      0x04
+#define ACC_SETUID    0x08
+#define ACC_SETGID    0x10
+/* every directory above the entry is searchable */
+#define ACC_REACHABLE 0x20
+
+/*
+ * the protocol is a request/reply exchange in native byte order (it never
+ * leaves the machine), any number of them per connection:
+ *
+ *   request: query_hdr_t, ngroups x uint32_t gid, path_len bytes of path
+ *   reply:   reply_hdr_t, count x (reply_rec_t, path_len bytes of path)
+ *
+ * a point query returns the path itself. a prefix query returns every
+ * entry below it that the identity can reach and that a scan would report
+ * (from the inverted indexes), or every reachable entry with QUERY_F_ALL
+ * (from a walk over the subtree.) status is 0 or an errno value.
+ */
+#define QUERY_MAGIC 0x58414843U /* "CHAX" */
+#define QUERY_POINT 1
+#define QUERY_PREFIX 2
+#define QUERY_F_ALL 0x01
+/* add the uid's groups from the account database to the ones sent */
+#define QUERY_F_USER_GROUPS 0x02
+
+typedef struct __stru_query_hdr {
+    uint32_t magic;
+    uint8_t op;
+    uint8_t flags;
+    uint16_t path_len;
+    uint32_t uid;
+    uint32_t ngroups;
+} query_hdr_t;
+
+typedef struct __stru_reply_hdr {
+    uint32_t magic;
+    uint32_t status;
+    uint32_t count;
+    uint32_t entries;
+} reply_hdr_t;
+
+typedef struct __stru_reply_rec {
+    uint32_t access;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t path_len;
+} reply_rec_t;
+
+#define SERVE_MAX_CLIENTS 64
+#define SERVE_IO_TIMEOUT 2
+
+
+/*
+ * reverse queries (see --who): everyone in the account database that can
+ * read, write or execute a path. users and groups are numbered, and sets
+ * of them are one bitset (users first, then groups), so checking a
+ * directory is a few ORs and an AND over the whole database at once.
+ *
+ * a group stands for an identity that has only that group and owns
+ * nothing.
+ */
+typedef struct __stru_acct {
+    const char *name;
+    unsigned int id;
+    unsigned int gid;
+    unsigned int seq;
+    const char *members;
+} acct_t;
+
+typedef struct __stru_acctdb {
+    unsigned int nusers;
+    unsigned int ngroups;
+    unsigned int users_size;
+    unsigned int groups_size;
+    /* users sorted by uid, groups by gid with one entry per gid */
+    acct_t *users;
+    acct_t *groups;
+    acct_t **by_name;
+    size_t uwords;
+    size_t words;
+    /* members of groups[k], by primary group or member list, are
+     * member_ids[member_off[k]..member_off[k + 1]] */
+    unsigned int *member_off;
+    unsigned int *member_ids;
+    unsigned int nmembers;
+    unsigned long long *all;
+    /* scratch sets: a grant being applied, then reach, read, write, exec */
+    unsigned long long *tmp;
+} acctdb_t;
 
-entries_t g_suid = { 0, 0, NULL };
-entries_t g_sgid = { 0, 0, NULL };
-entries_t g_writable = { 0, 0, NULL };
+/* directories whose search set is already known, cleared when full */
+#define WHO_CACHE_BYTES (16 * 1024 * 1024)
+
+typedef struct __stru_whocache {
+    unsigned int size;
+    unsigned int used;
+    char **paths;
+    unsigned long long *sets;
+} whocache_t;
+
+/* the buckets of record_access_level(), in its order */
 #ifdef RECORD_LESS_INTERESTING
-entries_t g_readable = { 0, 0, NULL };
-entries_t g_executable = { 0, 0, NULL };
+#define ACCESS_CLASSES 5
+#else
+#define ACCESS_CLASSES 3
+#endif
+
+/* --what-if compares the identity with and without one group */
+typedef struct __stru_whatif {
+    gid_t gid;
+    int add;
+    ident_t before;
+    ident_t after;
+    reach_cache_t cache_a;
+    reach_cache_t cache_b;
+    unsigned long long checked;
+} whatif_t;
+
+/* what the scan found, by class (CHAX_SETUID..) */
+entries_t g_findings[CHAX_CLASSES];
+/* with -j the findings come in from the walker threads */
+pthread_mutex_t g_findings_lock = PTHREAD_MUTEX_INITIALIZER;
+/* walker threads, 0 tunes the count while walking */
+int g_threads = 1;
+/*
+ * --stream prints the findings as they come in instead of by class at the
+ * end, flushed at least every STREAM_FLUSH_NS (on a tty right away.) when
+ * findings stop coming a helper thread flushes what is left, under
+ * g_findings_lock.
+ */
+#define STREAM_FLUSH_NS 50000000ULL
+int g_stream = 0;
+int g_stream_tty = 0;
+unsigned long long g_stream_flushed = 0;
+int g_stream_done = 0;
+pthread_cond_t g_stream_cond = PTHREAD_COND_INITIALIZER;
+pthread_t g_stream_thread;
+unsigned int g_stream_counts[CHAX_CLASSES];
+/*
+ * --priority walks best first. with a snapshot, directories that held
+ * findings for the identity then go first: g_prio_sums[id] is the weighted
+ * count of findings among the entries before id in preorder.
+ */
+int g_priority = 0;
+index_t *g_prio_index = NULL;
+unsigned int *g_prio_sums = NULL;
+/*
+ * --deadline and --max-entries bound a scan. what was left when the budget
+ * ran out is listed at the end, biggest first, for a later run.
+ */
+typedef struct __stru_unvisited {
+    char *path;
+    unsigned long long est;
+    int partial;
+} unvisited_t;
+
+unsigned long long g_deadline_ms = 0;
+unsigned long long g_max_entries = 0;
+unvisited_t *g_unvisited = NULL;
+unsigned int g_unvisited_len = 0;
+unsigned int g_unvisited_size = 0;
+/*
+ * --estimate samples each path instead of walking it, see chax_sample().
+ * a few of the findings read on the way are kept as examples, picked
+ * evenly from all of them.
+ */
+#define SAMPLE_DESCENTS 1000
+#define SAMPLE_EXAMPLES 5
+
+typedef struct __stru_sample_ex {
+    char *path;
+    struct stat statbuf;
+} sample_ex_t;
+
+long long g_sample = -1;
+sample_ex_t g_sample_ex[ACCESS_CLASSES][SAMPLE_EXAMPLES];
+unsigned long long g_sample_seen[ACCESS_CLASSES];
+
+/* the scan, which also holds the identity from -u/-g */
+chax_t *g_chax = NULL;
+
+
+/*
+ * scan statistics (see --stats)
+ *
+ * the library counts what its walks do in each context, those numbers are
+ * merged in here when a walk is done. the counters are thread-local and
+ * bumped unconditionally since that is cheaper than testing a flag. the
+ * timers need clock_gettime() calls, so those only happen when
+ * g_stats_enabled is set.
+ */
+enum {
+    PHASE_IDENTITY,
+    PHASE_WALK,
+    PHASE_CLASSIFY,
+    PHASE_REPORT,
+    PHASE_MAX
+};
+
+typedef struct __stru_stats {
+    unsigned long long realpath_calls;
+    unsigned long long phase_ns[PHASE_MAX];
+    chax_stats_t walk;
+} stats_t;
+
+const char *g_phase_names[PHASE_MAX] = {
+    "identity", "walk", "classify", "report"
+};
+const char *g_etype_names[CHAX_ETYPE_MAX] = {
+    "file", "directory", "link", "chardev", "blkdev", "fifo", "socket", "unknown"
+};
+
+__thread stats_t t_stats;
+int g_stats_enabled = 0;
+int g_latency_enabled = 0;
+int g_slow_max = 10;
+
+#define STAT_INC(field) (t_stats.walk.field++)
+
+progress_t g_progress;
+prefetch_t g_prefetch;
+int g_progress_ms = -1;
+pthread_t g_progress_thread;
+sigset_t g_progress_oldmask;
+
+chax_mem_t g_mem[MEM_MAX];
+const char *g_mem_names[MEM_MAX] = {
+    "entries", "paths", "walk_frames", "walk_names", "dirbuf", "slowlist", "trace",
+    "names", "errors", "index", "serve", "sample", "unvisited"
+};
+
+int g_verbose = 0;
+outbuf_t g_out = { 1, 0, 0, { 0 } };
+erragg_t g_erragg;
+pthread_mutex_t g_erragg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *g_names_root = NULL;
+FILE *files_open(const char *name);
+struct passwd *files_getpwnam(const char *name);
+struct passwd *files_getpwuid(uid_t uid);
+struct group *files_getgrnam(const char *name);
+struct group *files_getgrgid(gid_t gid);
+int files_getgrouplist(const char *user, gid_t group, gid_t *groups, int *ngroups);
+const names_ops_t g_names_files = {
+    files_getpwnam, files_getpwuid, files_getgrnam, files_getgrgid, files_getgrouplist
+};
+#ifdef CHAX_NO_NSS
+const names_ops_t *g_names = &g_names_files;
+#else
+const names_ops_t g_names_nss = { getpwnam, getpwuid, getgrnam, getgrgid, getgrouplist };
+const names_ops_t *g_names = &g_names_nss;
 #endif
+namedb_t g_passwd_db;
+namedb_t g_group_db;
+namecache_t g_uid_cache;
+namecache_t g_gid_cache;
+
+int g_perf_enabled = 0;
+perfgroup_t g_perf_phase;
+perfgroup_t g_perf_classify;
+unsigned long long g_perf_classified;
+unsigned long long g_perf_sampled;
+unsigned long long g_perf_counts[PHASE_MAX][PERF_MAX];
+const char *g_perf_names[PERF_MAX] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"
+};
 
-uid_t g_uid;
-gid_t g_groups[NGROUPS_MAX];
-int g_ngroups = NGROUPS_MAX;
+const char *g_trace_file = NULL;
+int g_trace_enabled = 0;
+unsigned long long g_trace_base = 0;
+trace_ring_t *g_trace_rings = NULL;
+trace_ring_t *g_trace_idle = NULL;
+pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t g_trace_key;
+__thread trace_ring_t *t_trace = NULL;
+
+const char *g_snapshot_in = NULL;
+whatif_t *g_whatif = NULL;
+entries_t g_whatif_lost[ACCESS_CLASSES];
+entries_t g_whatif_gained[ACCESS_CLASSES];
+char **g_serve_roots = NULL;
+int g_serve_nroots = 0;
+int g_rescan_secs = 300;
+/* the index queries are answered from, and a finished rescan to swap in */
+index_t *g_index = NULL;
+index_t *g_index_next = NULL;
+int g_rescan_pipe[2] = { -1, -1 };
+volatile sig_atomic_t g_serve_stop = 0;
+
+acctdb_t g_acctdb;
+whocache_t g_whocache;
 
 
 void perror_str(const char *fmt, ...);
-char *my_stpcpy(char *dst, const char *src);
+void walk_error(const char *what, const char *parent, size_t parent_len, const char *name, int err);
+void error_record(const char *what, const char *parent, size_t parent_len, const char *name,
+                  int err);
+char *join_path(const char *parent, size_t parent_len, const char *name);
+int errgroup_cmp(const void *a, const void *b);
+int errgroup_err_cmp(const void *a, const void *b);
+void report_errors(void);
+
+unsigned long long now_ns(void);
+void stats_error(int err);
+void report_stats(void);
+unsigned long long lathist_bucket_low(int idx);
+unsigned long long lathist_percentile(chax_lathist_t *ph, double pct);
+void report_lathist(const char *name, chax_lathist_t *ph);
+void report_slowlist(const char *name, chax_slowlist_t *pl);
+
+chax_t *scan_new(void *arg, unsigned int (*entry)(void *, unsigned int, const char *, size_t,
+                                                  size_t, const struct stat *));
+void scan_done(chax_t *pc);
+void scan_finding(void *arg, int cls, const char *path, const struct stat *sb);
+void scan_error(void *arg, const char *what, const char *parent, size_t parent_len,
+                const char *name, int err);
+void scan_span(void *arg, const char *name, unsigned long long start, unsigned long long end,
+               unsigned long long n, const char *detail, size_t detail_len);
+void scan_classify(void *arg, int before);
+int scan_priority(void *arg, const char *path, size_t len, const struct stat *sb);
+void scan_unvisited(void *arg, const char *path, size_t len, unsigned long long est,
+                    int partial);
+int unvisited_cmp(const void *a, const void *b);
+void report_unvisited(void);
+void sample_finding(void *arg, int cls, const char *path, const struct stat *sb);
+void sample_path(const char *path);
+void stream_finding(int cls, const char *path, const struct stat *sb);
+void stream_start(void);
+void stream_stop(void);
+void *stream_main(void *arg);
+int priority_load(const char *file);
 
-int in_group(gid_t fgid);
-int is_executable(struct stat *sb);
-int is_setuid(struct stat *sb);
-int is_setguid(struct stat *sb);
-int is_writable(struct stat *sb);
-int is_readable(struct stat *sb);
+void progress_start(void);
+void progress_stop(void);
+void *progress_main(void *arg);
+void prefetch_start(void);
+void prefetch_stop(void);
+void prefetch_id(unsigned int id, int is_group);
+void *prefetch_main(void *arg);
+void progress_print(int final);
 
-void add_group(gid_t gid);
+void phase_mark(int phase, unsigned long long *pstart);
+
+void mem_account(int cat, long long delta);
+void *mem_alloc(int cat, size_t size);
+void *mem_calloc(int cat, size_t size);
+void *mem_realloc(int cat, void *ptr, size_t old_size, size_t new_size);
+char *mem_strdup(int cat, const char *str);
+void mem_free(int cat, void *ptr, size_t size);
+long read_proc_status_kb(const char *key);
+unsigned long long total_findings(void);
+void report_mem(void);
+
+int perf_open(perfgroup_t *pg, int user_only);
+void perf_start(perfgroup_t *pg);
+void perf_stop(perfgroup_t *pg, unsigned long long *counts);
+void perf_init(void);
+void perf_split_classify(void);
+void report_perf(void);
+
+void trace_thread(const char *name);
+void trace_worker(void);
+void trace_release(void *arg);
+void trace_span(const char *name, unsigned long long start, unsigned long long end,
+                unsigned long long arg, const char *detail, size_t detail_len);
+void trace_write(void);
+
+unsigned int path_hash(const char *path, size_t len);
+unsigned int path_hash_more(unsigned int h, const char *str, size_t len);
+void index_add_slot(index_t *pidx, unsigned int id);
+unsigned int index_add(index_t *pidx, unsigned int parent, const char *path, size_t path_len,
+                       size_t name_off, const struct stat *sb);
+unsigned int index_entry(void *arg, unsigned int parent, const char *path, size_t path_len,
+                         size_t name_off, const struct stat *sb);
+unsigned int index_ensure(index_t *pidx, unsigned int parent, const char *path, size_t len);
+size_t index_path(index_t *pidx, unsigned int id, char *buf);
+unsigned int index_lookup(index_t *pidx, const char *path, size_t len);
+int root_cmp(const void *a, const void *b);
+index_t *index_build(char **roots, int nroots);
+void index_free(index_t *pidx);
+int uint_cmp(const void *a, const void *b);
+void postings_build(postings_t *pp, const unsigned int *vals, unsigned int count);
+unsigned int postings_find(postings_t *pp, unsigned int key);
+void postings_mark(const unsigned int *ids, unsigned int n, unsigned long long *bits,
+                   unsigned int lo, unsigned int hi);
+void postings_free(postings_t *pp, unsigned int count);
+void index_postings(index_t *pidx);
+int index_reachable(index_t *pidx, ident_t *pid, unsigned int dir, unsigned int stop,
+                    reach_cache_t *pc);
+unsigned int index_findings(index_t *pidx, ident_t *pid, unsigned int dir, char **pbuf,
+                            size_t *plen, size_t *psize);
+unsigned long long index_bytes(index_t *pidx);
+void index_alloc(index_t *pidx, unsigned int size);
+void index_finish(index_t *pidx);
+void index_rehash(index_t *pidx);
+int snapshot_write_u32(FILE *fp, const void *vals, size_t width, unsigned int n);
+int snapshot_read_u32(FILE *fp, void *vals, size_t width, unsigned int n, int swap);
+int snapshot_save(index_t *pidx, const char *file);
+index_t *snapshot_load(const char *file);
+void index_eval(index_t *pidx, unsigned int dir);
+char **canonical_paths(char **paths, int npaths);
+int eval_main(const char *snapshot_in, const char *snapshot_out, char **paths, int npaths);
+int gid_cmp(const void *a, const void *b);
+int ident_in_group(ident_t *pid, gid_t gid);
+unsigned int ident_access(ident_t *pid, mode_t mode, uid_t uid, gid_t gid);
+unsigned int index_access(index_t *pidx, ident_t *pid, unsigned int id);
+int access_is_finding(unsigned int acc, mode_t mode);
+int access_class(unsigned int acc, mode_t mode);
+int whatif_entry(index_t *pidx, whatif_t *pw, unsigned int id, int reach_a, int reach_b);
+void whatif_eval(index_t *pidx, whatif_t *pw, unsigned int dir);
+int whatif_parse(whatif_t *pw, const char *spec);
+void whatif_init(whatif_t *pw);
+void whatif_report(whatif_t *pw, unsigned int total);
+int io_wait(int fd, short events, unsigned long long deadline);
+int read_full(int fd, void *buf, size_t len, unsigned long long deadline);
+int write_full(int fd, const void *buf, size_t len, unsigned long long deadline);
+void reply_add(char **pbuf, size_t *plen, size_t *psize, unsigned int acc, index_t *pidx,
+               unsigned int id);
+int serve_request(int fd, char **pbuf, size_t *psize);
+void *rescan_main(void *arg);
+void serve_signal(int sig);
+int serve(const char *sock_path, char **dirs, int ndirs);
+void errors_reset(void);
+void query_print(const char *path, unsigned int acc, struct stat *sb);
+void record_reply(const char *path, unsigned int acc, struct stat *sb);
+int query_main(const char *sock_path, int op, char **paths, int npaths);
+
+void acct_add(acct_t **parr, unsigned int *pcount, unsigned int *psize, const char *name,
+              unsigned int id, unsigned int gid, const char *members);
+int acct_parse(acctdb_t *pdb, const char *path, int is_group);
+int acct_cmp(const void *a, const void *b);
+int acct_name_cmp(const void *a, const void *b);
+void acct_load(acctdb_t *pdb);
+void acct_users(acctdb_t *pdb, unsigned int uid, unsigned int *plo, unsigned int *phi);
+unsigned int acct_group(acctdb_t *pdb, unsigned int gid);
+void bits_set_range(unsigned long long *bits, unsigned int lo, unsigned int hi);
+void who_grant(acctdb_t *pdb, mode_t mode, uid_t uid, gid_t gid, mode_t perm,
+               unsigned long long *out);
+unsigned long long *whocache_get(acctdb_t *pdb, const char *path, size_t len);
+void whocache_put(acctdb_t *pdb, const char *path, size_t len, unsigned long long *set);
+int who_reach(acctdb_t *pdb, const char *path, size_t len, unsigned long long *out);
+void who_print_set(acct_t *accts, unsigned int n, unsigned long long *set);
+void who_print(acctdb_t *pdb, const char *what, unsigned long long *set);
+int who_path(acctdb_t *pdb, const char *path);
+int who_main(char **paths, int npaths);
+const char *type_name(mode_t mode);
+
+int namedb_load(namedb_t *pdb, const char *path);
+int namedb_cmp(const void *a, const void *b);
+const char *namedb_find(namedb_t *pdb, unsigned int id);
+void names_init(void);
+const char *namecache_get(namecache_t *pc, unsigned int id, int *pfound);
+void namecache_put(namecache_t *pc, unsigned int id, const char *name);
+const char *uid_lookup(uid_t uid);
+const char *gid_lookup(gid_t gid);
+const char *uid_name(uid_t uid);
+const char *gid_name(gid_t gid);
 
 void obtain_user_info(const char *user, const char *groups);
 void report_findings(const char *name, entries_t *pentries);
-void record_access(entries_t *pentries, const char *path, struct stat *sb);
+void report_row(outbuf_t *pob, const char *path, const struct stat *sb);
+void outbuf_send(outbuf_t *pob, const char *p, size_t len);
+void outbuf_flush(outbuf_t *pob);
+void outbuf_write(outbuf_t *pob, const void *data, size_t len);
+char *fmt_ulong(char *p, unsigned long v);
+char *fmt_mode(char *p, mode_t mode);
+void report_all_findings(void);
+void record_access(entries_t *pentries, const char *path, const struct stat *sb);
 void record_access_level(const char *path, struct stat *sb);
-void scan_directory(const char *dir);
 void usage(char *argv[]);
+int parse_num(const char *str, long min, long max, int *pval);
 
 
+/*
+ * the benchmarks in bench/ include this file and bring their own main()
+ */
+#ifndef CANHAZAXS_NO_MAIN
 int
 main(int argc, char *argv[])
 {
     char canonical_path[PATH_MAX+1] = { 0 };
     int i, opt;
     char *user = NULL, *groups = NULL;
+    char *serve_path = NULL, *query_path = NULL, *snapshot_out = NULL;
+    const char *whatif_spec = NULL, *prio_snapshot = NULL;
+    int query_op = QUERY_POINT, who = 0;
+    unsigned long long start = 0;
+    static const struct option long_opts[] = {
+        { "user",   required_argument, NULL, 'u' },
+        { "groups", required_argument, NULL, 'g' },
+        { "stats",  no_argument,       NULL, 's' },
+        { "latency", optional_argument, NULL, 'l' },
+        { "progress", optional_argument, NULL, 'p' },
+        { "trace",  required_argument, NULL, 't' },
+        { "perf-counters", no_argument, NULL, 'P' },
+        { "names-root", required_argument, NULL, 'R' },
+        { "verbose", no_argument,      NULL, 'v' },
+        { "serve",  required_argument, NULL, 'S' },
+        { "rescan", required_argument, NULL, 'r' },
+        { "query",  required_argument, NULL, 'q' },
+        { "query-prefix", required_argument, NULL, 'Q' },
+        { "who",    no_argument,       NULL, 'w' },
+        { "snapshot", required_argument, NULL, 'i' },
+        { "save-snapshot", required_argument, NULL, 'o' },
+        { "what-if", required_argument, NULL, 'W' },
+        { "jobs",   required_argument, NULL, 'j' },
+        { "priority", optional_argument, NULL, 'b' },
+        { "stream", no_argument,       NULL, 'F' },
+        { "deadline", required_argument, NULL, 'd' },
+        { "max-entries", required_argument, NULL, 'm' },
+        { "estimate", optional_argument, NULL, 'e' },
+        { NULL, 0, NULL, 0 }
+    };
 
     /* process arguments */
-    while ((opt = getopt(argc, argv, "u:g:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "u:g:sl::p::t:PR:vS:r:q:Q:wi:o:W:j:b::Fd:m:e::", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'u':
                 user = optarg;
@@ -82,440 +866,4792 @@ main(int argc, char *argv[])
                 groups = optarg;
                 break;
 
+            case 's':
+                g_stats_enabled = 1;
+                break;
+
+            case 'l':
+                g_stats_enabled = 1;
+                g_latency_enabled = 1;
+                if (optarg && parse_num(optarg, 0, CHAX_SLOWLIST_MAX, &g_slow_max) == -1) {
+                    fprintf(stderr, "[!] Invalid slow list size: %s (0 to %d)\n",
+                            optarg, CHAX_SLOWLIST_MAX);
+                    return 1;
+                }
+                break;
+
+            case 'p':
+                g_progress_ms = 1000;
+                if (optarg && parse_num(optarg, 0, INT_MAX, &g_progress_ms) == -1) {
+                    fprintf(stderr, "[!] Invalid progress interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 't':
+                g_trace_file = optarg;
+                g_trace_enabled = 1;
+                break;
+
+            case 'P':
+                g_perf_enabled = 1;
+                break;
+
+            case 'R':
+                g_names_root = optarg;
+                break;
+
+            case 'v':
+                g_verbose = 1;
+                break;
+
+            case 'S':
+                serve_path = optarg;
+                break;
+
+            case 'r':
+                if (parse_num(optarg, 0, INT_MAX, &g_rescan_secs) == -1) {
+                    fprintf(stderr, "[!] Invalid rescan interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'q':
+            case 'Q':
+                query_path = optarg;
+                query_op = opt == 'q' ? QUERY_POINT : QUERY_PREFIX;
+                break;
+
+            case 'w':
+                who = 1;
+                break;
+
+            case 'i':
+                g_snapshot_in = optarg;
+                break;
+
+            case 'o':
+                snapshot_out = optarg;
+                break;
+
+            case 'W':
+                whatif_spec = optarg;
+                break;
+
+            case 'j':
+                if (!strcmp(optarg, "auto"))
+                    g_threads = 0;
+                else if (parse_num(optarg, 1, CHAX_THREADS_MAX, &g_threads) == -1) {
+                    fprintf(stderr, "[!] Invalid number of jobs: %s (1 to %d or auto)\n",
+                            optarg, CHAX_THREADS_MAX);
+                    return 1;
+                }
+                break;
+
+            case 'b':
+                g_priority = 1;
+                prio_snapshot = optarg;
+                break;
+
+            case 'F':
+                g_stream = 1;
+                break;
+
+            case 'd':
+            {
+                char *end;
+                double secs = strtod(optarg, &end);
+
+                /* the library takes the milliseconds as a long */
+                if (end == optarg || *end || !(secs > 0) || secs * 1000 > LONG_MAX) {
+                    fprintf(stderr, "[!] Invalid deadline: %s\n", optarg);
+                    return 1;
+                }
+                g_deadline_ms = secs * 1000 > 1 ? secs * 1000 : 1;
+                break;
+            }
+
+            case 'm':
+            {
+                char *end;
+
+                errno = 0;
+                g_max_entries = strtoull(optarg, &end, 10);
+                if (end == optarg || *end || errno || !g_max_entries || *optarg == '-'
+                    || g_max_entries > LONG_MAX) {
+                    fprintf(stderr, "[!] Invalid number of entries: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+
+            case 'e':
+                g_sample = 0;
+                if (optarg) {
+                    char *end;
+
+                    g_sample = strtoll(optarg, &end, 10);
+                    if (end == optarg || *end || g_sample <= 0) {
+                        fprintf(stderr, "[!] Invalid number of descents: %s\n", optarg);
+                        return 1;
+                    }
+                }
+                break;
+
             default:
                 usage(argv);
                 return 1;
         }
     }
 
-    argc -= optind;
-    argv += optind;
+    argc -= optind;
+    argv += optind;
+
+    /* "canhazaxs eval --snapshot FILE" reads better, allow it */
+    if (g_snapshot_in && argc > 0 && !strcmp(argv[0], "eval")) {
+        argc--;
+        argv++;
+    }
+    if (g_snapshot_in && snapshot_out) {
+        fprintf(stderr, "[!] Give either --snapshot or --save-snapshot, not both\n");
+        return 1;
+    }
+    if (g_sample >= 0 && (g_snapshot_in || snapshot_out || whatif_spec)) {
+        fprintf(stderr, "[!] --estimate samples the file system, it can't be combined "
+                "with snapshots or --what-if\n");
+        return 1;
+    }
+    /* the counters only see the main thread, and sampling has no classify hook */
+    if (g_perf_enabled && (g_threads != 1 || g_sample >= 0)) {
+        fprintf(stderr, "[!] --perf-counters counts the main thread only, it can't be "
+                "combined with -j or --estimate\n");
+        return 1;
+    }
+    /* without a budget a fixed number of descents keeps it to seconds */
+    if (!g_sample && !g_deadline_ms && !g_max_entries)
+        g_sample = SAMPLE_DESCENTS;
+
+    if (g_trace_enabled) {
+        g_trace_base = now_ns();
+        pthread_key_create(&g_trace_key, trace_release);
+        trace_thread("walk");
+    }
+
+    if (g_perf_enabled)
+        perf_init();
+    names_init();
+    if (serve_path)
+        return serve(serve_path, argv, argc);
+    if (who)
+        return who_main(argv, argc);
+
+    /* get user info */
+    if (g_stats_enabled || g_trace_enabled)
+        start = now_ns();
+    if (g_perf_enabled)
+        perf_start(&g_perf_phase);
+    g_chax = scan_new(NULL, NULL);
+    obtain_user_info(user, groups);
+    phase_mark(PHASE_IDENTITY, &start);
+    if (query_path)
+        return query_main(query_path, query_op, argv, argc);
+    if (prio_snapshot && priority_load(prio_snapshot) == -1)
+        return 1;
+    if (whatif_spec) {
+        g_whatif = (whatif_t *)mem_calloc(MEM_SERVE, sizeof(whatif_t));
+        if (whatif_parse(g_whatif, whatif_spec) == -1)
+            return 1;
+        whatif_init(g_whatif);
+    }
+    /* first, every helper thread has to inherit SIGUSR1 blocked */
+    if (g_progress_ms >= 0)
+        progress_start();
+    if (g_stream)
+        g_stream_tty = isatty(1);
+    if (g_stream && !g_stream_tty && g_sample < 0)
+        stream_start();
+    /* streamed rows need the names right away */
+    if (!g_stream)
+        prefetch_start();
+
+    /* process remaining args as directories */
+    if (g_sample >= 0) {
+        for (i = 0; i < argc; i++) {
+            t_stats.realpath_calls++;
+            if (!realpath(argv[i], canonical_path)) {
+                perror_str("[!] Unable to resolve path \"%s\"", argv[i]);
+                return 1;
+            }
+
+            sample_path(canonical_path);
+        }
+    }
+    else if (g_snapshot_in || snapshot_out || g_whatif) {
+        if (eval_main(g_snapshot_in, snapshot_out, argv, argc) == -1)
+            return 1;
+    }
+    else {
+        for (i = 0; i < argc; i++) {
+            t_stats.realpath_calls++;
+            if (!realpath(argv[i], canonical_path)) {
+                perror_str("[!] Unable to resolve path \"%s\"", argv[i]);
+                return 1;
+            }
+
+            chax_scan(g_chax, canonical_path);
+        }
+    }
+
+    if (g_progress_ms >= 0)
+        progress_stop();
+    if (g_stream && !g_stream_tty && g_sample < 0)
+        stream_stop();
+    phase_mark(PHASE_WALK, &start);
+
+    /* report the errors, what was left and the findings */
+    report_errors();
+    report_unvisited();
+    scan_done(g_chax);
+    g_chax = NULL;
+    prefetch_stop();
+    if (!g_whatif && g_sample < 0)
+        report_all_findings();
+    phase_mark(PHASE_REPORT, &start);
+    if (g_stats_enabled) {
+        fflush(stdout);
+        report_stats();
+    }
+    if (g_perf_enabled) {
+        perf_split_classify();
+        fflush(stdout);
+        report_perf();
+    }
+    if (g_trace_enabled)
+        trace_write();
+
+    return 0;
+}
+#endif
+
+
+void
+perror_str(const char *fmt, ...)
+{
+    char *ptr = NULL;
+    va_list vl;
+
+    stats_error(errno);
+    va_start(vl, fmt);
+    if (vasprintf(&ptr, fmt, vl) == -1) {
+        perror(fmt);
+        return;
+    }
+    perror(ptr);
+    free(ptr);
+}
+
+
+void
+walk_error(const char *what, const char *parent, size_t parent_len, const char *name, int err)
+{
+    stats_error(err);
+    error_record(what, parent, parent_len, name, err);
+}
+
+
+/*
+ * record a failure on "<parent>/<name>". with -v it is printed right away,
+ * otherwise it is only counted in its group.
+ */
+void
+error_record(const char *what, const char *parent, size_t parent_len, const char *name, int err)
+{
+    erragg_t *pa = &g_erragg;
+    errgroup_t *pg;
+    unsigned int h, i;
+
+    if (g_verbose) {
+        char *path = join_path(parent, parent_len, name);
+
+        fprintf(stderr, "[!] %s \"%s\": %s\n", what, path, strerror(err));
+        mem_free(MEM_ERRORS, path, strlen(path) + 1);
+        return;
+    }
+
+    /* FNV-1a over the parent, mixed with the errno and the message */
+    h = 2166136261U;
+    for (i = 0; i < parent_len; i++)
+        h = (h ^ (unsigned char)parent[i]) * 16777619U;
+    h ^= (unsigned int)err * 2654435761U;
+    h ^= (unsigned int)(unsigned long)what;
+
+    pthread_mutex_lock(&g_erragg_lock);
+    pa->total++;
+
+    if ((pa->used + 1) * 2 > pa->size && pa->size < ERRAGG_MAX_GROUPS * 2) {
+        errgroup_t **old = pa->slots;
+        unsigned int old_size = pa->size, j;
+
+        pa->size = old_size ? old_size * 2 : 64;
+        pa->slots = (errgroup_t **)mem_calloc(MEM_ERRORS, pa->size * sizeof(errgroup_t *));
+        for (j = 0; j < old_size; j++) {
+            if (!old[j])
+                continue;
+            for (i = old[j]->hash & (pa->size - 1); pa->slots[i]; i = (i + 1) & (pa->size - 1))
+                ;
+            pa->slots[i] = old[j];
+        }
+        if (old)
+            mem_free(MEM_ERRORS, old, old_size * sizeof(errgroup_t *));
+    }
+
+    for (i = h & (pa->size - 1); (pg = pa->slots[i]); i = (i + 1) & (pa->size - 1)) {
+        if (pg->hash == h && pg->err == err && pg->what == what
+            && !strncmp(pg->parent, parent, parent_len) && pg->parent[parent_len] == '\0')
+            break;
+    }
+
+    if (!pg) {
+        if (pa->used >= ERRAGG_MAX_GROUPS) {
+            pa->overflow++;
+            pthread_mutex_unlock(&g_erragg_lock);
+            return;
+        }
+        pg = (errgroup_t *)mem_calloc(MEM_ERRORS, sizeof(errgroup_t));
+        pg->hash = h;
+        pg->err = err;
+        pg->what = what;
+        pg->parent = (char *)mem_alloc(MEM_ERRORS, parent_len + 1);
+        memcpy(pg->parent, parent, parent_len);
+        pg->parent[parent_len] = '\0';
+        pa->slots[i] = pg;
+        pa->used++;
+    }
+
+    pg->count++;
+    if (pg->nsamples < ERRAGG_SAMPLES)
+        pg->samples[pg->nsamples++] = join_path(parent, parent_len, name);
+    pthread_mutex_unlock(&g_erragg_lock);
+}
+
+
+char *
+join_path(const char *parent, size_t parent_len, const char *name)
+{
+    size_t name_len = strlen(name);
+    int slash = parent_len && parent[parent_len - 1] != '/';
+    char *path = (char *)mem_alloc(MEM_ERRORS, parent_len + slash + name_len + 1);
+
+    memcpy(path, parent, parent_len);
+    if (slash)
+        path[parent_len] = '/';
+    memcpy(path + parent_len + slash, name, name_len + 1);
+    return path;
+}
+
+
+int
+errgroup_cmp(const void *a, const void *b)
+{
+    const errgroup_t *pa = *(const errgroup_t **)a, *pb = *(const errgroup_t **)b;
+
+    if (pa->count != pb->count)
+        return pa->count > pb->count ? -1 : 1;
+    return strcmp(pa->parent, pb->parent);
+}
+
+
+int
+errgroup_err_cmp(const void *a, const void *b)
+{
+    const errgroup_t *pa = *(const errgroup_t **)a, *pb = *(const errgroup_t **)b;
+
+    return (pa->err > pb->err) - (pa->err < pb->err);
+}
+
+
+/*
+ * a line per errno, then the biggest groups first, each with its sample
+ * paths
+ */
+void
+report_errors(void)
+{
+    erragg_t *pa = &g_erragg;
+    errgroup_t **groups, **by_err;
+    unsigned int i, k, n = 0;
+    unsigned long long rest = 0;
+    int j;
+
+    if (!pa->total)
+        return;
+
+    groups = (errgroup_t **)mem_alloc(MEM_ERRORS, (pa->used + 1) * sizeof(errgroup_t *));
+    by_err = (errgroup_t **)mem_alloc(MEM_ERRORS, (pa->used + 1) * sizeof(errgroup_t *));
+    for (i = 0; i < pa->size; i++) {
+        if (pa->slots[i])
+            groups[n++] = pa->slots[i];
+    }
+    memcpy(by_err, groups, n * sizeof(errgroup_t *));
+    qsort(groups, n, sizeof(errgroup_t *), errgroup_cmp);
+    qsort(by_err, n, sizeof(errgroup_t *), errgroup_err_cmp);
+
+    /* the groups keep the real errno, whatever the per-errno stats table holds */
+    fprintf(stderr, "[!] %llu errors while scanning (use -v to see each one)\n", pa->total);
+    for (i = 0; i < n; i = k) {
+        unsigned long long per_errno = 0;
+
+        for (k = i; k < n && by_err[k]->err == by_err[i]->err; k++)
+            per_errno += by_err[k]->count;
+        fprintf(stderr, "[!]   %llu x %s\n", per_errno, strerror(by_err[i]->err));
+    }
+    mem_free(MEM_ERRORS, by_err, (pa->used + 1) * sizeof(errgroup_t *));
+    for (i = 0; i < n; i++) {
+        errgroup_t *pg = groups[i];
+
+        if (i >= ERRAGG_REPORT_MAX) {
+            rest += pg->count;
+            continue;
+        }
+        fprintf(stderr, "[!]   %llu x %s in \"%s\": %s (", pg->count, pg->what,
+                pg->parent[0] ? pg->parent : "/", strerror(pg->err));
+        for (j = 0; j < pg->nsamples; j++)
+            fprintf(stderr, "%s\"%s\"", j ? ", " : "e.g. ", pg->samples[j]);
+        fprintf(stderr, "%s)\n", pg->count > (unsigned long long)pg->nsamples ? ", ..." : "");
+    }
+    if (rest || pa->overflow)
+        fprintf(stderr, "[!]   %llu more in other places\n", rest + pa->overflow);
+    mem_free(MEM_ERRORS, groups, (pa->used + 1) * sizeof(errgroup_t *));
+}
+
+
+/*
+ * forget everything recorded so far, so a rescan starts counting from zero
+ */
+void
+errors_reset(void)
+{
+    erragg_t *pa = &g_erragg;
+    unsigned int i;
+    int j;
+
+    pthread_mutex_lock(&g_erragg_lock);
+    for (i = 0; i < pa->size; i++) {
+        errgroup_t *pg = pa->slots[i];
+
+        if (!pg)
+            continue;
+        for (j = 0; j < pg->nsamples; j++)
+            mem_free(MEM_ERRORS, pg->samples[j], strlen(pg->samples[j]) + 1);
+        mem_free(MEM_ERRORS, pg->parent, strlen(pg->parent) + 1);
+        mem_free(MEM_ERRORS, pg, sizeof(errgroup_t));
+        pa->slots[i] = NULL;
+    }
+    pa->used = 0;
+    pa->overflow = 0;
+    pa->total = 0;
+    pthread_mutex_unlock(&g_erragg_lock);
+}
+
+unsigned long long
+now_ns(void)
+{
+    return chax_now_ns();
+}
+
+
+void
+stats_error(int err)
+{
+    if (err < 0 || err >= CHAX_MAX_ERRNO)
+        err = 0;
+    t_stats.walk.errors[err]++;
+}
+
+
+/*
+ * dump the statistics as "stats.<key>=<value>" lines so they are easy to
+ * grep/cut. errno 0 collects anything out of range.
+ */
+void
+report_stats(void)
+{
+    chax_stats_t *ps = &t_stats.walk;
+    unsigned int workers = ps->threads_peak ? ps->threads_peak : g_threads > 1 ? g_threads : 1;
+    unsigned long long walk_ns = t_stats.phase_ns[PHASE_WALK];
+    int i;
+
+    fprintf(stderr, "stats.syscall.realpath=%llu\n", t_stats.realpath_calls);
+    fprintf(stderr, "stats.syscall.opendir=%llu\n", ps->opendir_calls);
+#if defined(__linux__) && defined(SYS_getdents64)
+    fprintf(stderr, "stats.syscall.getdents=%llu\n", ps->getdents_calls);
+#else
+    fprintf(stderr, "stats.syscall.readdir=%llu\n", ps->readdir_calls);
+#endif
+    fprintf(stderr, "stats.syscall.closedir=%llu\n", ps->closedir_calls);
+    fprintf(stderr, "stats.syscall.lstat=%llu\n", ps->lstat_calls);
+    for (i = 0; i < CHAX_ETYPE_MAX; i++)
+        fprintf(stderr, "stats.entries.%s=%llu\n", g_etype_names[i], ps->entries[i]);
+    fprintf(stderr, "stats.dirs_pruned=%llu\n", ps->dirs_pruned);
+    fprintf(stderr, "stats.names.prefetched=%llu\n", g_prefetch.queued);
+    fprintf(stderr, "stats.names.prefetch_dropped=%llu\n", g_prefetch.dropped);
+    if (ps->threads_limit) {
+        fprintf(stderr, "stats.threads.cpus=%u\n", ps->threads_cpus);
+        fprintf(stderr, "stats.threads.nofile=%u\n", ps->threads_nofile);
+        fprintf(stderr, "stats.threads.limit=%u\n", ps->threads_limit);
+        fprintf(stderr, "stats.threads.peak=%u\n", ps->threads_peak);
+        fprintf(stderr, "stats.threads.final=%u\n", ps->threads_final);
+        fprintf(stderr, "stats.threads.changes=%u\n", ps->threads_changes);
+        fprintf(stderr, "stats.threads.devices=%u\n", ps->threads_devices);
+        fprintf(stderr, "stats.threads.device_changes=%u\n", ps->threads_devtunes);
+        fprintf(stderr, "stats.threads.dirs_shared=%llu\n", ps->dirs_shared);
+    }
+    if (g_deadline_ms || g_max_entries) {
+        fprintf(stderr, "stats.budget.stopped=%u\n", ps->stopped);
+        fprintf(stderr, "stats.budget.unvisited_dirs=%llu\n", ps->unvisited_dirs);
+        fprintf(stderr, "stats.budget.unvisited_est=%llu\n", ps->unvisited_est);
+    }
+    report_mem();
+    for (i = 0; i < CHAX_MAX_ERRNO; i++) {
+        if (ps->errors[i])
+            fprintf(stderr, "stats.errors.%d=%llu\n", i, ps->errors[i]);
+    }
+    /*
+     * classification is timed inside the walk, take it out so the phases
+     * don't overlap. with -j it's summed over the workers, so only their
+     * average share comes off the wall clock walk time.
+     */
+    walk_ns -= walk_ns < ps->classify_ns / workers ? walk_ns : ps->classify_ns / workers;
+    for (i = 0; i < PHASE_MAX; i++)
+        fprintf(stderr, "stats.time_ns.%s=%llu\n", g_phase_names[i],
+                i == PHASE_CLASSIFY ? ps->classify_ns : i == PHASE_WALK ? walk_ns : t_stats.phase_ns[i]);
+
+    if (g_latency_enabled) {
+        report_lathist("lstat", &ps->lstat_lat);
+        report_lathist("getdents", &ps->getdents_lat);
+        report_slowlist("dirs", &ps->slow_dirs);
+        report_slowlist("entries", &ps->slow_entries);
+    }
+}
+
+
+unsigned long long
+lathist_bucket_low(int idx)
+{
+    int msb;
+
+    if (idx < CHAX_LATHIST_SUB)
+        return idx;
+    msb = idx / CHAX_LATHIST_SUB + CHAX_LATHIST_SUB_BITS - 1;
+    return (unsigned long long)(CHAX_LATHIST_SUB | (idx % CHAX_LATHIST_SUB)) << (msb - CHAX_LATHIST_SUB_BITS);
+}
+
+
+/*
+ * returns the lower bound of the bucket holding the given percentile
+ */
+unsigned long long
+lathist_percentile(chax_lathist_t *ph, double pct)
+{
+    unsigned long long want, seen = 0;
+    int i;
+
+    if (!ph->count)
+        return 0;
+    want = (unsigned long long)(ph->count * pct / 100.0);
+    if (want >= ph->count)
+        want = ph->count - 1;
+    for (i = 0; i < CHAX_LATHIST_BUCKETS; i++) {
+        seen += ph->buckets[i];
+        if (seen > want)
+            return lathist_bucket_low(i);
+    }
+    return ph->max;
+}
+
+
+void
+report_lathist(const char *name, chax_lathist_t *ph)
+{
+    int i;
+
+    fprintf(stderr, "stats.latency.%s.count=%llu\n", name, ph->count);
+    fprintf(stderr, "stats.latency.%s.mean_ns=%llu\n", name, ph->count ? ph->sum / ph->count : 0);
+    fprintf(stderr, "stats.latency.%s.p50_ns=%llu\n", name, lathist_percentile(ph, 50));
+    fprintf(stderr, "stats.latency.%s.p90_ns=%llu\n", name, lathist_percentile(ph, 90));
+    fprintf(stderr, "stats.latency.%s.p99_ns=%llu\n", name, lathist_percentile(ph, 99));
+    fprintf(stderr, "stats.latency.%s.p999_ns=%llu\n", name, lathist_percentile(ph, 99.9));
+    fprintf(stderr, "stats.latency.%s.max_ns=%llu\n", name, ph->max);
+    for (i = 0; i < CHAX_LATHIST_BUCKETS; i++) {
+        if (ph->buckets[i])
+            fprintf(stderr, "stats.latency.%s.bucket.%llu=%llu\n", name,
+                    lathist_bucket_low(i), ph->buckets[i]);
+    }
+}
+
+
+void
+report_slowlist(const char *name, chax_slowlist_t *pl)
+{
+    int i;
+
+    for (i = 0; i < pl->len; i++)
+        fprintf(stderr, "stats.slowest.%s.%d=%llu %s\n", name, i,
+                pl->items[i].ns, pl->items[i].path);
+}
+
+
+/*
+ * NOTE: the "groups" string will be modified in place by strtok()
+ */
+void
+obtain_user_info(const char *user, const char *groups)
+{
+    struct passwd *pw;
+    gid_t list[NGROUPS_MAX];
+    const gid_t *pgroups;
+    int i, nlist = NGROUPS_MAX;
+    uid_t uid = -1;
+
+    /* no user specified? use the current uid. */
+    if (!user) {
+        uid = getuid();
+        pw = g_names->getpwuid(uid);
+    }
+    else {
+        /* try to resolve the pw struct from the user string */
+        pw = g_names->getpwnam(user);
+
+        /* if it fails, try to treat it as a number */
+        if (!pw) {
+            char *endptr = (char *)user;
+            long uid_tmp;
+
+            /* try by id as well */
+            uid_tmp = strtol(user, &endptr, 0);
+            if (uid_tmp == LONG_MAX || *endptr != '\0') {
+                fprintf(stderr, "[!] Invalid user id: %s!\n", user);
+                exit(1);
+            }
+            uid = uid_tmp;
+
+            pw = g_names->getpwuid(uid);
+        }
+    }
+    if (!pw) {
+        fprintf(stderr, "[!] Unable to find uid %lu, trying anyway...\n", (unsigned long)uid);
+        nlist = 0;
+    }
+    else
+        uid = pw->pw_uid;
+
+    /* find out what groups the current or specified user is in */
+    if (!user) {
+        int num = getgroups(0, list);
+        if (num > nlist) {
+            fprintf(stderr, "[!] Too many groups!\n");
+            exit(1);
+        }
+        if ((nlist = getgroups(nlist, list)) == -1) {
+            perror("[!] Unable to getgroups");
+            exit(1);
+        }
+    }
+    else if (pw) {
+        /* since we are passing the max, we shouldn't have an issue with failed return */
+        g_names->getgrouplist(pw->pw_name, pw->pw_gid, list, &nlist);
+    }
+    /* else we have no way of knowing, the user doesn't exist =) */
+    if (chax_set_identity(g_chax, uid, list, nlist) == -1) {
+        perror("[!] Unable to set the identity");
+        exit(1);
+    }
+
+    /* make sure our gid is in the groups */
+    if (!user && pw)
+        chax_add_group(g_chax, pw->pw_gid);
+
+    /* append any extra groups */
+    if (groups) {
+        char *grnam = strtok((char *)groups, ",");
+
+        while (grnam) {
+            struct group *pg = g_names->getgrnam(grnam);
+            unsigned long gid_tmp;
+            gid_t gid;
+
+            if (!pg) {
+                char *endptr = grnam;
+
+                gid_tmp = strtoul(grnam, &endptr, 0);
+                /* a bad number indicates a probably mistake */
+                if (gid_tmp == ULONG_MAX || *endptr != '\0') {
+                    fprintf(stderr, "[!] Unknown/invalid group: %s\n", grnam);
+                    exit(1);
+                }
+                gid = gid_tmp;
+
+                /* try again */
+                pg = g_names->getgrgid(gid);
+            }
+
+            if (!pg) {
+                /* this is just a warning, add the number and keep processing others */
+                fprintf(stderr, "[!] Unable to find gid %s, trying anyway...\n", grnam);
+            }
+            else
+                gid = pg->gr_gid;
+            if (chax_add_group(g_chax, gid) == -1) {
+                fprintf(stderr, "[!] Out of memory!\n");
+                exit(1);
+            }
+
+            /* process the next group name. */
+            grnam = strtok(NULL, ",");
+        }
+    }
+
+    /* print what we found :) */
+    nlist = chax_identity(g_chax, &uid, &pgroups);
+    if (pw)
+        printf("[*] uid=%u(%s), groups=", pw->pw_uid, pw->pw_name);
+    else
+        printf("[*] uid=%u(?), groups=", uid);
+
+    for (i = 0; i < nlist; i++) {
+        const char *grname = gid_name(pgroups[i]);
+
+        if (grname)
+            printf("%u(%s)", pgroups[i], grname);
+        else
+            printf("%u(?)", pgroups[i]);
+        if (i != nlist - 1)
+            printf(",");
+    }
+    printf("\n");
+}
+
+
+/*
+ * "    %9s %04o %s %s %s\n" for every entry. whatever is pending on stdout
+ * goes out before the header so a terminal or a 2>&1 log shows each
+ * header right above its rows.
+ */
+void
+report_findings(const char *name, entries_t *pentries)
+{
+    unsigned int i;
+
+    fflush(stdout);
+    outbuf_flush(&g_out);
+    fprintf(stderr, "[*] Found %u entries that are %s\n", pentries->idx, name);
+    for (i = 0; i < pentries->idx; i++)
+        report_row(&g_out, pentries->head[i].path, &pentries->head[i].statbuf);
+    outbuf_flush(&g_out);
+}
+
+
+/*
+ * "    %9s %04o %s %s %s\n" with type, mode, owner, group and path, the
+ * names falling back to the ids
+ */
+void
+report_row(outbuf_t *pob, const char *path, const struct stat *sb)
+{
+    const char *pwname = uid_name(sb->st_uid);
+    const char *grname = gid_name(sb->st_gid);
+    const char *type = type_name(sb->st_mode);
+    size_t type_len = strlen(type);
+    char row[64], *p = row;
+
+    memcpy(p, "             ", 13 - type_len);
+    p += 13 - type_len;
+    memcpy(p, type, type_len);
+    p += type_len;
+    *p++ = ' ';
+    p = fmt_mode(p, sb->st_mode);
+    *p++ = ' ';
+    if (pwname) {
+        outbuf_write(pob, row, p - row);
+        outbuf_write(pob, pwname, strlen(pwname));
+        p = row;
+    }
+    else
+        p = fmt_ulong(p, sb->st_uid);
+    *p++ = ' ';
+    if (grname) {
+        outbuf_write(pob, row, p - row);
+        outbuf_write(pob, grname, strlen(grname));
+        p = row;
+    }
+    else
+        p = fmt_ulong(p, sb->st_gid);
+    *p++ = ' ';
+    outbuf_write(pob, row, p - row);
+    outbuf_write(pob, path, strlen(path));
+    outbuf_write(pob, "\n", 1);
+}
+
+
+/*
+ * a failed write (e.g. a closed pipe) drops the rest of the output, like
+ * stdio would
+ */
+void
+outbuf_send(outbuf_t *pob, const char *p, size_t len)
+{
+    while (len > 0 && !pob->failed) {
+        ssize_t n = write(pob->fd, p, len);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            pob->failed = 1;
+        else {
+            p += n;
+            len -= n;
+        }
+    }
+}
+
+
+void
+outbuf_flush(outbuf_t *pob)
+{
+    outbuf_send(pob, pob->buf, pob->len);
+    pob->len = 0;
+}
+
+
+void
+outbuf_write(outbuf_t *pob, const void *data, size_t len)
+{
+    if (pob->len + len > OUTBUF_SIZE) {
+        outbuf_flush(pob);
+        /* too big to buffer, send it as is */
+        if (len > OUTBUF_SIZE) {
+            outbuf_send(pob, (const char *)data, len);
+            return;
+        }
+    }
+    memcpy(pob->buf + pob->len, data, len);
+    pob->len += len;
+}
+
+
+char *
+fmt_ulong(char *p, unsigned long v)
+{
+    char tmp[24];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+
+/* the permission bits as 4 octal digits */
+char *
+fmt_mode(char *p, mode_t mode)
+{
+    p[0] = '0' + ((mode >> 9) & 7);
+    p[1] = '0' + ((mode >> 6) & 7);
+    p[2] = '0' + ((mode >> 3) & 7);
+    p[3] = '0' + (mode & 7);
+    return p + 4;
+}
+
+
+const char *
+type_name(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+        case S_IFSOCK:
+            return "socket";
+
+        case S_IFLNK: /* we're ignoring these, so this shouldn't happen */
+            return "link";
+
+        case S_IFREG:
+            return "file";
+
+        case S_IFBLK:
+            return "blkdev";
+
+        case S_IFDIR:
+            return "directory";
+
+        case S_IFCHR:
+            return "chardev";
+
+        case S_IFIFO:
+            return "fifo";
+    }
+    return "unknown";
+}
+
+void
+report_all_findings(void)
+{
+    int c;
+
+    if (g_stream) {
+        /* the rows are out already */
+        outbuf_flush(&g_out);
+        for (c = 0; c < ACCESS_CLASSES; c++)
+            fprintf(stderr, "[*] Found %u entries that are %s\n", g_stream_counts[c],
+                    chax_class_name(c));
+        return;
+    }
+    for (c = 0; c < ACCESS_CLASSES; c++)
+        report_findings(chax_class_name(c), &g_findings[c]);
+}
+
+/*
+ * parse a passwd or group file. both have the name in the first field and
+ * the id in the third. the mapping is only needed while parsing; names are
+ * copied into a pool since they aren't NUL terminated in the file.
+ */
+int
+namedb_load(namedb_t *pdb, const char *path)
+{
+    struct stat sb;
+    const char *map, *p, *end;
+    size_t pool_len = 0;
+    unsigned int size = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (sb.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    map = (const char *)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    /* the names can't be longer than the file itself */
+    pdb->pool_size = sb.st_size + 1;
+    pdb->pool = (char *)mem_alloc(MEM_NAMES, pdb->pool_size);
+
+    for (p = map, end = map + sb.st_size; p < end; ) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *name = p, *name_end, *field = NULL;
+        unsigned long id = 0;
+        char *endptr = NULL;
+
+        if (!eol)
+            eol = end;
+
+        /* "name:password:id:...", skipping comments and NIS compat lines */
+        name_end = memchr(p, ':', eol - p);
+        if (name_end && name_end != name && *name != '#' && *name != '+' && *name != '-')
+            field = memchr(name_end + 1, ':', eol - name_end - 1);
+        if (field) {
+            field++;
+            id = strtoul(field, &endptr, 10);
+        }
+        if (!field || endptr == field || *endptr != ':') {
+            p = eol + 1;
+            continue;
+        }
+
+        if (pdb->count == size) {
+            unsigned int new_size = size ? size * 2 : 256;
+
+            pdb->ents = (idname_t *)mem_realloc(MEM_NAMES, pdb->ents, size * sizeof(idname_t),
+                                               new_size * sizeof(idname_t));
+            size = new_size;
+        }
+        pdb->ents[pdb->count].id = id;
+        pdb->ents[pdb->count].line = pdb->count;
+        pdb->ents[pdb->count].name = pdb->pool + pool_len;
+        memcpy(pdb->pool + pool_len, name, name_end - name);
+        pool_len += name_end - name;
+        pdb->pool[pool_len++] = '\0';
+        pdb->count++;
+        p = eol + 1;
+    }
+    munmap((void *)map, sb.st_size);
+
+    qsort(pdb->ents, pdb->count, sizeof(idname_t), namedb_cmp);
+    return 0;
+}
+
+
+/*
+ * by id, then by position in the file so the first entry wins like in NSS
+ */
+int
+namedb_cmp(const void *a, const void *b)
+{
+    const idname_t *pa = (const idname_t *)a, *pb = (const idname_t *)b;
+
+    if (pa->id != pb->id)
+        return pa->id < pb->id ? -1 : 1;
+    return pa->line < pb->line ? -1 : (pa->line > pb->line);
+}
+
+
+const char *
+namedb_find(namedb_t *pdb, unsigned int id)
+{
+    unsigned int lo = 0, hi = pdb->count;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (pdb->ents[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < pdb->count && pdb->ents[lo].id == id)
+        return pdb->ents[lo].name;
+    return NULL;
+}
+
+
+void
+names_init(void)
+{
+    char path[PATH_MAX+1];
+
+#ifdef CHAX_NO_NSS
+    /* there is nothing else to ask, so the files are always it */
+    if (!g_names_root)
+        g_names_root = "";
+#endif
+    if (!g_names_root)
+        return;
+
+    snprintf(path, sizeof(path), "%s/etc/passwd", g_names_root);
+    if (namedb_load(&g_passwd_db, path) == -1) {
+        perror_str("[!] Unable to load \"%s\"", path);
+        exit(1);
+    }
+    snprintf(path, sizeof(path), "%s/etc/group", g_names_root);
+    if (namedb_load(&g_group_db, path) == -1) {
+        perror_str("[!] Unable to load \"%s\"", path);
+        exit(1);
+    }
+}
+
+
+/*
+ * the files backend. it reads /etc/passwd and /etc/group, under -R's root
+ * if given, from the top on each call; it only answers the few lookups
+ * made while setting up the identity. the results are only good until
+ * the next call, like with NSS.
+ */
+FILE *
+files_open(const char *name)
+{
+    char path[PATH_MAX+1];
+
+    snprintf(path, sizeof(path), "%s/etc/%s", g_names_root ? g_names_root : "", name);
+    return fopen(path, "re");
+}
+
+
+struct passwd *
+files_getpwnam(const char *name)
+{
+    FILE *fp = files_open("passwd");
+    struct passwd *pw = NULL;
+
+    if (!fp)
+        return NULL;
+    while ((pw = fgetpwent(fp)) && strcmp(pw->pw_name, name))
+        ;
+    fclose(fp);
+    return pw;
+}
+
+
+struct passwd *
+files_getpwuid(uid_t uid)
+{
+    FILE *fp = files_open("passwd");
+    struct passwd *pw = NULL;
+
+    if (!fp)
+        return NULL;
+    while ((pw = fgetpwent(fp)) && pw->pw_uid != uid)
+        ;
+    fclose(fp);
+    return pw;
+}
+
+
+struct group *
+files_getgrnam(const char *name)
+{
+    FILE *fp = files_open("group");
+    struct group *pg = NULL;
+
+    if (!fp)
+        return NULL;
+    while ((pg = fgetgrent(fp)) && strcmp(pg->gr_name, name))
+        ;
+    fclose(fp);
+    return pg;
+}
+
+
+struct group *
+files_getgrgid(gid_t gid)
+{
+    FILE *fp = files_open("group");
+    struct group *pg = NULL;
+
+    if (!fp)
+        return NULL;
+    while ((pg = fgetgrent(fp)) && pg->gr_gid != gid)
+        ;
+    fclose(fp);
+    return pg;
+}
+
+
+/*
+ * same contract as getgrouplist(3): group comes first, -1 if they don't
+ * all fit, and *ngroups is set to how many there are either way.
+ */
+int
+files_getgrouplist(const char *user, gid_t group, gid_t *groups, int *ngroups)
+{
+    FILE *fp = files_open("group");
+    struct group *pg;
+    int n = 0, max = *ngroups;
+
+    if (max > 0)
+        groups[0] = group;
+    n++;
+    while (fp && (pg = fgetgrent(fp))) {
+        char **pm;
+        int i;
+
+        if (pg->gr_gid == group)
+            continue;
+        for (pm = pg->gr_mem; pm && *pm && strcmp(*pm, user); pm++)
+            ;
+        if (!pm || !*pm)
+            continue;
+        for (i = 0; i < n && i < max && groups[i] != pg->gr_gid; i++)
+            ;
+        if (i < n && i < max)
+            continue;
+        if (n < max)
+            groups[n] = pg->gr_gid;
+        n++;
+    }
+    if (fp)
+        fclose(fp);
+    *ngroups = n;
+    return n > max ? -1 : n;
+}
+
+
+/*
+ * open addressing with linear probing, keyed by id. "*pfound" tells a
+ * cached miss (NULL name) apart from an id we haven't looked up yet.
+ */
+const char *
+namecache_get(namecache_t *pc, unsigned int id, int *pfound)
+{
+    unsigned int i;
+
+    *pfound = 0;
+    if (!pc->size)
+        return NULL;
+    for (i = (id * 2654435761U) & (pc->size - 1); pc->slots[i].used; i = (i + 1) & (pc->size - 1)) {
+        if (pc->slots[i].id == id) {
+            *pfound = 1;
+            return pc->slots[i].name;
+        }
+    }
+    return NULL;
+}
+
+
+void
+namecache_put(namecache_t *pc, unsigned int id, const char *name)
+{
+    unsigned int i;
+
+    /* keep the load factor under 1/2 */
+    if ((pc->used + 1) * 2 > pc->size) {
+        namecache_t old = *pc;
+
+        pc->size = old.size ? old.size * 2 : 64;
+        pc->used = 0;
+        pc->slots = (namecache_ent_t *)mem_calloc(MEM_NAMES, pc->size * sizeof(namecache_ent_t));
+        for (i = 0; i < old.size; i++) {
+            if (old.slots[i].used)
+                namecache_put(pc, old.slots[i].id, old.slots[i].name);
+        }
+        if (old.slots)
+            mem_free(MEM_NAMES, old.slots, old.size * sizeof(namecache_ent_t));
+    }
+
+    for (i = (id * 2654435761U) & (pc->size - 1); pc->slots[i].used; i = (i + 1) & (pc->size - 1))
+        ;
+    pc->slots[i].id = id;
+    pc->slots[i].used = 1;
+    pc->slots[i].name = name;
+    pc->used++;
+}
+
+
+/*
+ * returns NULL if the uid has no name
+ */
+const char *
+uid_name(uid_t uid)
+{
+    const char *name;
+    int found;
+
+    /* the caches belong to the helper until it is done */
+    if (g_prefetch.running)
+        prefetch_stop();
+
+    name = namecache_get(&g_uid_cache, uid, &found);
+    if (found)
+        return name;
+
+    name = uid_lookup(uid);
+    namecache_put(&g_uid_cache, uid, name);
+    return name;
+}
+
+
+const char *
+gid_name(gid_t gid)
+{
+    const char *name;
+    int found;
+
+    if (g_prefetch.running)
+        prefetch_stop();
+
+    name = namecache_get(&g_gid_cache, gid, &found);
+    if (found)
+        return name;
+
+    name = gid_lookup(gid);
+    namecache_put(&g_gid_cache, gid, name);
+    return name;
+}
+
+
+/*
+ * the uncached part of uid_name() and gid_name()
+ */
+const char *
+uid_lookup(uid_t uid)
+{
+    struct passwd *pw;
+
+    if (g_names_root)
+        return namedb_find(&g_passwd_db, uid);
+    pw = g_names->getpwuid(uid);
+    return pw ? mem_strdup(MEM_NAMES, pw->pw_name) : NULL;
+}
+
+
+const char *
+gid_lookup(gid_t gid)
+{
+    struct group *pg;
+
+    if (g_names_root)
+        return namedb_find(&g_group_db, gid);
+    pg = g_names->getgrgid(gid);
+    return pg ? mem_strdup(MEM_NAMES, pg->gr_name) : NULL;
+}
+
+
+/*
+ * only worth it when the lookups can be slow, i.e. through NSS. nothing
+ * may call uid_name() or gid_name() from here until prefetch_stop().
+ */
+void
+prefetch_start(void)
+{
+    prefetch_t *pp = &g_prefetch;
+
+    if (g_names_root)
+        return;
+    pthread_mutex_init(&pp->lock, NULL);
+    pthread_cond_init(&pp->cond, NULL);
+    if (pthread_create(&pp->thread, NULL, prefetch_main, pp) != 0) {
+        fprintf(stderr, "[!] Unable to start the name lookup thread\n");
+        return;
+    }
+    pp->running = 1;
+}
+
+
+/*
+ * waits for everything queued to be resolved
+ */
+void
+prefetch_stop(void)
+{
+    prefetch_t *pp = &g_prefetch;
+
+    if (!pp->running)
+        return;
+    pthread_mutex_lock(&pp->lock);
+    pp->stop = 1;
+    pthread_cond_signal(&pp->cond);
+    pthread_mutex_unlock(&pp->lock);
+    pthread_join(pp->thread, NULL);
+    pp->running = 0;
+    mem_free(MEM_NAMES, pp->uid_seen.slots, pp->uid_seen.size * sizeof(namecache_ent_t));
+    mem_free(MEM_NAMES, pp->gid_seen.slots, pp->gid_seen.size * sizeof(namecache_ent_t));
+    memset(&pp->uid_seen, 0, sizeof(pp->uid_seen));
+    memset(&pp->gid_seen, 0, sizeof(pp->gid_seen));
+}
+
+
+/*
+ * queue an id the helper hasn't seen yet. when the ring is full it's left
+ * to the report to look up.
+ */
+void
+prefetch_id(unsigned int id, int is_group)
+{
+    prefetch_t *pp = &g_prefetch;
+    namecache_t *pseen = is_group ? &pp->gid_seen : &pp->uid_seen;
+    unsigned int tail = pp->tail;
+    int found;
+
+    namecache_get(pseen, id, &found);
+    if (found)
+        return;
+    namecache_put(pseen, id, NULL);
+
+    if (tail - __atomic_load_n(&pp->head, __ATOMIC_ACQUIRE) == PREFETCH_RING) {
+        pp->dropped++;
+        return;
+    }
+    pp->ring[tail % PREFETCH_RING].id = id;
+    pp->ring[tail % PREFETCH_RING].is_group = is_group;
+    pp->queued++;
+    /* pairs with the helper's store to sleeping and load of tail */
+    __atomic_store_n(&pp->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pp->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pp->lock);
+        pthread_cond_signal(&pp->cond);
+        pthread_mutex_unlock(&pp->lock);
+    }
+}
+
+
+void *
+prefetch_main(void *arg)
+{
+    prefetch_t *pp = (prefetch_t *)arg;
+    unsigned int head = 0;
+
+    if (g_trace_enabled)
+        trace_thread("names");
+    for (;;) {
+        prefetch_req_t req;
+        unsigned long long start;
+        const char *name;
+
+        if (head == __atomic_load_n(&pp->tail, __ATOMIC_SEQ_CST)) {
+            int stop;
+
+            pthread_mutex_lock(&pp->lock);
+            __atomic_store_n(&pp->sleeping, 1, __ATOMIC_SEQ_CST);
+            while (head == __atomic_load_n(&pp->tail, __ATOMIC_SEQ_CST) && !pp->stop)
+                pthread_cond_wait(&pp->cond, &pp->lock);
+            __atomic_store_n(&pp->sleeping, 0, __ATOMIC_SEQ_CST);
+            stop = pp->stop;
+            pthread_mutex_unlock(&pp->lock);
+            if (stop && head == __atomic_load_n(&pp->tail, __ATOMIC_ACQUIRE))
+                break;
+            continue;
+        }
+
+        req = pp->ring[head % PREFETCH_RING];
+        __atomic_store_n(&pp->head, ++head, __ATOMIC_RELEASE);
+        start = g_trace_enabled ? now_ns() : 0;
+        if (req.is_group)
+            namecache_put(&g_gid_cache, req.id, name = gid_lookup(req.id));
+        else
+            namecache_put(&g_uid_cache, req.id, name = uid_lookup(req.id));
+        if (g_trace_enabled)
+            trace_span(req.is_group ? "getgrgid" : "getpwuid", start, now_ns(), 1,
+                       name ? name : "", name ? strlen(name) : 0);
+    }
+    return NULL;
+}
+
+
+void
+record_access(entries_t *pentries, const char *path, const struct stat *sb)
+{
+    unsigned int new_next_idx = pentries->idx + 1;
+    entry_t *pentry;
+
+    if (g_prefetch.running) {
+        prefetch_id(sb->st_uid, 0);
+        prefetch_id(sb->st_gid, 1);
+    }
+
+    if (new_next_idx > pentries->len) {
+        /* grow array geometrically, growing one at a time was quadratic */
+        unsigned int new_len = pentries->len ? pentries->len * 2 : 16;
+
+        pentries->head = (entry_t *)mem_realloc(MEM_ENTRIES, pentries->head,
+                                                pentries->len * sizeof(entry_t),
+                                                new_len * sizeof(entry_t));
+        pentries->len = new_len;
+    }
+
+    pentry = pentries->head + pentries->idx;
+    /* atomic only so --progress can peek at the count */
+    __atomic_store_n(&pentries->idx, new_next_idx, __ATOMIC_RELAXED);
+    pentry->path = mem_strdup(MEM_PATHS, path);
+    memcpy(&(pentry->statbuf), sb, sizeof(pentry->statbuf));
+}
+
+/*
+ * filter the permissions we have on the entry into buckets
+ */
+void
+record_access_level(const char *path, struct stat *sb)
+{
+    int cls = chax_classify(g_chax, sb);
+
+    if (cls >= 0)
+        scan_finding(NULL, cls, path, sb);
+}
+
+
+/*
+ * a library context set up from the command line options. the entry hook
+ * makes it an index build instead of a scan, see chax_hooks_t.
+ */
+chax_t *
+scan_new(void *arg, unsigned int (*entry)(void *, unsigned int, const char *, size_t,
+                                          size_t, const struct stat *))
+{
+    chax_hooks_t hooks;
+    chax_t *pc;
+
+    if (!(pc = chax_new())) {
+        fprintf(stderr, "[!] Out of memory!\n");
+        exit(1);
+    }
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.arg = arg;
+    hooks.finding = g_sample >= 0 && !entry ? sample_finding : scan_finding;
+    hooks.error = scan_error;
+    hooks.entry = entry;
+    if (g_trace_enabled)
+        hooks.span = scan_span;
+    /* -P is refused with -j, the counters are the main thread's */
+    if (g_perf_enabled)
+        hooks.classify = scan_classify;
+    if (g_prio_sums)
+        hooks.priority = scan_priority;
+    /* an index has to be complete, the budget only bounds a scan */
+    if (!entry)
+        hooks.unvisited = scan_unvisited;
+    chax_set_hooks(pc, &hooks);
+#ifdef RECORD_LESS_INTERESTING
+    chax_set_option(pc, CHAX_OPT_LESS_INTERESTING, 1);
+#endif
+    chax_set_option(pc, CHAX_OPT_TIMING, g_stats_enabled || g_trace_enabled);
+    chax_set_option(pc, CHAX_OPT_LATENCY, g_latency_enabled);
+    chax_set_option(pc, CHAX_OPT_SLOW_MAX, g_slow_max);
+    chax_set_option(pc, CHAX_OPT_PROGRESS, g_progress_ms >= 0);
+    chax_set_option(pc, CHAX_OPT_THREADS, g_threads);
+    chax_set_option(pc, CHAX_OPT_PRIORITY, g_priority);
+    if (!entry && (chax_set_option(pc, CHAX_OPT_DEADLINE_MS, g_deadline_ms) == -1
+                   || chax_set_option(pc, CHAX_OPT_MAX_ENTRIES, g_max_entries) == -1)) {
+        fprintf(stderr, "[!] Unable to set the budget: %s\n", strerror(errno));
+        exit(1);
+    }
+    return pc;
+}
+
+
+/*
+ * fold what the context did into this thread's statistics and let it go
+ */
+void
+scan_done(chax_t *pc)
+{
+    chax_stats_merge(&t_stats.walk, chax_stats(pc), g_slow_max);
+    chax_free(pc);
+}
+
+
+void
+scan_finding(void *arg, int cls, const char *path, const struct stat *sb)
+{
+    int lock = g_threads != 1 || g_stream;
+
+    (void)arg;
+    if (lock)
+        pthread_mutex_lock(&g_findings_lock);
+    if (g_stream)
+        stream_finding(cls, path, sb);
+    else
+        record_access(&g_findings[cls], path, sb);
+    if (lock)
+        pthread_mutex_unlock(&g_findings_lock);
+}
+
+
+/*
+ * what the snapshot found below the directory, on top of the usual guess.
+ * setuid and setgid findings weigh 8, the rest 1. a directory that held
+ * nothing goes last.
+ */
+int
+scan_priority(void *arg, const char *path, size_t len, const struct stat *sb)
+{
+    int prio = chax_priority(g_chax, path, len, sb);
+    unsigned int id = index_lookup(g_prio_index, path, len), found;
+
+    (void)arg;
+    if (id == INDEX_NONE)
+        return prio;
+    found = g_prio_sums[g_prio_index->end[id]] - g_prio_sums[id + 1];
+    if (!found)
+        return prio - 40;
+    return prio + 20 * (32 - __builtin_clz(found));
+}
+
+
+void
+scan_unvisited(void *arg, const char *path, size_t len, unsigned long long est, int partial)
+{
+    unvisited_t *pu;
+
+    (void)arg;
+    pthread_mutex_lock(&g_findings_lock);
+    if (g_unvisited_len == g_unvisited_size) {
+        unsigned int size = g_unvisited_size ? g_unvisited_size * 2 : 64;
+
+        g_unvisited = (unvisited_t *)mem_realloc(MEM_UNVISITED, g_unvisited,
+                                                 g_unvisited_size * sizeof(unvisited_t),
+                                                 size * sizeof(unvisited_t));
+        g_unvisited_size = size;
+    }
+    pu = g_unvisited + g_unvisited_len++;
+    pu->path = mem_alloc(MEM_UNVISITED, len + 1);
+    memcpy(pu->path, path, len);
+    pu->path[len] = '\0';
+    pu->est = est;
+    pu->partial = partial;
+    pthread_mutex_unlock(&g_findings_lock);
+}
+
+
+int
+unvisited_cmp(const void *a, const void *b)
+{
+    const unvisited_t *ua = (const unvisited_t *)a, *ub = (const unvisited_t *)b;
+
+    if (ua->est != ub->est)
+        return ua->est < ub->est ? 1 : -1;
+    return strcmp(ua->path, ub->path);
+}
+
+
+/*
+ * "~?" is a subtree nothing could be guessed from, "(partly)" a directory
+ * that was read but still had that many entries in it
+ */
+void
+report_unvisited(void)
+{
+    const chax_stats_t *ps = chax_stats(g_chax);
+    unsigned int i;
+
+    if (!ps->stopped)
+        return;
+    fprintf(stderr, "[*] Stopped at the %s after %llu entries, %llu directories not visited "
+            "(~%llu entries)\n", g_max_entries && ps->visited >= g_max_entries
+            ? "entry limit" : "deadline", ps->visited, ps->unvisited_dirs, ps->unvisited_est);
+    qsort(g_unvisited, g_unvisited_len, sizeof(unvisited_t), unvisited_cmp);
+    for (i = 0; i < g_unvisited_len; i++) {
+        unvisited_t *pu = g_unvisited + i;
+
+        if (!pu->est && !pu->partial)
+            fprintf(stderr, "    ~? %s\n", pu->path);
+        else
+            fprintf(stderr, "    ~%llu %s%s\n", pu->est, pu->path,
+                    pu->partial ? " (partly)" : "");
+    }
+}
+
+
+/*
+ * reservoir sampling, so every finding read is as likely to be kept. a
+ * sample runs on one thread.
+ */
+void
+sample_finding(void *arg, int cls, const char *path, const struct stat *sb)
+{
+    sample_ex_t *px;
+    unsigned long long n;
+
+    (void)arg;
+    if (cls >= ACCESS_CLASSES)
+        return;
+    n = ++g_sample_seen[cls];
+    if (n <= SAMPLE_EXAMPLES)
+        px = g_sample_ex[cls] + n - 1;
+    else {
+        unsigned long long slot = ((unsigned long long)random() << 31 | random()) % n;
+
+        if (slot >= SAMPLE_EXAMPLES)
+            return;
+        px = g_sample_ex[cls] + slot;
+        mem_free(MEM_PATHS, px->path, strlen(px->path) + 1);
+    }
+    px->path = mem_strdup(MEM_PATHS, path);
+    memcpy(&px->statbuf, sb, sizeof(struct stat));
+}
+
+
+/*
+ * "[*] About N entries are <class> (lo to hi at 95%, M seen)", or the exact
+ * count when everything got read, each followed by the examples
+ */
+void
+sample_path(const char *path)
+{
+    chax_estimate_t est;
+    unsigned long long start = now_ns();
+    double lo, hi;
+    int c, i;
+
+    if (chax_sample(g_chax, path, g_sample, &est) == -1)
+        return;
+    fflush(stdout);
+    outbuf_flush(&g_out);
+    if (est.exact)
+        fprintf(stderr, "[*] Read all %llu entries below %s\n", est.seen[CHAX_CLASSES], path);
+    else {
+        fprintf(stderr, "[*] Sampled %s with %llu descents, %llu entries read in %.2fs\n",
+                path, est.descents, est.seen[CHAX_CLASSES], (now_ns() - start) / 1e9);
+        lo = est.count[CHAX_CLASSES] - 1.96 * est.se[CHAX_CLASSES];
+        hi = est.count[CHAX_CLASSES] + 1.96 * est.se[CHAX_CLASSES];
+        fprintf(stderr, "[*] About %.0f entries in all (%.0f to %.0f at 95%%)\n",
+                est.count[CHAX_CLASSES], lo > est.seen[CHAX_CLASSES] ? lo : est.seen[CHAX_CLASSES],
+                hi);
+    }
+    for (c = 0; c < ACCESS_CLASSES; c++) {
+        if (est.exact)
+            fprintf(stderr, "[*] Found %llu entries that are %s", est.seen[c], chax_class_name(c));
+        else {
+            lo = est.count[c] - 1.96 * est.se[c];
+            hi = est.count[c] + 1.96 * est.se[c];
+            fprintf(stderr, "[*] About %.0f entries are %s (%.0f to %.0f at 95%%, %llu seen)",
+                    est.count[c], chax_class_name(c), lo > est.seen[c] ? lo : est.seen[c], hi,
+                    est.seen[c]);
+        }
+        fprintf(stderr, est.seen[c] > SAMPLE_EXAMPLES ? ", for example\n" : "\n");
+        for (i = 0; i < SAMPLE_EXAMPLES && i < (int)g_sample_seen[c]; i++) {
+            sample_ex_t *px = g_sample_ex[c] + i;
+
+            report_row(&g_out, px->path, &px->statbuf);
+            mem_free(MEM_PATHS, px->path, strlen(px->path) + 1);
+        }
+        outbuf_flush(&g_out);
+        g_sample_seen[c] = 0;
+    }
+}
+
+
+/*
+ * called with g_findings_lock held
+ */
+void
+stream_finding(int cls, const char *path, const struct stat *sb)
+{
+    const char *name = chax_class_name(cls);
+    size_t name_len = strlen(name);
+    unsigned long long now;
+
+    g_stream_counts[cls]++;
+    outbuf_write(&g_out, name, name_len);
+    outbuf_write(&g_out, "                  ", name_len < 18 ? 18 - name_len : 0);
+    report_row(&g_out, path, sb);
+    now = now_ns();
+    if (g_stream_tty || now - g_stream_flushed >= STREAM_FLUSH_NS) {
+        outbuf_flush(&g_out);
+        g_stream_flushed = now;
+    }
+}
+
+
+void
+stream_start(void)
+{
+    if (pthread_create(&g_stream_thread, NULL, stream_main, NULL) != 0) {
+        fprintf(stderr, "[!] Unable to start the stream thread\n");
+        g_stream_tty = 1;
+    }
+}
+
+
+void
+stream_stop(void)
+{
+    pthread_mutex_lock(&g_findings_lock);
+    g_stream_done = 1;
+    pthread_cond_signal(&g_stream_cond);
+    pthread_mutex_unlock(&g_findings_lock);
+    pthread_join(g_stream_thread, NULL);
+}
+
+
+/*
+ * flush rows that have waited STREAM_FLUSH_NS with nothing coming after
+ * them to push them out
+ */
+void *
+stream_main(void *arg)
+{
+    struct timespec ts;
+
+    (void)arg;
+    pthread_mutex_lock(&g_findings_lock);
+    while (!g_stream_done) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += STREAM_FLUSH_NS;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&g_stream_cond, &g_findings_lock, &ts);
+        if (g_out.len && now_ns() - g_stream_flushed >= STREAM_FLUSH_NS) {
+            outbuf_flush(&g_out);
+            g_stream_flushed = now_ns();
+        }
+    }
+    pthread_mutex_unlock(&g_findings_lock);
+    return NULL;
+}
+
+
+/*
+ * load the snapshot --priority goes by and weigh what the identity found
+ * in it. the parent of an entry comes before it in preorder.
+ */
+int
+priority_load(const char *file)
+{
+    index_t *pidx;
+    ident_t ident;
+    const gid_t *groups;
+    unsigned char *reach;
+    unsigned int i;
+
+    if (!(pidx = snapshot_load(file)))
+        return -1;
+    ident.ngroups = chax_identity(g_chax, &ident.uid, &groups);
+    ident.groups = (gid_t *)mem_alloc(MEM_INDEX, (ident.ngroups + 1) * sizeof(gid_t));
+    memcpy(ident.groups, groups, ident.ngroups * sizeof(gid_t));
+    qsort(ident.groups, ident.ngroups, sizeof(gid_t), gid_cmp);
+
+    reach = (unsigned char *)mem_alloc(MEM_INDEX, pidx->count + 1);
+    g_prio_sums = (unsigned int *)mem_alloc(MEM_INDEX, (pidx->count + 1) * sizeof(unsigned int));
+    g_prio_sums[0] = 0;
+    for (i = 0; i < pidx->count; i++) {
+        unsigned int p = pidx->parent[i], acc;
+        int cls;
+
+        reach[i] = p == INDEX_NONE
+            || (reach[p] && (ident_access(&ident, pidx->mode[p], pidx->uid[p], pidx->gid[p])
+                             & ACC_EXEC));
+        acc = ident_access(&ident, pidx->mode[i], pidx->uid[i], pidx->gid[i]);
+        cls = access_class(acc | (reach[i] ? ACC_REACHABLE : 0), pidx->mode[i]);
+        g_prio_sums[i + 1] = g_prio_sums[i] + (cls < 0 ? 0 : cls <= CHAX_SETGID ? 8 : 1);
+    }
+    mem_free(MEM_INDEX, reach, pidx->count + 1);
+    mem_free(MEM_INDEX, ident.groups, (ident.ngroups + 1) * sizeof(gid_t));
+    g_prio_index = pidx;
+    return 0;
+}
+
+
+/* the library already counted it */
+void
+scan_error(void *arg, const char *what, const char *parent, size_t parent_len,
+           const char *name, int err)
+{
+    (void)arg;
+    error_record(what, parent, parent_len, name, err);
+}
+
+
+void
+scan_span(void *arg, const char *name, unsigned long long start, unsigned long long end,
+          unsigned long long n, const char *detail, size_t detail_len)
+{
+    (void)arg;
+    trace_span(name, start, end, n, detail, detail_len);
+}
+
+
+void
+scan_classify(void *arg, int before)
+{
+    (void)arg;
+    if (before) {
+        if (g_perf_classified++ % PERF_CLASSIFY_EVERY)
+            return;
+        g_perf_sampled++;
+        perf_start(&g_perf_classify);
+    }
+    else if ((g_perf_classified - 1) % PERF_CLASSIFY_EVERY == 0)
+        perf_stop(&g_perf_classify, NULL);
+}
+
+
+/*
+ * scale the sampled classification counts up to every entry and take them
+ * out of the walk, which they were also counted in.
+ */
+void
+perf_split_classify(void)
+{
+    unsigned long long *walk = g_perf_counts[PHASE_WALK];
+    unsigned long long *cls = g_perf_counts[PHASE_CLASSIFY];
+    int i;
+
+    perf_stop(&g_perf_classify, cls);
+    for (i = 0; i < PERF_MAX; i++) {
+        if (g_perf_sampled)
+            cls[i] = (unsigned long long)((double)cls[i] * g_perf_classified / g_perf_sampled);
+        walk[i] = walk[i] > cls[i] ? walk[i] - cls[i] : 0;
+    }
+}
+
+
+/*
+ * a helper thread prints the progress line every g_progress_ms (or only on
+ * SIGUSR1 when that is 0), so the walk never waits on stderr.
+ */
+void
+progress_start(void)
+{
+    sigset_t set;
+
+    g_progress.start_ns = now_ns();
+
+    /*
+     * the signal is only ever collected by sigtimedwait() in the thread.
+     * the walk's threads inherit the mask, progress_stop() puts it back.
+     */
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, &g_progress_oldmask);
+
+    if (pthread_create(&g_progress_thread, NULL, progress_main, NULL) != 0) {
+        fprintf(stderr, "[!] Unable to start the progress thread\n");
+        pthread_sigmask(SIG_SETMASK, &g_progress_oldmask, NULL);
+        g_progress_ms = -1;
+    }
+}
+
+
+void
+progress_stop(void)
+{
+    struct timespec ts = { 0, 0 };
+    sigset_t set;
+
+    __atomic_store_n(&g_progress.done, 1, __ATOMIC_RELEASE);
+    pthread_kill(g_progress_thread, SIGUSR1);
+    pthread_join(g_progress_thread, NULL);
+    progress_print(1);
+
+    /* one sent after the thread was gone would kill us once unblocked */
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (sigtimedwait(&set, NULL, &ts) == SIGUSR1)
+        ;
+    pthread_sigmask(SIG_SETMASK, &g_progress_oldmask, NULL);
+}
+
+
+void *
+progress_main(void *arg)
+{
+    sigset_t set;
+    struct timespec ts, *pts = NULL;
+
+    (void)arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (g_progress_ms > 0) {
+        ts.tv_sec = g_progress_ms / 1000;
+        ts.tv_nsec = (g_progress_ms % 1000) * 1000000L;
+        pts = &ts;
+    }
+
+    while (!__atomic_load_n(&g_progress.done, __ATOMIC_ACQUIRE)) {
+        if (sigtimedwait(&set, NULL, pts) == -1 && errno != EAGAIN && errno != EINTR)
+            break;
+        if (__atomic_load_n(&g_progress.done, __ATOMIC_ACQUIRE))
+            break;
+        progress_print(0);
+    }
+    return NULL;
+}
+
+
+void
+progress_print(int final)
+{
+    static unsigned long long last_ns = 0, last_entries = 0;
+    unsigned long long now = now_ns();
+    chax_progress_t p;
+    unsigned long long entries, est_total;
+    unsigned long long elapsed = now - g_progress.start_ns, rate = 0;
+    double eta = 0;
+    int tty = isatty(2);
+
+    chax_progress(g_chax, &p);
+    entries = p.entries;
+    est_total = p.est_total;
+
+    if (!last_ns)
+        last_ns = g_progress.start_ns;
+    if (now > last_ns)
+        rate = (entries - last_entries) * 1000000000ULL / (now - last_ns);
+    last_ns = now;
+    last_entries = entries;
+
+    /* the ETA uses the overall rate, the instantaneous one is too jumpy */
+    if (entries && est_total > entries)
+        eta = (double)(est_total - entries) * elapsed / entries / 1e9;
+
+    fprintf(stderr, "%s[*] %llu entries (%llu/s), %llu dirs, %llu pending, depth %u, "
+            "suid %u sgid %u writable %u, eta %.1fs%s",
+            tty ? "\r" : "",
+            entries, rate, p.dirs, p.pending_dirs, p.depth,
+            __atomic_load_n(&g_findings[CHAX_SETUID].idx, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_findings[CHAX_SETGID].idx, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_findings[CHAX_WRITABLE].idx, __ATOMIC_RELAXED),
+            final ? 0 : eta,
+            tty ? (final ? "\033[K\n" : "\033[K") : "\n");
+}
+
+
+/*
+ * close out a phase for --stats and --trace and start timing the next one
+ */
+void
+phase_mark(int phase, unsigned long long *pstart)
+{
+    unsigned long long now;
+
+    if (g_perf_enabled) {
+        perf_stop(&g_perf_phase, g_perf_counts[phase]);
+        perf_start(&g_perf_phase);
+    }
+    if (!g_stats_enabled && !g_trace_enabled)
+        return;
+    now = now_ns();
+    t_stats.phase_ns[phase] += now - *pstart;
+    trace_span(g_phase_names[phase], *pstart, now, 0, NULL, 0);
+    *pstart = now;
+}
+
+
+void
+mem_account(int cat, long long delta)
+{
+    chax_mem_t *pm = g_mem + cat;
+    unsigned long long cur, peak;
+
+    cur = __atomic_add_fetch(&pm->cur, delta, __ATOMIC_RELAXED);
+    if (delta > 0)
+        __atomic_fetch_add(&pm->total, delta, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&pm->peak, __ATOMIC_RELAXED);
+    while (cur > peak
+           && !__atomic_compare_exchange_n(&pm->peak, &peak, cur, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+void *
+mem_alloc(int cat, size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (!ptr) {
+        fprintf(stderr, "[!] Out of memory!\n");
+        exit(1);
+    }
+    mem_account(cat, size);
+    return ptr;
+}
+
+
+void *
+mem_calloc(int cat, size_t size)
+{
+    void *ptr = calloc(1, size);
+
+    if (!ptr) {
+        fprintf(stderr, "[!] Out of memory!\n");
+        exit(1);
+    }
+    mem_account(cat, size);
+    return ptr;
+}
+
+
+void *
+mem_realloc(int cat, void *ptr, size_t old_size, size_t new_size)
+{
+    void *new_ptr = realloc(ptr, new_size);
+
+    if (!new_ptr) {
+        fprintf(stderr, "[!] Out of memory!\n");
+        exit(1);
+    }
+    mem_account(cat, (long long)new_size - (long long)old_size);
+    return new_ptr;
+}
+
+
+char *
+mem_strdup(int cat, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *ptr = (char *)mem_alloc(cat, len);
+
+    memcpy(ptr, str, len);
+    return ptr;
+}
+
+
+void
+mem_free(int cat, void *ptr, size_t size)
+{
+    free(ptr);
+    mem_account(cat, -(long long)size);
+}
+
+
+/*
+ * returns the value of a "Key:  N kB" line in /proc/self/status, or -1
+ */
+long
+read_proc_status_kb(const char *key)
+{
+    char line[128];
+    size_t klen = strlen(key);
+    long val = -1;
+    FILE *fp;
+
+    if (!(fp = fopen("/proc/self/status", "r")))
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, key, klen) && line[klen] == ':') {
+            val = strtol(line + klen + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return val;
+}
+
+
+unsigned long long
+total_findings(void)
+{
+    unsigned long long findings = 0;
+    int c;
+
+    for (c = 0; c < ACCESS_CLASSES; c++)
+        findings += g_findings[c].idx;
+    return findings;
+}
+
+
+/*
+ * per structure usage plus the numbers needed to predict whether a scan
+ * will fit: peak RSS and the cost of each finding and each visited entry.
+ */
+void
+report_mem(void)
+{
+    unsigned long long total = 0, cur = 0, findings = total_findings();
+    unsigned long long entries = t_stats.walk.visited;
+    long hwm = read_proc_status_kb("VmHWM");
+    chax_mem_t mem[MEM_MAX];
+    int i;
+
+    memcpy(mem, g_mem, sizeof(mem));
+    mem[MEM_WALK_FRAMES] = t_stats.walk.mem[CHAX_MEM_WALK_FRAMES];
+    mem[MEM_WALK_NAMES] = t_stats.walk.mem[CHAX_MEM_WALK_NAMES];
+    mem[MEM_DIRBUF] = t_stats.walk.mem[CHAX_MEM_DIRBUF];
+    mem[MEM_SLOWLIST] = t_stats.walk.mem[CHAX_MEM_SLOWLIST];
+    mem[MEM_SAMPLE] = t_stats.walk.mem[CHAX_MEM_SAMPLE];
+    for (i = 0; i < MEM_MAX; i++) {
+        fprintf(stderr, "stats.mem.%s.current=%llu\n", g_mem_names[i], mem[i].cur);
+        fprintf(stderr, "stats.mem.%s.peak=%llu\n", g_mem_names[i], mem[i].peak);
+        total += mem[i].total;
+        cur += mem[i].cur;
+    }
+    fprintf(stderr, "stats.bytes_allocated=%llu\n", total);
+    fprintf(stderr, "stats.mem.current=%llu\n", cur);
+    fprintf(stderr, "stats.mem.peak_rss_kb=%ld\n", hwm);
+    if (findings)
+        fprintf(stderr, "stats.mem.bytes_per_finding=%.1f\n",
+                (double)(g_mem[MEM_ENTRIES].cur + g_mem[MEM_PATHS].cur) / findings);
+    if (entries) {
+        fprintf(stderr, "stats.mem.bytes_per_entry=%.1f\n", (double)cur / entries);
+        if (hwm > 0)
+            fprintf(stderr, "stats.mem.rss_per_entry=%.1f\n", hwm * 1024.0 / entries);
+    }
+}
+
+
+/*
+ * open the counters as one group led by cycles. returns -1 if not even
+ * the leader could be opened.
+ */
+int
+perf_open(perfgroup_t *pg, int user_only)
+{
+#ifdef __linux__
+    static const unsigned long long configs[PERF_MAX] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    struct perf_event_attr attr;
+    int i;
+
+    pg->user_only = user_only;
+    for (i = 0; i < PERF_MAX; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = (i == 0);
+        attr.exclude_kernel = user_only;
+        attr.exclude_hv = 1;
+        pg->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i ? pg->fds[0] : -1, 0);
+        if (pg->fds[0] == -1)
+            return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+void
+perf_start(perfgroup_t *pg)
+{
+#ifdef __linux__
+    ioctl(pg->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+
+/*
+ * stop the group and, if "counts" is given, add the values to it and reset
+ * the counters. the classify group is only read once at the end, so it
+ * keeps accumulating in the kernel until then.
+ */
+void
+perf_stop(perfgroup_t *pg, unsigned long long *counts)
+{
+#ifdef __linux__
+    int i;
+
+    ioctl(pg->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (!counts)
+        return;
+    for (i = 0; i < PERF_MAX; i++) {
+        unsigned long long val;
+
+        if (pg->fds[i] != -1 && read(pg->fds[i], &val, sizeof(val)) == sizeof(val))
+            counts[i] += val;
+    }
+    ioctl(pg->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+
+/*
+ * try with kernel counting first and fall back to user space only, which
+ * perf_event_paranoid=2 still permits. anything more restrictive disables
+ * --perf-counters with a warning.
+ */
+void
+perf_init(void)
+{
+    char paranoid[16] = "?";
+    FILE *fp;
+
+    if (perf_open(&g_perf_phase, 0) == -1 && perf_open(&g_perf_phase, 1) == -1) {
+        int err = errno;
+
+        if ((fp = fopen("/proc/sys/kernel/perf_event_paranoid", "r"))) {
+            if (fscanf(fp, "%15s", paranoid) != 1)
+                strcpy(paranoid, "?");
+            fclose(fp);
+        }
+        fprintf(stderr, "[!] Hardware counters unavailable: %s (perf_event_paranoid=%s)\n",
+                strerror(err), paranoid);
+        g_perf_enabled = 0;
+        return;
+    }
+
+    /* classification never enters the kernel, so user only is fine here */
+    if (perf_open(&g_perf_classify, 1) == -1) {
+        fprintf(stderr, "[!] Unable to open the classification counters: %s\n", strerror(errno));
+        g_perf_enabled = 0;
+    }
+}
+
+
+/*
+ * "perf.<phase>.<counter>=N" plus per entry costs for the walk and
+ * classification and per finding costs for the report.
+ */
+void
+report_perf(void)
+{
+    unsigned long long entries = t_stats.walk.visited;
+    unsigned long long findings = total_findings();
+    int phase, i;
+
+    fprintf(stderr, "perf.kernel_included=%d\n", !g_perf_phase.user_only);
+    for (phase = 0; phase < PHASE_MAX; phase++) {
+        perfgroup_t *pg = phase == PHASE_CLASSIFY ? &g_perf_classify : &g_perf_phase;
+        unsigned long long div = phase == PHASE_REPORT ? findings : entries;
+        const char *per = phase == PHASE_REPORT ? "finding" : "entry";
+
+        for (i = 0; i < PERF_MAX; i++) {
+            if (pg->fds[i] == -1) {
+                fprintf(stderr, "perf.%s.%s=missing\n", g_phase_names[phase], g_perf_names[i]);
+                continue;
+            }
+            fprintf(stderr, "perf.%s.%s=%llu\n", g_phase_names[phase], g_perf_names[i],
+                    g_perf_counts[phase][i]);
+            if (phase != PHASE_IDENTITY && div)
+                fprintf(stderr, "perf.%s.%s_per_%s=%.2f\n", g_phase_names[phase], g_perf_names[i],
+                        per, (double)g_perf_counts[phase][i] / div);
+        }
+    }
+}
+
+
+/*
+ * give the calling thread its ring buffer. this is the only time the trace
+ * lock is taken before the trace is written.
+ */
+void
+trace_thread(const char *name)
+{
+    trace_ring_t *pr;
+
+    if (!g_trace_enabled || t_trace)
+        return;
+    pr = (trace_ring_t *)mem_calloc(MEM_TRACE, sizeof(*pr));
+#ifdef __linux__
+    pr->tid = syscall(SYS_gettid);
+#else
+    pr->tid = (long)getpid();
+#endif
+    pr->thread_name = name;
+
+    pthread_mutex_lock(&g_trace_lock);
+    pr->next = g_trace_rings;
+    g_trace_rings = pr;
+    pthread_mutex_unlock(&g_trace_lock);
+    t_trace = pr;
+}
+
+
+/*
+ * a walker thread takes over the ring of one that has exited, if there is
+ * one, and hands it on when it exits itself. the walks create new threads
+ * for every path, a ring each would add up without bound.
+ */
+void
+trace_worker(void)
+{
+    pthread_mutex_lock(&g_trace_lock);
+    if ((t_trace = g_trace_idle))
+        g_trace_idle = t_trace->idle_next;
+    pthread_mutex_unlock(&g_trace_lock);
+    if (!t_trace)
+        trace_thread("worker");
+    pthread_setspecific(g_trace_key, t_trace);
+}
+
+
+/* the thread exit destructor for g_trace_key */
+void
+trace_release(void *arg)
+{
+    trace_ring_t *pr = (trace_ring_t *)arg;
+
+    pthread_mutex_lock(&g_trace_lock);
+    pr->idle_next = g_trace_idle;
+    g_trace_idle = pr;
+    pthread_mutex_unlock(&g_trace_lock);
+}
+
+
+/*
+ * record a complete span. "detail" is optional; only its last
+ * TRACE_DETAIL_MAX - 1 bytes are kept since the tail of a path says most.
+ */
+void
+trace_span(const char *name, unsigned long long start, unsigned long long end,
+           unsigned long long arg, const char *detail, size_t detail_len)
+{
+    trace_event_t *pev;
+
+    if (!g_trace_enabled)
+        return;
+    if (!t_trace)
+        trace_worker();
+
+    pev = t_trace->events + (t_trace->head++ % TRACE_RING_SIZE);
+    pev->name = name;
+    pev->start_ns = start;
+    pev->dur_ns = end - start;
+    pev->arg = arg;
+    if (detail) {
+        if (detail_len >= TRACE_DETAIL_MAX)
+            detail += detail_len - (TRACE_DETAIL_MAX - 1);
+        if (detail_len >= TRACE_DETAIL_MAX)
+            detail_len = TRACE_DETAIL_MAX - 1;
+        memcpy(pev->detail, detail, detail_len);
+        pev->detail[detail_len] = '\0';
+    }
+    else
+        pev->detail[0] = '\0';
+}
+
+
+/*
+ * dump the rings as Chrome trace event JSON (chrome://tracing, Perfetto UI)
+ */
+void
+trace_write(void)
+{
+    FILE *fp;
+    trace_ring_t *pr;
+    unsigned long long i, first, dropped = 0;
+    int pid = (int)getpid(), comma = 0;
+
+    if (!(fp = fopen(g_trace_file, "w"))) {
+        perror_str("[!] Unable to open trace file \"%s\"", g_trace_file);
+        return;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    pthread_mutex_lock(&g_trace_lock);
+    for (pr = g_trace_rings; pr; pr = pr->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,"
+                "\"args\":{\"name\":\"%s\"}}", comma ? ",\n" : "", pid, pr->tid, pr->thread_name);
+        comma = 1;
+
+        first = pr->head > TRACE_RING_SIZE ? pr->head - TRACE_RING_SIZE : 0;
+        dropped += first;
+        for (i = first; i < pr->head; i++) {
+            trace_event_t *pev = pr->events + (i % TRACE_RING_SIZE);
+            const unsigned char *p;
+
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n\":%llu",
+                    pev->name, pid, pr->tid,
+                    (pev->start_ns - g_trace_base) / 1000.0, pev->dur_ns / 1000.0,
+                    pev->arg);
+            if (pev->detail[0]) {
+                fputs(",\"path\":\"", fp);
+                for (p = (const unsigned char *)pev->detail; *p; p++) {
+                    if (*p == '"' || *p == '\\')
+                        fprintf(fp, "\\%c", *p);
+                    else if (*p < 0x20 || *p >= 0x7f)
+                        fprintf(fp, "\\u%04x", *p);
+                    else
+                        fputc(*p, fp);
+                }
+                fputc('"', fp);
+            }
+            fputs("}}", fp);
+        }
+    }
+    pthread_mutex_unlock(&g_trace_lock);
+    fprintf(fp, "\n],\"otherData\":{\"dropped_spans\":\"%llu\"}}\n", dropped);
+    fclose(fp);
+
+    if (dropped)
+        fprintf(stderr, "[!] The trace rings wrapped, the oldest %llu spans were dropped\n", dropped);
+}
+
+
+unsigned int
+path_hash(const char *path, size_t len)
+{
+    return path_hash_more(2166136261U, path, len);
+}
+
+
+/*
+ * FNV-1a, continued from h. a child's hash follows from its parent's
+ * without going over the whole path again.
+ */
+unsigned int
+path_hash_more(unsigned int h, const char *str, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)str[i]) * 16777619U;
+    return h;
+}
+
+
+void
+index_add_slot(index_t *pidx, unsigned int id)
+{
+    unsigned int i, mask = pidx->nslots - 1;
+
+    for (i = pidx->hash[id] & mask; pidx->slots[i]; i = (i + 1) & mask)
+        ;
+    pidx->slots[i] = id + 1;
+}
+
+
+/*
+ * append the entry at path[0..path_len], whose name starts at name_off.
+ * end[] is only filled in by index_build() once everything is in.
+ */
+unsigned int
+index_add(index_t *pidx, unsigned int parent, const char *path, size_t path_len,
+          size_t name_off, const struct stat *sb)
+{
+    unsigned int id = pidx->count;
+    size_t name_len = path_len - name_off;
+
+    if (id == pidx->size) {
+        if (pidx->size >= INDEX_NONE / 2) {
+            fprintf(stderr, "[!] Too many entries for the index!\n");
+            exit(1);
+        }
+        index_alloc(pidx, pidx->size ? pidx->size * 2 : 1024);
+    }
+
+    if (pidx->pool_len + name_len + 1 > pidx->pool_size) {
+        size_t new_size = pidx->pool_size ? pidx->pool_size * 2 : 65536;
+
+        while (pidx->pool_len + name_len + 1 > new_size)
+            new_size *= 2;
+        if (new_size > (size_t)UINT_MAX + 1) {
+            fprintf(stderr, "[!] Too many names for the index!\n");
+            exit(1);
+        }
+        pidx->pool = (char *)mem_realloc(MEM_INDEX, pidx->pool, pidx->pool_size, new_size);
+        pidx->pool_size = new_size;
+    }
+
+    /* keep the hash table at most half full */
+    if ((id + 1) * 2 > pidx->nslots) {
+        unsigned int old_size = pidx->nslots, i;
+
+        mem_free(MEM_INDEX, pidx->slots, old_size * sizeof(unsigned int));
+        pidx->nslots = old_size ? old_size * 2 : 2048;
+        pidx->slots = (unsigned int *)mem_calloc(MEM_INDEX, pidx->nslots * sizeof(unsigned int));
+        for (i = 0; i < id; i++)
+            index_add_slot(pidx, i);
+    }
+
+    pidx->parent[id] = parent;
+    pidx->end[id] = id + 1;
+    pidx->name[id] = pidx->pool_len;
+    memcpy(pidx->pool + pidx->pool_len, path + name_off, name_len);
+    pidx->pool[pidx->pool_len + name_len] = '\0';
+    pidx->pool_len += name_len + 1;
+    pidx->hash[id] = path_hash(path, path_len);
+    pidx->mode[id] = sb->st_mode;
+    pidx->uid[id] = sb->st_uid;
+    pidx->gid[id] = sb->st_gid;
+    pidx->count++;
+    index_add_slot(pidx, id);
+    return id;
+}
+
+
+/*
+ * look up path[0..len], adding it if it isn't there yet
+ */
+unsigned int
+index_ensure(index_t *pidx, unsigned int parent, const char *path, size_t len)
+{
+    char buf[PATH_MAX + 1];
+    struct stat sb;
+    unsigned int id;
+    size_t name_off = len;
+
+    if ((id = index_lookup(pidx, path, len)) != INDEX_NONE)
+        return id;
+
+    memcpy(buf, path, len);
+    buf[len] = '\0';
+    STAT_INC(lstat_calls);
+    if (lstat(buf, &sb) == -1) {
+        walk_error("Unable to lstat", "", 0, buf, errno);
+        return INDEX_NONE;
+    }
+    while (name_off > 0 && buf[name_off - 1] != '/')
+        name_off--;
+    return index_add(pidx, parent, buf, len, name_off, &sb);
+}
+
+
+/*
+ * rebuild the full path of an entry into buf (PATH_MAX + 1 bytes)
+ */
+size_t
+index_path(index_t *pidx, unsigned int id, char *buf)
+{
+    unsigned int chain[PATH_MAX / 2 + 1];
+    int n = 0;
+    size_t len = 0;
+
+    while (id != INDEX_NONE && n < PATH_MAX / 2 + 1) {
+        chain[n++] = id;
+        id = pidx->parent[id];
+    }
+
+    /* chain[n - 1] is "/", which has an empty name */
+    while (--n > 0) {
+        const char *name = pidx->pool + pidx->name[chain[n - 1]];
+        size_t name_len = strlen(name);
+
+        if (len + 1 + name_len > PATH_MAX)
+            break;
+        buf[len++] = '/';
+        memcpy(buf + len, name, name_len);
+        len += name_len;
+    }
+    if (!len)
+        buf[len++] = '/';
+    buf[len] = '\0';
+    return len;
+}
+
+
+unsigned int
+index_lookup(index_t *pidx, const char *path, size_t len)
+{
+    char buf[PATH_MAX + 1];
+    unsigned int h = path_hash(path, len), mask = pidx->nslots - 1, i;
+
+    if (!pidx->nslots)
+        return INDEX_NONE;
+    for (i = h & mask; pidx->slots[i]; i = (i + 1) & mask) {
+        unsigned int id = pidx->slots[i] - 1;
+
+        if (pidx->hash[id] == h && index_path(pidx, id, buf) == len && !memcmp(buf, path, len))
+            return id;
+    }
+    return INDEX_NONE;
+}
+
+
+int
+root_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/*
+ * index everything below the given canonical paths, plus the directories
+ * above them so queries can check search permission all the way up.
+ *
+ * the roots are walked in sorted order with nested ones dropped. all the
+ * roots below a directory then come one after another, which keeps the
+ * subtree of every entry contiguous, the directories above the roots
+ * included.
+ */
+unsigned int
+index_entry(void *arg, unsigned int parent, const char *path, size_t path_len,
+            size_t name_off, const struct stat *sb)
+{
+    return index_add((index_t *)arg, parent, path, path_len, name_off, sb);
+}
+
+
+index_t *
+index_build(char **roots, int nroots)
+{
+    index_t *pidx = (index_t *)mem_calloc(MEM_INDEX, sizeof(index_t));
+    char **sorted = (char **)mem_alloc(MEM_INDEX, nroots * sizeof(char *));
+    unsigned int id;
+    int i, j;
+
+    chax_t *pc = scan_new(pidx, index_entry);
+
+    memcpy(sorted, roots, nroots * sizeof(char *));
+    qsort(sorted, nroots, sizeof(char *), root_cmp);
+
+    for (i = 0; i < nroots; i++) {
+        const char *root = sorted[i];
+        size_t len = strlen(root), k;
+
+        for (j = 0; j < i; j++) {
+            size_t l = strlen(sorted[j]);
+
+            if (!strncmp(root, sorted[j], l)
+                && (root[l] == '\0' || root[l] == '/' || sorted[j][l - 1] == '/'))
+                break;
+        }
+        if (j < i)
+            continue;
+
+        id = index_ensure(pidx, INDEX_NONE, "/", 1);
+        for (k = 2; k <= len && id != INDEX_NONE; k++) {
+            if (k == len || root[k] == '/')
+                id = index_ensure(pidx, id, root, k);
+        }
+        if (id == INDEX_NONE)
+            continue;
+
+        pidx->roots = (unsigned int *)mem_realloc(MEM_INDEX, pidx->roots,
+                                                  pidx->nroots * sizeof(unsigned int),
+                                                  (pidx->nroots + 1) * sizeof(unsigned int));
+        pidx->roots[pidx->nroots++] = id;
+        chax_walk(pc, root, id);
+    }
+    scan_done(pc);
+    mem_free(MEM_INDEX, sorted, nroots * sizeof(char *));
+    index_finish(pidx);
+    return pidx;
+}
+
+
+void
+index_free(index_t *pidx)
+{
+    size_t n = pidx->size;
+
+    mem_free(MEM_INDEX, pidx->parent, n * sizeof(unsigned int));
+    mem_free(MEM_INDEX, pidx->end, n * sizeof(unsigned int));
+    mem_free(MEM_INDEX, pidx->name, n * sizeof(unsigned int));
+    mem_free(MEM_INDEX, pidx->hash, n * sizeof(unsigned int));
+    mem_free(MEM_INDEX, pidx->mode, n * sizeof(mode_t));
+    mem_free(MEM_INDEX, pidx->uid, n * sizeof(uid_t));
+    mem_free(MEM_INDEX, pidx->gid, n * sizeof(gid_t));
+    mem_free(MEM_INDEX, pidx->pool, pidx->pool_size);
+    mem_free(MEM_INDEX, pidx->slots, pidx->nslots * sizeof(unsigned int));
+    postings_free(&pidx->by_uid, pidx->count);
+    postings_free(&pidx->by_gid, pidx->count);
+    if (pidx->world)
+        mem_free(MEM_INDEX, pidx->world, (pidx->nworld + 1) * sizeof(unsigned int));
+    if (pidx->setid)
+        mem_free(MEM_INDEX, pidx->setid, (pidx->nsetid + 1) * sizeof(unsigned int));
+    mem_free(MEM_INDEX, pidx->roots, pidx->nroots * sizeof(unsigned int));
+    mem_free(MEM_INDEX, pidx, sizeof(index_t));
+}
+
+
+int
+uint_cmp(const void *a, const void *b)
+{
+    unsigned int ua = *(const unsigned int *)a, ub = *(const unsigned int *)b;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+
+/*
+ * group the ids 0..count by vals[id]. the distinct keys are found by
+ * sorting a copy, then it's a counting sort over their positions.
+ */
+void
+postings_build(postings_t *pp, const unsigned int *vals, unsigned int count)
+{
+    unsigned int *tmp = (unsigned int *)mem_alloc(MEM_INDEX, (count + 1) * sizeof(unsigned int));
+    unsigned int *pos = (unsigned int *)mem_alloc(MEM_INDEX, (count + 1) * sizeof(unsigned int));
+    unsigned int i, k;
+
+    memcpy(tmp, vals, count * sizeof(unsigned int));
+    qsort(tmp, count, sizeof(unsigned int), uint_cmp);
+    for (i = k = 0; i < count; i++) {
+        if (!k || tmp[k - 1] != tmp[i])
+            tmp[k++] = tmp[i];
+    }
+    pp->nkeys = k;
+    pp->keys = (unsigned int *)mem_alloc(MEM_INDEX, (k + 1) * sizeof(unsigned int));
+    memcpy(pp->keys, tmp, k * sizeof(unsigned int));
+    mem_free(MEM_INDEX, tmp, (count + 1) * sizeof(unsigned int));
+
+    pp->off = (unsigned int *)mem_calloc(MEM_INDEX, (k + 1) * sizeof(unsigned int));
+    for (i = 0; i < count; i++) {
+        pos[i] = postings_find(pp, vals[i]);
+        pp->off[pos[i] + 1]++;
+    }
+    for (k = 0; k < pp->nkeys; k++)
+        pp->off[k + 1] += pp->off[k];
+
+    /* filled in id order, so each list comes out sorted; off[] is shifted
+     * by one while filling and restored after */
+    pp->ids = (unsigned int *)mem_alloc(MEM_INDEX, (count + 1) * sizeof(unsigned int));
+    for (i = 0; i < count; i++)
+        pp->ids[pp->off[pos[i]]++] = i;
+    for (k = pp->nkeys; k > 0; k--)
+        pp->off[k] = pp->off[k - 1];
+    pp->off[0] = 0;
+    mem_free(MEM_INDEX, pos, (count + 1) * sizeof(unsigned int));
+}
+
+
+/*
+ * returns the position of key in pp->keys, or INDEX_NONE
+ */
+unsigned int
+postings_find(postings_t *pp, unsigned int key)
+{
+    unsigned int lo = 0, hi = pp->nkeys;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (pp->keys[mid] == key)
+            return mid;
+        if (pp->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return INDEX_NONE;
+}
+
+
+/*
+ * set the bits of the ids in [lo, hi) from a sorted list, bit 0 is lo
+ */
+void
+postings_mark(const unsigned int *ids, unsigned int n, unsigned long long *bits,
+              unsigned int lo, unsigned int hi)
+{
+    unsigned int a = 0, b = n;
+
+    /* first id >= lo */
+    while (a < b) {
+        unsigned int mid = a + (b - a) / 2;
+
+        if (ids[mid] < lo)
+            a = mid + 1;
+        else
+            b = mid;
+    }
+    for (; a < n && ids[a] < hi; a++)
+        bits[(ids[a] - lo) / 64] |= 1ULL << ((ids[a] - lo) % 64);
+}
+
+
+void
+postings_free(postings_t *pp, unsigned int count)
+{
+    if (!pp->ids)
+        return;
+    mem_free(MEM_INDEX, pp->keys, (pp->nkeys + 1) * sizeof(unsigned int));
+    mem_free(MEM_INDEX, pp->off, (pp->nkeys + 1) * sizeof(unsigned int));
+    mem_free(MEM_INDEX, pp->ids, (count + 1) * sizeof(unsigned int));
+}
+
+
+/*
+ * the inverted indexes. an identity only gets more than the "other" bits
+ * on entries it owns or whose group it is in, so the candidates for its
+ * findings are the lists for its uid and groups, plus the entries whose
+ * "other" bits alone make them a finding (world), plus the set-id ones,
+ * which root can execute whatever the mode.
+ */
+void
+index_postings(index_t *pidx)
+{
+#ifdef RECORD_LESS_INTERESTING
+    const mode_t world_mask = S_IRWXO;
+#else
+    const mode_t world_mask = S_IWOTH;
+#endif
+    unsigned int *vals = (unsigned int *)mem_alloc(MEM_INDEX, (pidx->count + 1) * sizeof(unsigned int));
+    unsigned int i;
+
+    for (i = 0; i < pidx->count; i++)
+        vals[i] = pidx->uid[i];
+    postings_build(&pidx->by_uid, vals, pidx->count);
+    for (i = 0; i < pidx->count; i++)
+        vals[i] = pidx->gid[i];
+    postings_build(&pidx->by_gid, vals, pidx->count);
+    mem_free(MEM_INDEX, vals, (pidx->count + 1) * sizeof(unsigned int));
+
+    for (i = 0; i < pidx->count; i++) {
+        if (S_ISLNK(pidx->mode[i]))
+            continue;
+        if (pidx->mode[i] & world_mask)
+            pidx->nworld++;
+        if (pidx->mode[i] & (S_ISUID | S_ISGID))
+            pidx->nsetid++;
+    }
+    pidx->world = (unsigned int *)mem_alloc(MEM_INDEX, (pidx->nworld + 1) * sizeof(unsigned int));
+    pidx->setid = (unsigned int *)mem_alloc(MEM_INDEX, (pidx->nsetid + 1) * sizeof(unsigned int));
+    pidx->nworld = pidx->nsetid = 0;
+    for (i = 0; i < pidx->count; i++) {
+        if (S_ISLNK(pidx->mode[i]))
+            continue;
+        if (pidx->mode[i] & world_mask)
+            pidx->world[pidx->nworld++] = i;
+        if (pidx->mode[i] & (S_ISUID | S_ISGID))
+            pidx->setid[pidx->nsetid++] = i;
+    }
+}
+
+
+unsigned long long
+index_bytes(index_t *pidx)
+{
+    return (unsigned long long)pidx->size * (4 * sizeof(unsigned int) + sizeof(mode_t)
+                                             + sizeof(uid_t) + sizeof(gid_t))
+        + pidx->pool_size + pidx->nslots * sizeof(unsigned int)
+        + (2ULL * pidx->count + pidx->nworld + pidx->nsetid) * sizeof(unsigned int)
+        + 2ULL * (pidx->by_uid.nkeys + pidx->by_gid.nkeys) * sizeof(unsigned int);
+}
+
+
+void
+index_alloc(index_t *pidx, unsigned int size)
+{
+    size_t n = pidx->size;
+
+    pidx->parent = (unsigned int *)mem_realloc(MEM_INDEX, pidx->parent, n * sizeof(unsigned int),
+                                               size * sizeof(unsigned int));
+    pidx->end = (unsigned int *)mem_realloc(MEM_INDEX, pidx->end, n * sizeof(unsigned int),
+                                            size * sizeof(unsigned int));
+    pidx->name = (unsigned int *)mem_realloc(MEM_INDEX, pidx->name, n * sizeof(unsigned int),
+                                             size * sizeof(unsigned int));
+    pidx->hash = (unsigned int *)mem_realloc(MEM_INDEX, pidx->hash, n * sizeof(unsigned int),
+                                             size * sizeof(unsigned int));
+    pidx->mode = (mode_t *)mem_realloc(MEM_INDEX, pidx->mode, n * sizeof(mode_t),
+                                       size * sizeof(mode_t));
+    pidx->uid = (uid_t *)mem_realloc(MEM_INDEX, pidx->uid, n * sizeof(uid_t),
+                                     size * sizeof(uid_t));
+    pidx->gid = (gid_t *)mem_realloc(MEM_INDEX, pidx->gid, n * sizeof(gid_t),
+                                     size * sizeof(gid_t));
+    pidx->size = size;
+}
+
+
+/*
+ * in preorder every subtree ends where the last one below it does
+ */
+void
+index_finish(index_t *pidx)
+{
+    unsigned int id;
+
+    for (id = pidx->count; id-- > 0; ) {
+        unsigned int parent = pidx->parent[id];
+
+        if (parent != INDEX_NONE && pidx->end[parent] < pidx->end[id])
+            pidx->end[parent] = pidx->end[id];
+    }
+    index_postings(pidx);
+}
+
+
+/*
+ * recompute the path hashes and the lookup table after a load. parents
+ * come before their children, so each hash follows from one already done.
+ */
+void
+index_rehash(index_t *pidx)
+{
+    unsigned int i;
+
+    for (i = 0; i < pidx->count; i++) {
+        const char *name = pidx->pool + pidx->name[i];
+        unsigned int parent = pidx->parent[i], h;
+
+        pidx->end[i] = i + 1;
+        if (parent == INDEX_NONE) {
+            pidx->hash[i] = path_hash("/", 1);
+            continue;
+        }
+        h = pidx->hash[parent];
+        if (pidx->parent[parent] != INDEX_NONE)
+            h = path_hash_more(h, "/", 1);
+        pidx->hash[i] = path_hash_more(h, name, strlen(name));
+    }
+
+    pidx->nslots = 2048;
+    while (pidx->nslots < pidx->count * 2)
+        pidx->nslots *= 2;
+    pidx->slots = (unsigned int *)mem_calloc(MEM_INDEX, pidx->nslots * sizeof(unsigned int));
+    for (i = 0; i < pidx->count; i++)
+        index_add_slot(pidx, i);
+}
+
+
+int
+snapshot_write_u32(FILE *fp, const void *vals, size_t width, unsigned int n)
+{
+    uint32_t buf[4096];
+    unsigned int i, k;
+
+    if (width == sizeof(uint32_t))
+        return fwrite(vals, sizeof(uint32_t), n, fp) == n ? 0 : -1;
+    for (i = 0; i < n; i += k) {
+        for (k = 0; k < 4096 && i + k < n; k++) {
+            if (width == sizeof(uint16_t))
+                buf[k] = ((const uint16_t *)vals)[i + k];
+            else
+                buf[k] = ((const uint64_t *)vals)[i + k];
+        }
+        if (fwrite(buf, sizeof(uint32_t), k, fp) != k)
+            return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * read n 32-bit values into an array of "width" byte elements, swapping
+ * each one first if the snapshot came from the other byte order
+ */
+int
+snapshot_read_u32(FILE *fp, void *vals, size_t width, unsigned int n, int swap)
+{
+    uint32_t buf[4096];
+    unsigned int i, k;
+
+    if (width == sizeof(uint32_t) && !swap)
+        return fread(vals, sizeof(uint32_t), n, fp) == n ? 0 : -1;
+    for (i = 0; i < n; i += k) {
+        k = n - i < 4096 ? n - i : 4096;
+        if (fread(buf, sizeof(uint32_t), k, fp) != k)
+            return -1;
+        for (k = 0; k < 4096 && i + k < n; k++) {
+            uint32_t val = swap ? __builtin_bswap32(buf[k]) : buf[k];
+
+            if (width == sizeof(uint16_t))
+                ((uint16_t *)vals)[i + k] = val;
+            else if (width == sizeof(uint32_t))
+                ((uint32_t *)vals)[i + k] = val;
+            else
+                ((uint64_t *)vals)[i + k] = val;
+        }
+    }
+    return 0;
+}
+
+
+int
+snapshot_save(index_t *pidx, const char *file)
+{
+    snapshot_hdr_t hdr;
+    FILE *fp;
+    int ret = 0;
+
+    if (!(fp = fopen(file, "we"))) {
+        perror_str("[!] Unable to create \"%s\"", file);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.bom = SNAPSHOT_BOM;
+    hdr.count = pidx->count;
+    hdr.nroots = pidx->nroots;
+    hdr.pool_len = pidx->pool_len;
+    hdr.created = time(NULL);
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+        || snapshot_write_u32(fp, pidx->parent, sizeof(unsigned int), pidx->count) == -1
+        || snapshot_write_u32(fp, pidx->name, sizeof(unsigned int), pidx->count) == -1
+        || snapshot_write_u32(fp, pidx->mode, sizeof(mode_t), pidx->count) == -1
+        || snapshot_write_u32(fp, pidx->uid, sizeof(uid_t), pidx->count) == -1
+        || snapshot_write_u32(fp, pidx->gid, sizeof(gid_t), pidx->count) == -1
+        || snapshot_write_u32(fp, pidx->roots, sizeof(unsigned int), pidx->nroots) == -1
+        || fwrite(pidx->pool, 1, pidx->pool_len, fp) != pidx->pool_len)
+        ret = -1;
+    if (fclose(fp) == EOF)
+        ret = -1;
+    if (ret == -1)
+        perror_str("[!] Unable to write \"%s\"", file);
+    return ret;
+}
+
+
+index_t *
+snapshot_load(const char *file)
+{
+    snapshot_hdr_t hdr;
+    index_t *pidx;
+    struct stat sb;
+    FILE *fp;
+    unsigned int *above, nabove = 0, i;
+    int bad, swap;
+
+    if (!(fp = fopen(file, "re"))) {
+        perror_str("[!] Unable to open \"%s\"", file);
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic))
+        || (hdr.bom != SNAPSHOT_BOM && hdr.bom != __builtin_bswap32(SNAPSHOT_BOM))) {
+        fprintf(stderr, "[!] \"%s\" is not a snapshot\n", file);
+        fclose(fp);
+        return NULL;
+    }
+    if ((swap = hdr.bom != SNAPSHOT_BOM)) {
+        hdr.count = __builtin_bswap32(hdr.count);
+        hdr.nroots = __builtin_bswap32(hdr.nroots);
+        hdr.pool_len = __builtin_bswap64(hdr.pool_len);
+        hdr.created = __builtin_bswap64(hdr.created);
+    }
+
+    /*
+     * nothing is allocated before the header agrees with the file size,
+     * and the largest array (the slots, up to four per entry) and the pool
+     * have to fit a size_t on 32-bit builds too. the pool's offsets are
+     * unsigned ints, which no size_t is smaller than.
+     */
+    bad = fstat(fileno(fp), &sb) == -1
+        || hdr.count > INDEX_NONE / 4
+        || (size_t)hdr.count * 4 * sizeof(unsigned int) / (4 * sizeof(unsigned int)) != hdr.count
+        || hdr.nroots > hdr.count
+        || hdr.pool_len >= UINT_MAX
+        || (uint64_t)sb.st_size != sizeof(hdr) + (uint64_t)hdr.count * 5 * sizeof(uint32_t)
+                                  + (uint64_t)hdr.nroots * sizeof(uint32_t) + hdr.pool_len;
+    if (bad) {
+        fprintf(stderr, "[!] \"%s\" is truncated or corrupt\n", file);
+        fclose(fp);
+        return NULL;
+    }
+
+    pidx = (index_t *)mem_calloc(MEM_INDEX, sizeof(index_t));
+    index_alloc(pidx, hdr.count ? hdr.count : 1);
+    pidx->count = hdr.count;
+    pidx->nroots = hdr.nroots;
+    pidx->roots = (unsigned int *)mem_alloc(MEM_INDEX, pidx->nroots * sizeof(unsigned int));
+    pidx->pool_len = hdr.pool_len;
+    pidx->pool_size = hdr.pool_len + 1;
+    pidx->pool = (char *)mem_alloc(MEM_INDEX, pidx->pool_size);
+
+    bad = snapshot_read_u32(fp, pidx->parent, sizeof(unsigned int), pidx->count, swap) == -1
+        || snapshot_read_u32(fp, pidx->name, sizeof(unsigned int), pidx->count, swap) == -1
+        || snapshot_read_u32(fp, pidx->mode, sizeof(mode_t), pidx->count, swap) == -1
+        || snapshot_read_u32(fp, pidx->uid, sizeof(uid_t), pidx->count, swap) == -1
+        || snapshot_read_u32(fp, pidx->gid, sizeof(gid_t), pidx->count, swap) == -1
+        || snapshot_read_u32(fp, pidx->roots, sizeof(unsigned int), pidx->nroots, swap) == -1
+        || fread(pidx->pool, 1, pidx->pool_len, fp) != pidx->pool_len;
+    fclose(fp);
+    pidx->pool[pidx->pool_len] = '\0';
+
+    /*
+     * everything is used as an index later, so check it all here. the
+     * subtrees have to be in preorder too, index_finish() takes each one
+     * for a range: an entry's parent must be on the stack of directories
+     * still open above the entry before it.
+     */
+    above = (unsigned int *)mem_alloc(MEM_INDEX, (pidx->count + 1) * sizeof(unsigned int));
+    for (i = 0; !bad && i < pidx->count; i++) {
+        unsigned int parent = pidx->parent[i];
+
+        if (pidx->name[i] >= pidx->pool_len)
+            bad = 1;
+        else if (parent == INDEX_NONE) {
+            bad = pidx->pool[pidx->name[i]] != '\0';
+            nabove = 0;
+        }
+        else {
+            while (nabove && above[nabove - 1] != parent)
+                nabove--;
+            bad = !nabove;
+        }
+        above[nabove++] = i;
+    }
+    mem_free(MEM_INDEX, above, (pidx->count + 1) * sizeof(unsigned int));
+    for (i = 0; !bad && i < pidx->nroots; i++)
+        bad = pidx->roots[i] >= pidx->count;
+    if (bad) {
+        fprintf(stderr, "[!] \"%s\" is truncated or corrupt\n", file);
+        index_free(pidx);
+        return NULL;
+    }
+
+    index_rehash(pidx);
+    index_finish(pidx);
+    return pidx;
+}
+
+
+/*
+ * classify everything below dir as scan_directory() would have, from the
+ * index instead of the file system. the path is kept up to date with a
+ * stack of the directories above the current entry.
+ */
+void
+index_eval(index_t *pidx, unsigned int dir)
+{
+    unsigned int stack[PATH_MAX / 2 + 1];
+    size_t lens[PATH_MAX / 2 + 1];
+    char path[PATH_MAX + 1];
+    struct stat sb;
+    unsigned int i = dir + 1, end = pidx->end[dir];
+    int depth = 0;
+
+    memset(&sb, 0, sizeof(sb));
+    stack[0] = dir;
+    lens[0] = index_path(pidx, dir, path);
+
+    while (i < end) {
+        const char *name = pidx->pool + pidx->name[i];
+        size_t len, name_len = strlen(name);
+
+        while (depth > 0 && stack[depth] != pidx->parent[i])
+            depth--;
+        len = lens[depth];
+        if (len + 1 + name_len > PATH_MAX) {
+            i = pidx->end[i];
+            continue;
+        }
+        if (path[len - 1] != '/')
+            path[len++] = '/';
+        memcpy(path + len, name, name_len + 1);
+        len += name_len;
+
+        sb.st_mode = pidx->mode[i];
+        sb.st_uid = pidx->uid[i];
+        sb.st_gid = pidx->gid[i];
+        STAT_INC(entries[chax_etype(sb.st_mode)]);
+        if (S_ISLNK(sb.st_mode)) {
+            i++;
+            continue;
+        }
+
+        record_access_level(path, &sb);
+        if (S_ISDIR(sb.st_mode)) {
+            if (!chax_searchable(g_chax, &sb)) {
+                STAT_INC(dirs_pruned);
+                i = pidx->end[i];
+                continue;
+            }
+            depth++;
+            stack[depth] = i;
+            lens[depth] = len;
+        }
+        i++;
+    }
+}
+
+
+/*
+ * realpath() each argument, like main() does before scanning
+ */
+char **
+canonical_paths(char **paths, int npaths)
+{
+    char canonical_path[PATH_MAX+1] = { 0 };
+    char **out = (char **)mem_alloc(MEM_PATHS, (npaths + 1) * sizeof(char *));
+    int i;
+
+    for (i = 0; i < npaths; i++) {
+        t_stats.realpath_calls++;
+        if (!realpath(paths[i], canonical_path)) {
+            perror_str("[!] Unable to resolve path \"%s\"", paths[i]);
+            return NULL;
+        }
+        out[i] = mem_strdup(MEM_PATHS, canonical_path);
+    }
+    return out;
+}
+
+
+/*
+ * load snapshot_in, or walk the paths into an index and save it to
+ * snapshot_out if given. the findings for the current identity (or the
+ * --what-if delta) then come from the index, for the given paths or else
+ * the ones the snapshot was taken of.
+ */
+int
+eval_main(const char *snapshot_in, const char *snapshot_out, char **paths, int npaths)
+{
+    index_t *pidx;
+    unsigned int i;
+    int j, ret = 0;
+
+    if (snapshot_in) {
+        if (!(pidx = snapshot_load(snapshot_in)))
+            return -1;
+    }
+    else {
+        if (!(paths = canonical_paths(paths, npaths)))
+            return -1;
+        pidx = index_build(paths, npaths);
+        report_errors();
+        if (snapshot_out && snapshot_save(pidx, snapshot_out) == -1)
+            return -1;
+    }
+
+    if (!npaths) {
+        for (i = 0; i < pidx->nroots; i++) {
+            if (g_whatif)
+                whatif_eval(pidx, g_whatif, pidx->roots[i]);
+            else
+                index_eval(pidx, pidx->roots[i]);
+        }
+    }
+    for (j = 0; j < npaths; j++) {
+        size_t len = strlen(paths[j]);
+
+        while (len > 1 && paths[j][len - 1] == '/')
+            len--;
+        if ((i = index_lookup(pidx, paths[j], len)) == INDEX_NONE) {
+            fprintf(stderr, "[!] \"%s\" is not in the snapshot\n", paths[j]);
+            ret = -1;
+            continue;
+        }
+        if (g_whatif)
+            whatif_eval(pidx, g_whatif, i);
+        else
+            index_eval(pidx, i);
+    }
+    if (g_whatif)
+        whatif_report(g_whatif, pidx->count);
+    return ret;
+}
+
+
+int
+gid_cmp(const void *a, const void *b)
+{
+    gid_t ga = *(const gid_t *)a, gb = *(const gid_t *)b;
+
+    return ga < gb ? -1 : ga > gb;
+}
+
+
+int
+ident_in_group(ident_t *pid, gid_t gid)
+{
+    int lo = 0, hi = pid->ngroups;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (pid->groups[mid] == gid)
+            return 1;
+        if (pid->groups[mid] < gid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+
+/*
+ * the same rules as chax_classify(), for any identity
+ */
+unsigned int
+ident_access(ident_t *pid, mode_t mode, uid_t uid, gid_t gid)
+{
+    int owner = uid == pid->uid;
+    int member = (mode & S_IRWXG) && ident_in_group(pid, gid);
+    unsigned int acc = 0;
+
+    if (pid->uid == 0 || (mode & S_IXOTH) || ((mode & S_IXUSR) && owner)
+        || ((mode & S_IXGRP) && member))
+        acc |= ACC_EXEC;
+    if ((mode & S_IWOTH) || ((mode & S_IWUSR) && owner) || ((mode & S_IWGRP) && member))
+        acc |= ACC_WRITE;
+    if ((mode & S_IROTH) || ((mode & S_IRUSR) && owner) || ((mode & S_IRGRP) && member))
+        acc |= ACC_READ;
+    if ((acc & ACC_EXEC) && (mode & S_ISUID))
+        acc |= ACC_SETUID;
+    if ((acc & ACC_EXEC) && (mode & S_ISGID))
+        acc |= ACC_SETGID;
+    return acc;
+}
+
+
+unsigned int
+index_access(index_t *pidx, ident_t *pid, unsigned int id)
+{
+    unsigned int acc = ident_access(pid, pidx->mode[id], pidx->uid[id], pidx->gid[id]);
+    unsigned int p;
+
+    for (p = pidx->parent[id]; p != INDEX_NONE; p = pidx->parent[p]) {
+        if (!(ident_access(pid, pidx->mode[p], pidx->uid[p], pidx->gid[p]) & ACC_EXEC))
+            return acc;
+    }
+    return acc | ACC_REACHABLE;
+}
+
+
+/*
+ * can the identity search every directory from dir up to stop, which is
+ * known to be reachable already
+ */
+int
+index_reachable(index_t *pidx, ident_t *pid, unsigned int dir, unsigned int stop,
+                reach_cache_t *pc)
+{
+    unsigned int slot = dir & (REACH_CACHE_SIZE - 1);
+    int ok;
+
+    if (dir == stop)
+        return 1;
+    if (dir == INDEX_NONE)
+        return 0;
+    if (pc->ids[slot] == dir)
+        return pc->ok[slot];
+    ok = (ident_access(pid, pidx->mode[dir], pidx->uid[dir], pidx->gid[dir]) & ACC_EXEC)
+        && index_reachable(pidx, pid, pidx->parent[dir], stop, pc);
+    pc->ids[slot] = dir;
+    pc->ok[slot] = ok;
+    return ok;
+}
+
+
+/*
+ * the findings below dir, which the identity can reach. the candidates
+ * from the inverted indexes are marked in a bitmap over dir's id range and
+ * checked in preorder, so the reply comes out as a range walk would.
+ */
+unsigned int
+index_findings(index_t *pidx, ident_t *pid, unsigned int dir, char **pbuf, size_t *plen,
+               size_t *psize)
+{
+    unsigned int lo = dir + 1, hi = pidx->end[dir], count = 0, k, w;
+    size_t nwords = (hi - lo + 63) / 64 + 1;
+    unsigned long long *bits;
+    reach_cache_t *pc;
+    int g;
+
+#ifdef RECORD_LESS_INTERESTING
+    /* root executes anything, so every entry is a finding, listed or not */
+    if (pid->uid == 0) {
+        for (k = lo; k < hi; k++) {
+            unsigned int acc = ident_access(pid, pidx->mode[k], pidx->uid[k], pidx->gid[k]) | ACC_REACHABLE;
+
+            if (access_is_finding(acc, pidx->mode[k])) {
+                reply_add(pbuf, plen, psize, acc, pidx, k);
+                count++;
+            }
+        }
+        return count;
+    }
+#endif
+
+    bits = (unsigned long long *)mem_calloc(MEM_SERVE, nwords * 8);
+    pc = (reach_cache_t *)mem_alloc(MEM_SERVE, sizeof(reach_cache_t));
+    postings_mark(pidx->world, pidx->nworld, bits, lo, hi);
+    postings_mark(pidx->setid, pidx->nsetid, bits, lo, hi);
+    if ((k = postings_find(&pidx->by_uid, pid->uid)) != INDEX_NONE)
+        postings_mark(pidx->by_uid.ids + pidx->by_uid.off[k],
+                      pidx->by_uid.off[k + 1] - pidx->by_uid.off[k], bits, lo, hi);
+    for (g = 0; g < pid->ngroups; g++) {
+        if ((k = postings_find(&pidx->by_gid, pid->groups[g])) != INDEX_NONE)
+            postings_mark(pidx->by_gid.ids + pidx->by_gid.off[k],
+                          pidx->by_gid.off[k + 1] - pidx->by_gid.off[k], bits, lo, hi);
+    }
+
+    memset(pc->ids, 0xff, sizeof(pc->ids));
+    for (w = 0; w < nwords; w++) {
+        unsigned long long word = bits[w];
+
+        while (word) {
+            unsigned int id = lo + w * 64 + __builtin_ctzll(word);
+            unsigned int acc;
+
+            word &= word - 1;
+            if (!index_reachable(pidx, pid, pidx->parent[id], dir, pc))
+                continue;
+            acc = ident_access(pid, pidx->mode[id], pidx->uid[id], pidx->gid[id]) | ACC_REACHABLE;
+            if (access_is_finding(acc, pidx->mode[id])) {
+                reply_add(pbuf, plen, psize, acc, pidx, id);
+                count++;
+            }
+        }
+    }
+    mem_free(MEM_SERVE, pc, sizeof(reach_cache_t));
+    mem_free(MEM_SERVE, bits, nwords * 8);
+    return count;
+}
+
+
+/*
+ * would record_access_level() have kept it
+ */
+int
+access_is_finding(unsigned int acc, mode_t mode)
+{
+    if (S_ISLNK(mode) || !(acc & ACC_REACHABLE))
+        return 0;
+#ifdef RECORD_LESS_INTERESTING
+    return (acc & (ACC_SETUID | ACC_SETGID | ACC_WRITE | ACC_READ | ACC_EXEC)) != 0;
+#else
+    return (acc & (ACC_SETUID | ACC_SETGID | ACC_WRITE)) != 0;
+#endif
+}
+
+
+/*
+ * the bucket record_access_level() would put it in, or -1
+ */
+int
+access_class(unsigned int acc, mode_t mode)
+{
+    if (!access_is_finding(acc, mode))
+        return -1;
+    if (acc & ACC_SETUID)
+        return 0;
+    if (acc & ACC_SETGID)
+        return 1;
+    if (acc & ACC_WRITE)
+        return 2;
+    return (acc & ACC_READ) ? 3 : 4;
+}
+
+
+/*
+ * file id under what it was and what it would be, if those differ.
+ * returns whether either identity can search it.
+ */
+int
+whatif_entry(index_t *pidx, whatif_t *pw, unsigned int id, int reach_a, int reach_b)
+{
+    mode_t mode = pidx->mode[id];
+    unsigned int acc_a = ident_access(&pw->before, mode, pidx->uid[id], pidx->gid[id]);
+    unsigned int acc_b = ident_access(&pw->after, mode, pidx->uid[id], pidx->gid[id]);
+    int ca = access_class(acc_a | (reach_a ? ACC_REACHABLE : 0), mode);
+    int cb = access_class(acc_b | (reach_b ? ACC_REACHABLE : 0), mode);
+
+    pw->checked++;
+    if (ca != cb) {
+        char path[PATH_MAX + 1];
+        struct stat sb;
+
+        memset(&sb, 0, sizeof(sb));
+        sb.st_mode = mode;
+        sb.st_uid = pidx->uid[id];
+        sb.st_gid = pidx->gid[id];
+        index_path(pidx, id, path);
+        if (ca >= 0)
+            record_access(&g_whatif_lost[ca], path, &sb);
+        if (cb >= 0)
+            record_access(&g_whatif_gained[cb], path, &sb);
+    }
+    return ((acc_a & ACC_EXEC) && reach_a) || ((acc_b & ACC_EXEC) && reach_b);
+}
+
+
+/*
+ * only entries in the changed group can differ by themselves. when one of
+ * them is a directory that only one side can search, everything below it
+ * is compared as well, and the rest of the tree is never looked at.
+ */
+void
+whatif_eval(index_t *pidx, whatif_t *pw, unsigned int dir)
+{
+    unsigned int lo = dir + 1, hi = pidx->end[dir], skip = 0, k, a, b, n, i;
+    const unsigned int *ids;
+
+    if ((k = postings_find(&pidx->by_gid, pw->gid)) == INDEX_NONE)
+        return;
+    ids = pidx->by_gid.ids + pidx->by_gid.off[k];
+    n = pidx->by_gid.off[k + 1] - pidx->by_gid.off[k];
+    memset(pw->cache_a.ids, 0xff, sizeof(pw->cache_a.ids));
+    memset(pw->cache_b.ids, 0xff, sizeof(pw->cache_b.ids));
+
+    /* first id >= lo */
+    for (a = 0, b = n; a < b; ) {
+        unsigned int mid = a + (b - a) / 2;
+
+        if (ids[mid] < lo)
+            a = mid + 1;
+        else
+            b = mid;
+    }
+    for (; a < n && ids[a] < hi; a++) {
+        unsigned int id = ids[a], parent = pidx->parent[id];
+        int reach_a, reach_b;
+
+        if (id < skip || S_ISLNK(pidx->mode[id]))
+            continue;
+        reach_a = index_reachable(pidx, &pw->before, parent, dir, &pw->cache_a);
+        reach_b = index_reachable(pidx, &pw->after, parent, dir, &pw->cache_b);
+        if (!reach_a && !reach_b)
+            continue;
+        whatif_entry(pidx, pw, id, reach_a, reach_b);
+        if (!S_ISDIR(pidx->mode[id])
+            || index_reachable(pidx, &pw->before, id, dir, &pw->cache_a)
+               == index_reachable(pidx, &pw->after, id, dir, &pw->cache_b))
+            continue;
+
+        for (i = id + 1; i < pidx->end[id]; ) {
+            parent = pidx->parent[i];
+            reach_a = index_reachable(pidx, &pw->before, parent, dir, &pw->cache_a);
+            reach_b = index_reachable(pidx, &pw->after, parent, dir, &pw->cache_b);
+            if (S_ISLNK(pidx->mode[i]) || (!reach_a && !reach_b))
+                i = pidx->end[i];
+            else if (!whatif_entry(pidx, pw, i, reach_a, reach_b))
+                i = pidx->end[i];
+            else
+                i++;
+        }
+        skip = pidx->end[id];
+    }
+}
+
+
+/*
+ * parse [+-]GROUP for --what-if
+ */
+int
+whatif_parse(whatif_t *pw, const char *spec)
+{
+    struct group *pg;
+    char *endptr;
+    unsigned long gid;
+
+    if (*spec != '+' && *spec != '-') {
+        fprintf(stderr, "[!] Give the group to add as +GROUP or to drop as -GROUP: %s\n", spec);
+        return -1;
+    }
+    pw->add = *spec++ == '+';
+    if ((pg = g_names->getgrnam(spec))) {
+        pw->gid = pg->gr_gid;
+        return 0;
+    }
+    gid = strtoul(spec, &endptr, 0);
+    if (!*spec || *endptr != '\0' || gid == ULONG_MAX) {
+        fprintf(stderr, "[!] Unknown/invalid group: %s\n", spec);
+        return -1;
+    }
+    pw->gid = gid;
+    return 0;
+}
+
+
+/*
+ * the identity from -u/-g, and the same with the group added or dropped
+ */
+void
+whatif_init(whatif_t *pw)
+{
+    const char *grname = gid_name(pw->gid);
+    const gid_t *groups;
+    uid_t uid;
+    int i, n = 0, ngroups = chax_identity(g_chax, &uid, &groups);
+
+    pw->before.uid = pw->after.uid = uid;
+    pw->before.ngroups = ngroups;
+    pw->before.groups = (gid_t *)mem_alloc(MEM_SERVE, (ngroups + 1) * sizeof(gid_t));
+    memcpy(pw->before.groups, groups, ngroups * sizeof(gid_t));
+    qsort(pw->before.groups, ngroups, sizeof(gid_t), gid_cmp);
+
+    pw->after.groups = (gid_t *)mem_alloc(MEM_SERVE, (ngroups + 1) * sizeof(gid_t));
+    for (i = 0; i < ngroups; i++) {
+        if (pw->before.groups[i] != pw->gid)
+            pw->after.groups[n++] = pw->before.groups[i];
+    }
+    if (pw->add)
+        pw->after.groups[n++] = pw->gid;
+    pw->after.ngroups = n;
+    qsort(pw->after.groups, n, sizeof(gid_t), gid_cmp);
+
+    if (pw->add == ident_in_group(&pw->before, pw->gid))
+        fprintf(stderr, "[!] The identity is %s in group %u, nothing will change\n",
+                pw->add ? "already" : "not", pw->gid);
+    if (grname)
+        printf("[*] What if group %u(%s) were %s\n", pw->gid, grname, pw->add ? "added" : "dropped");
+    else
+        printf("[*] What if group %u(?) were %s\n", pw->gid, pw->add ? "added" : "dropped");
+}
+
+
+void
+whatif_report(whatif_t *pw, unsigned int total)
+{
+    char name[64];
+    int c, changed = 0;
+
+    for (c = 0; c < ACCESS_CLASSES; c++) {
+        if (g_whatif_lost[c].idx) {
+            sprintf(name, "no longer %s", chax_class_name(c));
+            report_findings(name, &g_whatif_lost[c]);
+            changed = 1;
+        }
+        if (g_whatif_gained[c].idx) {
+            sprintf(name, "newly %s", chax_class_name(c));
+            report_findings(name, &g_whatif_gained[c]);
+            changed = 1;
+        }
+    }
+    if (!changed)
+        fprintf(stderr, "[*] Nothing changes\n");
+    fprintf(stderr, "[*] Compared %llu of %u entries\n", pw->checked, total);
+}
+
+
+/*
+ * wait for a non-blocking fd until the deadline (now_ns() time) passes
+ */
+int
+io_wait(int fd, short events, unsigned long long deadline)
+{
+    struct pollfd pfd;
+    unsigned long long now;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+        if ((now = now_ns()) >= deadline)
+            return -1;
+        ret = poll(&pfd, 1, (deadline - now) / 1000000 + 1);
+    } while (ret == -1 && errno == EINTR);
+    return ret > 0 ? 0 : -1;
+}
+
+
+/*
+ * read_full() and write_full() block, or with a deadline (0 for none) wait
+ * on a non-blocking fd for no longer than that
+ */
+int
+read_full(int fd, void *buf, size_t len, unsigned long long deadline)
+{
+    char *p = (char *)buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN && deadline) {
+            if (io_wait(fd, POLLIN, deadline) == -1)
+                return -1;
+            continue;
+        }
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+int
+write_full(int fd, const void *buf, size_t len, unsigned long long deadline)
+{
+    const char *p = (const char *)buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN && deadline) {
+            if (io_wait(fd, POLLOUT, deadline) == -1)
+                return -1;
+            continue;
+        }
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+void
+reply_add(char **pbuf, size_t *plen, size_t *psize, unsigned int acc, index_t *pidx,
+          unsigned int id)
+{
+    char path[PATH_MAX + 1];
+    size_t path_len = index_path(pidx, id, path);
+    reply_rec_t rec;
+
+    if (*plen + sizeof(rec) + path_len > *psize) {
+        size_t new_size = *psize ? *psize * 2 : 65536;
+
+        while (*plen + sizeof(rec) + path_len > new_size)
+            new_size *= 2;
+        *pbuf = (char *)mem_realloc(MEM_SERVE, *pbuf, *psize, new_size);
+        *psize = new_size;
+    }
+    rec.access = acc;
+    rec.mode = pidx->mode[id];
+    rec.uid = pidx->uid[id];
+    rec.gid = pidx->gid[id];
+    rec.path_len = path_len;
+    memcpy(*pbuf + *plen, &rec, sizeof(rec));
+    memcpy(*pbuf + *plen + sizeof(rec), path, path_len);
+    *plen += sizeof(rec) + path_len;
+}
+
+
+/*
+ * answer one request on fd. the reply is built in *pbuf, which is kept
+ * around for the next one. returns -1 when the connection should go.
+ *
+ * from its first byte to the last byte of the reply a request gets
+ * SERVE_IO_TIMEOUT seconds in all, so a client that trickles its request
+ * or doesn't read the reply holds the others up for no longer than that.
+ */
+int
+serve_request(int fd, char **pbuf, size_t *psize)
+{
+    index_t *pidx = g_index;
+    query_hdr_t qh;
+    reply_hdr_t rh;
+    ident_t ident;
+    char path[PATH_MAX + 1];
+    size_t len = sizeof(reply_hdr_t), path_len, groups_size;
+    unsigned int id, acc, count = 0, i;
+    unsigned long long deadline = now_ns() + SERVE_IO_TIMEOUT * 1000000000ULL;
+    int ret = -1;
+
+    if (read_full(fd, &qh, sizeof(qh), deadline) == -1)
+        return -1;
+    if (qh.magic != QUERY_MAGIC || qh.ngroups > NGROUPS_MAX || !qh.path_len || qh.path_len > PATH_MAX)
+        return -1;
+
+    ident.uid = qh.uid;
+    ident.ngroups = qh.ngroups;
+    groups_size = qh.ngroups + ((qh.flags & QUERY_F_USER_GROUPS) ? NGROUPS_MAX : 0);
+    ident.groups = (gid_t *)mem_alloc(MEM_SERVE, (groups_size + 1) * sizeof(gid_t));
+    for (i = 0; i < qh.ngroups; i++) {
+        uint32_t gid;
+
+        if (read_full(fd, &gid, sizeof(gid), deadline) == -1)
+            goto out;
+        ident.groups[i] = gid;
+    }
+    if (read_full(fd, path, qh.path_len, deadline) == -1)
+        goto out;
+    path_len = qh.path_len;
+    while (path_len > 1 && path[path_len - 1] == '/')
+        path_len--;
+    path[path_len] = '\0';
+
+    if (qh.flags & QUERY_F_USER_GROUPS) {
+        struct passwd *pw = g_names->getpwuid(qh.uid);
+        int n = NGROUPS_MAX;
+
+        if (pw && g_names->getgrouplist(pw->pw_name, pw->pw_gid, ident.groups + ident.ngroups, &n) != -1)
+            ident.ngroups += n;
+    }
+    qsort(ident.groups, ident.ngroups, sizeof(gid_t), gid_cmp);
+
+    memset(&rh, 0, sizeof(rh));
+    id = index_lookup(pidx, path, path_len);
+    if (id == INDEX_NONE)
+        rh.status = ENOENT;
+    else if (qh.op == QUERY_POINT) {
+        reply_add(pbuf, &len, psize, index_access(pidx, &ident, id), pidx, id);
+        count++;
+    }
+    else if (qh.op == QUERY_PREFIX) {
+        acc = index_access(pidx, &ident, id);
+        if (!(acc & ACC_REACHABLE) || !(acc & ACC_EXEC) || !S_ISDIR(pidx->mode[id]))
+            rh.status = S_ISDIR(pidx->mode[id]) ? EACCES : ENOTDIR;
+        else if (!(qh.flags & QUERY_F_ALL))
+            count = index_findings(pidx, &ident, id, pbuf, &len, psize);
+        else {
+            /* preorder, so an unsearchable directory is skipped as a range */
+            for (i = id + 1; i < pidx->end[id]; ) {
+                acc = ident_access(&ident, pidx->mode[i], pidx->uid[i], pidx->gid[i]) | ACC_REACHABLE;
+                reply_add(pbuf, &len, psize, acc, pidx, i);
+                count++;
+                if (S_ISDIR(pidx->mode[i]) && !(acc & ACC_EXEC))
+                    i = pidx->end[i];
+                else
+                    i++;
+            }
+        }
+    }
+    else
+        rh.status = EINVAL;
+
+    if (len > *psize) {
+        *pbuf = (char *)mem_realloc(MEM_SERVE, *pbuf, *psize, 65536);
+        *psize = 65536;
+    }
+    rh.magic = QUERY_MAGIC;
+    rh.count = count;
+    rh.entries = pidx->count;
+    memcpy(*pbuf, &rh, sizeof(rh));
+    ret = write_full(fd, *pbuf, len, deadline);
+
+out:
+    mem_free(MEM_SERVE, ident.groups, (groups_size + 1) * sizeof(gid_t));
+    return ret;
+}
+
+
+/*
+ * build a fresh index in the background. the serve loop swaps it in
+ * between requests when woken through the pipe.
+ *
+ * this is a full walk on purpose: chmod and chown don't touch the parent
+ * directory's mtime, so skipping directories that look unchanged would
+ * miss exactly the changes that matter here.
+ */
+void *
+rescan_main(void *arg)
+{
+    unsigned long long start = now_ns();
+    index_t *pidx;
+    char c = 0;
+
+    pidx = index_build(g_serve_roots, g_serve_nroots);
+    report_errors();
+    errors_reset();
+    fprintf(stderr, "[*] Rescanned %u entries in %.2fs\n", pidx->count, (now_ns() - start) / 1e9);
+    __atomic_store_n(&g_index_next, pidx, __ATOMIC_RELEASE);
+    if (write(g_rescan_pipe[1], &c, 1) != 1)
+        perror("[!] Unable to wake the server");
+    return NULL;
+}
+
+
+void
+serve_signal(int sig)
+{
+    g_serve_stop = 1;
+}
+
+
+int
+serve(const char *sock_path, char **dirs, int ndirs)
+{
+    struct pollfd pfds[2 + SERVE_MAX_CLIENTS];
+    struct sockaddr_un sa;
+    struct sigaction sact;
+    struct stat sb;
+    pthread_t rescan_thread;
+    char *buf = NULL;
+    size_t buf_size = 0;
+    unsigned long long start, next_rescan = 0;
+    int lfd, nclients = 0, rescanning = 0, i;
+    mode_t old_umask;
+
+    if (!ndirs && !g_snapshot_in) {
+        fprintf(stderr, "[!] Nothing to index, give at least one path\n");
+        return 1;
+    }
+    if (strlen(sock_path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "[!] Socket path too long \"%s\"\n", sock_path);
+        return 1;
+    }
+
+    start = now_ns();
+    if (g_snapshot_in) {
+        /* there is nothing to rescan */
+        if (!(g_index = snapshot_load(g_snapshot_in)))
+            return 1;
+        g_rescan_secs = 0;
+    }
+    else {
+        if (!(g_serve_roots = canonical_paths(dirs, ndirs)))
+            return 1;
+        g_serve_nroots = ndirs;
+        g_index = index_build(g_serve_roots, g_serve_nroots);
+        report_errors();
+        errors_reset();
+    }
+    fprintf(stderr, "[*] Indexed %u entries in %.2fs (%llu KiB)\n", g_index->count,
+            (now_ns() - start) / 1e9, index_bytes(g_index) / 1024);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, sock_path);
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("[!] Unable to create socket");
+        return 1;
+    }
+
+    /* a socket left behind by an earlier run is replaced, a live one isn't */
+    if (lstat(sock_path, &sb) == 0) {
+        if (!S_ISSOCK(sb.st_mode) || connect(lfd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+            fprintf(stderr, "[!] \"%s\" is in use\n", sock_path);
+            return 1;
+        }
+        unlink(sock_path);
+    }
+
+    /* the index shows everything we could see, only let our own user in */
+    old_umask = umask(077);
+    if (bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        perror_str("[!] Unable to bind \"%s\"", sock_path);
+        return 1;
+    }
+    umask(old_umask);
+    if (listen(lfd, SERVE_MAX_CLIENTS) == -1 || pipe2(g_rescan_pipe, O_CLOEXEC) == -1) {
+        perror("[!] Unable to listen");
+        unlink(sock_path);
+        return 1;
+    }
+
+    memset(&sact, 0, sizeof(sact));
+    sact.sa_handler = serve_signal;
+    sigaction(SIGINT, &sact, NULL);
+    sigaction(SIGTERM, &sact, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "[*] Serving queries on %s\n", sock_path);
+    pfds[0].fd = lfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = g_rescan_pipe[0];
+    pfds[1].events = POLLIN;
+    if (g_rescan_secs)
+        next_rescan = now_ns() + g_rescan_secs * 1000000000ULL;
+
+    while (!g_serve_stop) {
+        int timeout = -1;
+
+        if (g_rescan_secs && !rescanning) {
+            unsigned long long now = now_ns();
+
+            if (now >= next_rescan) {
+                sigset_t set, old;
+
+                /* SIGINT and SIGTERM have to interrupt our poll, not the rescan */
+                sigemptyset(&set);
+                sigaddset(&set, SIGINT);
+                sigaddset(&set, SIGTERM);
+                pthread_sigmask(SIG_BLOCK, &set, &old);
+                if (pthread_create(&rescan_thread, NULL, rescan_main, NULL) == 0)
+                    rescanning = 1;
+                else
+                    next_rescan = now + g_rescan_secs * 1000000000ULL;
+                pthread_sigmask(SIG_SETMASK, &old, NULL);
+                continue;
+            }
+            timeout = (next_rescan - now) / 1000000 + 1;
+        }
+
+        if (poll(pfds, 2 + nclients, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("[!] Unable to poll");
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            char c;
+
+            if (read(g_rescan_pipe[0], &c, 1) == 1) {
+                pthread_join(rescan_thread, NULL);
+                rescanning = 0;
+                index_free(g_index);
+                g_index = __atomic_load_n(&g_index_next, __ATOMIC_ACQUIRE);
+                g_index_next = NULL;
+                next_rescan = now_ns() + g_rescan_secs * 1000000000ULL;
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            /* non-blocking, serve_request() bounds the time a client gets */
+            int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+            if (cfd != -1 && nclients == SERVE_MAX_CLIENTS)
+                close(cfd);
+            else if (cfd != -1) {
+                pfds[2 + nclients].fd = cfd;
+                pfds[2 + nclients].events = POLLIN;
+                pfds[2 + nclients].revents = 0;
+                nclients++;
+            }
+        }
+
+        for (i = 0; i < nclients; i++) {
+            struct pollfd *pp = pfds + 2 + i;
+
+            if (!pp->revents)
+                continue;
+            if ((pp->revents & POLLIN) && serve_request(pp->fd, &buf, &buf_size) == 0) {
+                pp->revents = 0;
+                continue;
+            }
+            close(pp->fd);
+            *pp = pfds[2 + --nclients];
+            i--;
+        }
+    }
+
+    fprintf(stderr, "[*] Shutting down\n");
+    for (i = 0; i < nclients; i++)
+        close(pfds[2 + i].fd);
+    close(lfd);
+    unlink(sock_path);
+    return 0;
+}
+
+
+/*
+ * print one point query answer
+ */
+void
+query_print(const char *path, unsigned int acc, struct stat *sb)
+{
+    const char *pwname = uid_name(sb->st_uid);
+    const char *grname = gid_name(sb->st_gid);
+    char tmpu[128], tmpg[128];
+
+    if (!pwname)
+        sprintf(tmpu, "%lu", (unsigned long)sb->st_uid);
+    if (!grname)
+        sprintf(tmpg, "%lu", (unsigned long)sb->st_gid);
+    printf("    %c%c%c%s%s %04o %s %s %s%s\n",
+           (acc & ACC_READ) ? 'r' : '-',
+           (acc & ACC_WRITE) ? 'w' : '-',
+           (acc & ACC_EXEC) ? 'x' : '-',
+           (acc & ACC_SETUID) ? " set-uid" : "",
+           (acc & ACC_SETGID) ? " set-gid" : "",
+           sb->st_mode & ~S_IFMT,
+           pwname ? pwname : tmpu,
+           grname ? grname : tmpg,
+           path,
+           (acc & ACC_REACHABLE) ? "" : " (unreachable)");
+}
+
+
+/*
+ * file a prefix query answer the way record_access_level() would have
+ */
+void
+record_reply(const char *path, unsigned int acc, struct stat *sb)
+{
+    if (acc & ACC_SETUID)
+        record_access(&g_findings[CHAX_SETUID], path, sb);
+    else if (acc & ACC_SETGID)
+        record_access(&g_findings[CHAX_SETGID], path, sb);
+    else if (acc & ACC_WRITE)
+        record_access(&g_findings[CHAX_WRITABLE], path, sb);
+#ifdef RECORD_LESS_INTERESTING
+    else if (acc & ACC_READ)
+        record_access(&g_findings[CHAX_READABLE], path, sb);
+    else if (acc & ACC_EXEC)
+        record_access(&g_findings[CHAX_EXECUTABLE], path, sb);
+#endif
+}
+
+
+/*
+ * ask a --serve instance about each path as the identity from -u/-g
+ */
+int
+query_main(const char *sock_path, int op, char **paths, int npaths)
+{
+    char canonical_path[PATH_MAX+1] = { 0 };
+    char path[PATH_MAX + 1];
+    struct sockaddr_un sa;
+    uint32_t *wire_groups;
+    const gid_t *groups;
+    uid_t uid;
+    int fd, i, ret = 0, ngroups = chax_identity(g_chax, &uid, &groups);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, sock_path, sizeof(sa.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+        || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        perror_str("[!] Unable to connect to \"%s\"", sock_path);
+        return 1;
+    }
+
+    wire_groups = (uint32_t *)mem_alloc(MEM_SERVE, (ngroups + 1) * sizeof(uint32_t));
+    for (i = 0; i < ngroups; i++)
+        wire_groups[i] = groups[i];
+
+    for (i = 0; i < npaths; i++) {
+        const char *qpath = paths[i];
+        query_hdr_t qh;
+        reply_hdr_t rh;
+        reply_rec_t rec;
+        unsigned int k;
+
+        /* the index has canonical paths, resolve ours if it exists here too */
+        if (realpath(paths[i], canonical_path))
+            qpath = canonical_path;
+        if (strlen(qpath) > PATH_MAX) {
+            fprintf(stderr, "[!] name too long \"%s\"\n", qpath);
+            ret = 1;
+            continue;
+        }
+
+        qh.magic = QUERY_MAGIC;
+        qh.op = op;
+        qh.flags = 0;
+        qh.path_len = strlen(qpath);
+        qh.uid = uid;
+        qh.ngroups = ngroups;
+        if (write_full(fd, &qh, sizeof(qh), 0) == -1
+            || write_full(fd, wire_groups, ngroups * sizeof(uint32_t), 0) == -1
+            || write_full(fd, qpath, qh.path_len, 0) == -1
+            || read_full(fd, &rh, sizeof(rh), 0) == -1 || rh.magic != QUERY_MAGIC) {
+            fprintf(stderr, "[!] Query for \"%s\" failed\n", qpath);
+            ret = 1;
+            break;
+        }
+        if (rh.status) {
+            fprintf(stderr, "[!] \"%s\": %s\n", qpath, strerror(rh.status));
+            ret = 1;
+            continue;
+        }
+
+        for (k = 0; k < rh.count; k++) {
+            struct stat sb;
+
+            if (read_full(fd, &rec, sizeof(rec), 0) == -1 || rec.path_len > PATH_MAX
+                || read_full(fd, path, rec.path_len, 0) == -1) {
+                fprintf(stderr, "[!] Truncated reply for \"%s\"\n", qpath);
+                ret = 1;
+                goto out;
+            }
+            path[rec.path_len] = '\0';
+            memset(&sb, 0, sizeof(sb));
+            sb.st_mode = rec.mode;
+            sb.st_uid = rec.uid;
+            sb.st_gid = rec.gid;
+            if (op == QUERY_POINT)
+                query_print(path, rec.access, &sb);
+            else
+                record_reply(path, rec.access, &sb);
+        }
+    }
+
+out:
+    close(fd);
+    mem_free(MEM_SERVE, wire_groups, (ngroups + 1) * sizeof(uint32_t));
+    if (op == QUERY_PREFIX)
+        report_all_findings();
+    return ret;
+}
+
+
+void
+acct_add(acct_t **parr, unsigned int *pcount, unsigned int *psize, const char *name,
+         unsigned int id, unsigned int gid, const char *members)
+{
+    acct_t *pa;
+
+    if (*pcount == *psize) {
+        unsigned int new_size = *psize ? *psize * 2 : 64;
+
+        *parr = (acct_t *)mem_realloc(MEM_NAMES, *parr, *psize * sizeof(acct_t),
+                                      new_size * sizeof(acct_t));
+        *psize = new_size;
+    }
+    pa = *parr + *pcount;
+    pa->name = mem_strdup(MEM_NAMES, name);
+    pa->id = id;
+    pa->gid = gid;
+    pa->seq = *pcount;
+    pa->members = members ? mem_strdup(MEM_NAMES, members) : NULL;
+    (*pcount)++;
+}
+
 
-    /* get user info */
-    obtain_user_info(user, groups);
+/*
+ * read a passwd ("name:pw:uid:gid:...") or group ("name:pw:gid:members")
+ * file for --who -R.
+ */
+int
+acct_parse(acctdb_t *pdb, const char *path, int is_group)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
 
-    /* process remaining args as directories */
-    for (i = 0; i < argc; i++) {
-        if (!realpath(argv[i], canonical_path)) {
-            perror_str("[!] Unable to resolve path \"%s\"", argv[i]);
-            return 1;
+    if (!(fp = fopen(path, "re")))
+        return -1;
+    while ((n = getline(&line, &cap, fp)) != -1) {
+        char *field[4] = { line, NULL, NULL, NULL };
+        char *p = line, *endptr;
+        unsigned long id, gid = 0;
+        int i;
+
+        if (n > 0 && line[n - 1] == '\n')
+            line[n - 1] = '\0';
+        if (line[0] == '#' || line[0] == '+' || line[0] == '-')
+            continue;
+        for (i = 1; i < 4 && (p = strchr(p, ':')); i++) {
+            *p++ = '\0';
+            field[i] = p;
         }
+        if (i < 4 || !field[0][0])
+            continue;
+        if ((p = strchr(field[3], ':')))
+            *p = '\0';
 
-        scan_directory(canonical_path);
+        id = strtoul(field[2], &endptr, 10);
+        if (endptr == field[2] || *endptr)
+            continue;
+        if (is_group) {
+            acct_add(&pdb->groups, &pdb->ngroups, &pdb->groups_size, field[0], id, id, field[3]);
+            continue;
+        }
+        gid = strtoul(field[3], &endptr, 10);
+        if (endptr == field[3] || *endptr)
+            continue;
+        acct_add(&pdb->users, &pdb->nusers, &pdb->users_size, field[0], id, gid, NULL);
     }
-
-    /* report the findings */
-    report_findings("set-uid executable", &g_suid);
-    report_findings("set-gid executable", &g_sgid);
-    report_findings("writable", &g_writable);
-#ifdef RECORD_LESS_INTERESTING
-    report_findings("readable", &g_readable);
-    report_findings("only executable", &g_executable);
-#endif
-
+    free(line);
+    fclose(fp);
     return 0;
 }
 
 
-void
-perror_str(const char *fmt, ...)
+/*
+ * by id, the first one in the database wins
+ */
+int
+acct_cmp(const void *a, const void *b)
 {
-    char *ptr = NULL;
-    va_list vl;
+    const acct_t *pa = (const acct_t *)a, *pb = (const acct_t *)b;
 
-    va_start(vl, fmt);
-    if (vasprintf(&ptr, fmt, vl) == -1) {
-        perror(fmt);
-        return;
-    }
-    perror(ptr);
-    free(ptr);
+    if (pa->id != pb->id)
+        return pa->id < pb->id ? -1 : 1;
+    return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
 }
 
 
-void
-add_group(gid_t gid)
+int
+acct_name_cmp(const void *a, const void *b)
 {
-    if (g_ngroups + 1 >= NGROUPS_MAX) {
-        fprintf(stderr, "[!] Too many groups!!\n");
-        exit(1);
-    }
-    g_groups[g_ngroups] = gid;
-    g_ngroups++;
+    const acct_t *pa = *(acct_t * const *)a, *pb = *(acct_t * const *)b;
+    int ret = strcmp(pa->name, pb->name);
+
+    if (ret)
+        return ret;
+    return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
 }
 
 
 /*
- * NOTE: the "groups" string will be modified in place by strtok()
+ * read every user and group, from NSS or with -R from the files, and work
+ * out the members of each group as a bitset of users.
  */
 void
-obtain_user_info(const char *user, const char *groups)
+acct_load(acctdb_t *pdb)
 {
-    struct passwd *pw;
-    int i;
-    uid_t uid = -1;
+    unsigned int i, k, *pairs = NULL;
+    size_t npairs = 0, pairs_size = 0, j;
 
-    /* no user specified? use the current uid. */
-    if (!user) {
-        uid = getuid();
-        pw = getpwuid(uid);
+    if (g_names_root) {
+        char path[PATH_MAX+1];
+
+        snprintf(path, sizeof(path), "%s/etc/passwd", g_names_root);
+        if (acct_parse(pdb, path, 0) == -1) {
+            perror_str("[!] Unable to load \"%s\"", path);
+            exit(1);
+        }
+        snprintf(path, sizeof(path), "%s/etc/group", g_names_root);
+        if (acct_parse(pdb, path, 1) == -1) {
+            perror_str("[!] Unable to load \"%s\"", path);
+            exit(1);
+        }
     }
+#ifndef CHAX_NO_NSS
     else {
-        /* try to resolve the pw struct from the user string */
-        pw = getpwnam(user);
+        struct passwd *pw;
+        struct group *gr;
+        char *members = NULL;
+        size_t members_size = 0;
 
-        /* if it fails, try to treat it as a number */
-        if (!pw) {
-            char *endptr = (char *)user;
-            long uid_tmp;
+        setpwent();
+        while ((pw = getpwent()))
+            acct_add(&pdb->users, &pdb->nusers, &pdb->users_size, pw->pw_name, pw->pw_uid,
+                     pw->pw_gid, NULL);
+        endpwent();
 
-            /* try by id as well */
-            uid_tmp = strtol(user, &endptr, 0);
-            if (uid_tmp == LONG_MAX || *endptr != '\0') {
-                fprintf(stderr, "[!] Invalid user id: %s!\n", user);
-                exit(1);
-            }
-            uid = uid_tmp;
+        setgrent();
+        while ((gr = getgrent())) {
+            size_t len = 0;
+            char **pm;
 
-            pw = getpwuid(uid);
+            for (pm = gr->gr_mem; pm && *pm; pm++) {
+                size_t mlen = strlen(*pm);
+
+                if (len + mlen + 2 > members_size) {
+                    size_t new_size = members_size ? members_size * 2 : 256;
+
+                    while (len + mlen + 2 > new_size)
+                        new_size *= 2;
+                    members = (char *)mem_realloc(MEM_NAMES, members, members_size, new_size);
+                    members_size = new_size;
+                }
+                if (len)
+                    members[len++] = ',';
+                memcpy(members + len, *pm, mlen);
+                len += mlen;
+            }
+            if (members)
+                members[len] = '\0';
+            acct_add(&pdb->groups, &pdb->ngroups, &pdb->groups_size, gr->gr_name, gr->gr_gid,
+                     gr->gr_gid, len ? members : NULL);
         }
+        endgrent();
+        mem_free(MEM_NAMES, members, members_size);
     }
-    if (!pw) {
-        fprintf(stderr, "[!] Unable to find uid %lu, trying anyway...\n", (unsigned long)uid);
-        g_uid = uid;
-        g_ngroups = 0;
-    }
-    else
-        g_uid = pw->pw_uid;
+#endif
 
-    /* find out what groups the current or specified user is in */
-    if (!user) {
-        int num = getgroups(0, g_groups);
-        if (num > g_ngroups) {
-            fprintf(stderr, "[!] Too many groups!\n");
-            exit(1);
-        }
-        if ((g_ngroups = getgroups(g_ngroups, g_groups)) == -1) {
-            perror("[!] Unable to getgroups");
-            exit(1);
-        }
+    qsort(pdb->users, pdb->nusers, sizeof(acct_t), acct_cmp);
+    pdb->by_name = (acct_t **)mem_alloc(MEM_NAMES, (pdb->nusers + 1) * sizeof(acct_t *));
+    for (i = 0; i < pdb->nusers; i++)
+        pdb->by_name[i] = pdb->users + i;
+    qsort(pdb->by_name, pdb->nusers, sizeof(acct_t *), acct_name_cmp);
 
-        /* make sure our gid is in the groups */
-        if (!in_group(pw->pw_gid))
-            add_group(pw->pw_gid);
-    }
-    else if (pw) {
-        /* since we are passing the max, we shouldn't have an issue with failed return */
-        getgrouplist(pw->pw_name, pw->pw_gid, g_groups, &g_ngroups);
+    qsort(pdb->groups, pdb->ngroups, sizeof(acct_t), acct_cmp);
+    for (i = k = 0; i < pdb->ngroups; i++) {
+        if (!k || pdb->groups[k - 1].id != pdb->groups[i].id)
+            k++;
     }
-    /* else we have no way of knowing, the user doesn't exist =) */
-
-    /* append any extra groups */
-    if (groups) {
-        char *grnam = strtok((char *)groups, ",");
+    pdb->uwords = (pdb->nusers + 63) / 64;
+    pdb->words = pdb->uwords + (k + 63) / 64;
 
-        while (grnam) {
-            struct group *pg = getgrnam(grnam);
-            unsigned long gid_tmp;
-            gid_t gid;
+    /* one group per gid, merging the member lists of duplicates */
+    for (i = k = 0; i < pdb->ngroups; i++) {
+        acct_t cur = pdb->groups[i];
+        char *name, *save = NULL;
+        size_t members_len;
 
-            if (!pg) {
-                char *endptr = grnam;
+        if (!k || pdb->groups[k - 1].id != cur.id)
+            pdb->groups[k++] = cur;
+        if (!cur.members)
+            continue;
+        members_len = strlen(cur.members);
+        for (name = strtok_r((char *)cur.members, ",", &save); name;
+             name = strtok_r(NULL, ",", &save)) {
+            unsigned int lo = 0, hi = pdb->nusers;
 
-                gid_tmp = strtoul(grnam, &endptr, 0);
-                /* a bad number indicates a probably mistake */
-                if (gid_tmp == ULONG_MAX || *endptr != '\0') {
-                    fprintf(stderr, "[!] Unknown/invalid group: %s\n", grnam);
-                    exit(1);
-                }
-                gid = gid_tmp;
+            /* the first user by that name */
+            while (lo < hi) {
+                unsigned int mid = lo + (hi - lo) / 2;
 
-                /* try again */
-                pg = getgrgid(gid);
+                if (strcmp(pdb->by_name[mid]->name, name) < 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
             }
+            if (lo < pdb->nusers && !strcmp(pdb->by_name[lo]->name, name)) {
+                if (npairs == pairs_size) {
+                    size_t new_size = pairs_size ? pairs_size * 2 : 1024;
 
-            if (!pg) {
-                /* this is just a warning, add the number and keep processing others */
-                fprintf(stderr, "[!] Unable to find gid %s, trying anyway...\n", grnam);
-                if (!in_group(gid))
-                    add_group(gid);
+                    pairs = (unsigned int *)mem_realloc(MEM_NAMES, pairs,
+                                                        pairs_size * 2 * sizeof(unsigned int),
+                                                        new_size * 2 * sizeof(unsigned int));
+                    pairs_size = new_size;
+                }
+                pairs[npairs * 2] = k - 1;
+                pairs[npairs * 2 + 1] = pdb->by_name[lo] - pdb->users;
+                npairs++;
             }
-            else if (!in_group(pg->gr_gid))
-                add_group(pg->gr_gid);
-
-            /* process the next group name. */
-            grnam = strtok(NULL, ",");
         }
+        mem_free(MEM_NAMES, (char *)cur.members, members_len + 1);
+        pdb->groups[k - 1].members = NULL;
     }
+    pdb->ngroups = k;
 
-    /* print what we found :) */
-    if (pw)
-        printf("[*] uid=%u(%s), groups=", pw->pw_uid, pw->pw_name);
-    else
-        printf("[*] uid=%u(?), groups=", g_uid);
+    /* counting sort of the (group, user) pairs, then the primary groups */
+    pdb->member_off = (unsigned int *)mem_calloc(MEM_NAMES,
+                                                 (pdb->ngroups + 2) * sizeof(unsigned int));
+    for (j = 0; j < npairs; j++)
+        pdb->member_off[pairs[j * 2] + 2]++;
+    for (i = 0; i < pdb->nusers; i++) {
+        if ((k = acct_group(pdb, pdb->users[i].gid)) != INDEX_NONE)
+            pdb->member_off[k + 2]++;
+    }
+    for (k = 0; k < pdb->ngroups; k++)
+        pdb->member_off[k + 2] += pdb->member_off[k + 1];
+    pdb->nmembers = pdb->member_off[pdb->ngroups + 1];
+    pdb->member_ids = (unsigned int *)mem_alloc(MEM_NAMES,
+                                                (pdb->nmembers + 1) * sizeof(unsigned int));
+    for (j = 0; j < npairs; j++)
+        pdb->member_ids[pdb->member_off[pairs[j * 2] + 1]++] = pairs[j * 2 + 1];
+    for (i = 0; i < pdb->nusers; i++) {
+        if ((k = acct_group(pdb, pdb->users[i].gid)) != INDEX_NONE)
+            pdb->member_ids[pdb->member_off[k + 1]++] = i;
+    }
+    mem_free(MEM_NAMES, pairs, pairs_size * 2 * sizeof(unsigned int));
+
+    pdb->all = (unsigned long long *)mem_calloc(MEM_NAMES, (pdb->words + 1) * 8);
+    bits_set_range(pdb->all, 0, pdb->nusers);
+    bits_set_range(pdb->all + pdb->uwords, 0, pdb->ngroups);
+    pdb->tmp = (unsigned long long *)mem_alloc(MEM_NAMES, (5 * pdb->words + 1) * 8);
+}
+
+
+/*
+ * the users with this uid are users[*plo..*phi]
+ */
+void
+acct_users(acctdb_t *pdb, unsigned int uid, unsigned int *plo, unsigned int *phi)
+{
+    unsigned int lo = 0, hi = pdb->nusers;
 
-    for (i = 0; i < g_ngroups; i++) {
-        struct group *pg = getgrgid(g_groups[i]);
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
 
-        if (pg)
-            printf("%u(%s)", pg->gr_gid, pg->gr_name);
+        if (pdb->users[mid].id < uid)
+            lo = mid + 1;
         else
-            printf("%u(?)", g_groups[i]);
-        if (i != g_ngroups - 1)
-            printf(",");
+            hi = mid;
     }
-    printf("\n");
+    *plo = lo;
+    while (lo < pdb->nusers && pdb->users[lo].id == uid)
+        lo++;
+    *phi = lo;
 }
 
 
-void
-report_findings(const char *name, entries_t *pentries)
+/*
+ * returns the position of gid in groups, or INDEX_NONE
+ */
+unsigned int
+acct_group(acctdb_t *pdb, unsigned int gid)
 {
-    unsigned int i;
+    unsigned int lo = 0, hi = pdb->ngroups;
 
-    fprintf(stderr, "[*] Found %u entries that are %s\n", pentries->idx, name);
-    for (i = 0; i < pentries->idx; i++) {
-        entry_t *pentry = pentries->head + i;
-        struct passwd *pw = getpwuid(pentry->statbuf.st_uid);
-        struct group *pg = getgrgid(pentry->statbuf.st_gid);
-        char tmpu[128], tmpg[128];
-        char mode_str[16];
-        char *type_str = "unknown";
-
-        sprintf(mode_str, "%04o", pentry->statbuf.st_mode & ~S_IFMT);
-        if (!pw)
-            sprintf(tmpu, "%lu", (unsigned long)pentry->statbuf.st_uid);
-        if (!pg)
-            sprintf(tmpg, "%lu", (unsigned long)pentry->statbuf.st_gid);
-        switch (pentry->statbuf.st_mode & S_IFMT) {
-            case S_IFSOCK:
-                type_str = "socket";
-                break;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
 
-            case S_IFLNK: /* we're ignoring these, so this shouldn't happen */
-                type_str = "link";
-                break;
+        if (pdb->groups[mid].id == gid)
+            return mid;
+        if (pdb->groups[mid].id < gid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return INDEX_NONE;
+}
 
-            case S_IFREG:
-                type_str = "file";
-                break;
 
-            case S_IFBLK:
-                type_str = "blkdev";
-                break;
+void
+bits_set_range(unsigned long long *bits, unsigned int lo, unsigned int hi)
+{
+    for (; lo < hi; lo++)
+        bits[lo / 64] |= 1ULL << (lo % 64);
+}
 
-            case S_IFDIR:
-                type_str = "directory";
-                break;
 
-            case S_IFCHR:
-                type_str = "chardev";
-                break;
+/*
+ * the principals that get perm (S_IROTH, S_IWOTH or S_IXOTH) on an entry,
+ * by the same rules as chax_classify()
+ */
+void
+who_grant(acctdb_t *pdb, mode_t mode, uid_t uid, gid_t gid, mode_t perm,
+          unsigned long long *out)
+{
+    unsigned int lo, hi, g, m;
 
-            case S_IFIFO:
-                type_str = "fifo";
-                break;
-        }
-        printf("    %9s %s %s %s %s\n", 
-               type_str,
-               mode_str,
-               pw ? pw->pw_name : tmpu,
-               pg ? pg->gr_name : tmpg,
-               pentry->path);
+    if (mode & perm) {
+        memcpy(out, pdb->all, pdb->words * 8);
+        return;
+    }
+    memset(out, 0, pdb->words * 8);
+    if (mode & (perm << 6)) {
+        acct_users(pdb, uid, &lo, &hi);
+        bits_set_range(out, lo, hi);
+    }
+    if ((mode & (perm << 3)) && (g = acct_group(pdb, gid)) != INDEX_NONE) {
+        for (m = pdb->member_off[g]; m < pdb->member_off[g + 1]; m++)
+            out[pdb->member_ids[m] / 64] |= 1ULL << (pdb->member_ids[m] % 64);
+        bits_set_range(out + pdb->uwords, g, g + 1);
+    }
+    if (perm == S_IXOTH) {
+        acct_users(pdb, 0, &lo, &hi);
+        bits_set_range(out, lo, hi);
     }
 }
 
 
-int
-in_group(gid_t gid)
+unsigned long long *
+whocache_get(acctdb_t *pdb, const char *path, size_t len)
 {
-    int i;
+    whocache_t *pc = &g_whocache;
+    unsigned int i, mask = pc->size - 1;
 
-    for (i = 0; i < g_ngroups; i++) {
-        if (g_groups[i] == gid)
-            return 1;
+    if (!pc->size)
+        return NULL;
+    for (i = path_hash(path, len) & mask; pc->paths[i]; i = (i + 1) & mask) {
+        if (!strncmp(pc->paths[i], path, len) && pc->paths[i][len] == '\0')
+            return pc->sets + i * pdb->words;
     }
-    return 0;
+    return NULL;
 }
 
 
-int
-is_executable(struct stat *sb)
+void
+whocache_put(acctdb_t *pdb, const char *path, size_t len, unsigned long long *set)
 {
-    if (g_uid == 0)
-        return 1;
-    if (sb->st_mode & S_IXOTH)
-        return 1;
-    if ((sb->st_mode & S_IXUSR) && sb->st_uid == g_uid)
-        return 1;
-    if ((sb->st_mode & S_IXGRP) && in_group(sb->st_gid))
-        return 1;
-    return 0;
-}
+    whocache_t *pc = &g_whocache;
+    unsigned int i, mask;
 
+    if (!pc->size) {
+        pc->size = 4096;
+        while (pc->size > 16 && pc->size * pdb->words * 8 > WHO_CACHE_BYTES)
+            pc->size /= 2;
+        pc->paths = (char **)mem_calloc(MEM_NAMES, pc->size * sizeof(char *));
+        pc->sets = (unsigned long long *)mem_alloc(MEM_NAMES, pc->size * pdb->words * 8);
+    }
+    if ((pc->used + 1) * 2 > pc->size) {
+        for (i = 0; i < pc->size; i++) {
+            if (pc->paths[i])
+                mem_free(MEM_NAMES, pc->paths[i], strlen(pc->paths[i]) + 1);
+            pc->paths[i] = NULL;
+        }
+        pc->used = 0;
+    }
 
-int
-is_setuid(struct stat *sb)
-{
-    return (is_executable(sb) && (sb->st_mode & S_ISUID));
+    mask = pc->size - 1;
+    for (i = path_hash(path, len) & mask; pc->paths[i]; i = (i + 1) & mask)
+        ;
+    pc->paths[i] = (char *)mem_alloc(MEM_NAMES, len + 1);
+    memcpy(pc->paths[i], path, len);
+    pc->paths[i][len] = '\0';
+    memcpy(pc->sets + i * pdb->words, set, pdb->words * 8);
+    pc->used++;
 }
 
 
+/*
+ * the principals that can search every directory down to path[0..len],
+ * which is canonical. it starts from the deepest one already cached.
+ */
 int
-is_setgid(struct stat *sb)
+who_reach(acctdb_t *pdb, const char *path, size_t len, unsigned long long *out)
 {
-    return (is_executable(sb) && (sb->st_mode & S_ISGID));
-}
+    unsigned short ends[PATH_MAX / 2 + 2];
+    char buf[PATH_MAX + 1];
+    unsigned long long *cached = NULL;
+    struct stat sb;
+    size_t k, w;
+    int n = 0, i;
 
+    ends[n++] = 1;
+    for (k = 1; k < len; k++) {
+        if (path[k] == '/')
+            ends[n++] = k;
+    }
+    if (len > 1)
+        ends[n++] = len;
 
-int
-is_writable(struct stat *sb)
-{
-    /* although root can write to anything, it doesn't help us to show that here.
-    if (g_uid == 0)
-        return 1;
-     */
-    if (sb->st_mode & S_IWOTH)
-        return 1;
-    if ((sb->st_mode & S_IWUSR) && sb->st_uid == g_uid)
-        return 1;
-    if ((sb->st_mode & S_IWGRP) && in_group(sb->st_gid))
-        return 1;
-    return 0;
-}
+    for (i = n - 1; i >= 0 && !(cached = whocache_get(pdb, path, ends[i])); i--)
+        ;
+    memcpy(out, cached ? cached : pdb->all, pdb->words * 8);
 
+    memcpy(buf, path, len);
+    for (i++; i < n; i++) {
+        buf[ends[i]] = '\0';
+        STAT_INC(lstat_calls);
+        if (lstat(buf, &sb) == -1) {
+            perror_str("[!] Unable to lstat \"%s\"", buf);
+            return -1;
+        }
+        if (ends[i] < len)
+            buf[ends[i]] = path[ends[i]];
 
-int
-is_readable(struct stat *sb)
-{
-    /* although root can read from anything, it doesn't help us to show that here.
-    if (g_uid == 0)
-        return 1;
-     */
-    if (sb->st_mode & S_IROTH)
-        return 1;
-    if ((sb->st_mode & S_IRUSR) && sb->st_uid == g_uid)
-        return 1;
-    if ((sb->st_mode & S_IRGRP) && in_group(sb->st_gid))
-        return 1;
+        who_grant(pdb, sb.st_mode, sb.st_uid, sb.st_gid, S_IXOTH, pdb->tmp);
+        for (w = 0; w < pdb->words; w++)
+            out[w] &= pdb->tmp[w];
+        whocache_put(pdb, path, ends[i], out);
+    }
     return 0;
 }
 
 
 void
-record_access(entries_t *pentries, const char *path, struct stat *sb)
+who_print_set(acct_t *accts, unsigned int n, unsigned long long *set)
 {
-    unsigned int new_next_idx = pentries->idx + 1;
-    entry_t *pentry;
+    unsigned int count = 0;
+    size_t w, nwords = (n + 63) / 64;
+    int first = 1;
 
-    if (new_next_idx > pentries->len) {
-        entry_t *new_head;
-        /* grow array */
-        /* XXX: TODO: optimize allocations */
-        new_head = (entry_t *)realloc(pentries->head, (pentries->len + 1) * sizeof(entry_t));
-        if (!new_head) {
-            fprintf(stderr, "[!] Out of memory!\n");
-            exit(1);
-        }
-        pentries->head = new_head;
-        pentries->len++;
+    for (w = 0; w < nwords; w++)
+        count += __builtin_popcountll(set[w]);
+    if (!count) {
+        printf("none");
+        return;
+    }
+    if (count == n) {
+        printf("everyone");
+        return;
     }
+    for (w = 0; w < nwords; w++) {
+        unsigned long long word = set[w];
 
-    pentry = pentries->head + pentries->idx;
-    pentries->idx = new_next_idx;
-    pentry->path = strdup(path);
-    memcpy(&(pentry->statbuf), sb, sizeof(pentry->statbuf));
+        while (word) {
+            printf("%s%s", first ? "" : ",", accts[w * 64 + __builtin_ctzll(word)].name);
+            word &= word - 1;
+            first = 0;
+        }
+    }
 }
 
-/*
- * filter the permissions we have on the entry into buckets
- */
+
 void
-record_access_level(const char *path, struct stat *sb)
+who_print(acctdb_t *pdb, const char *what, unsigned long long *set)
 {
-    if (is_setuid(sb))
-        record_access(&g_suid, path, sb);
-    else if (is_setgid(sb))
-        record_access(&g_sgid, path, sb);
-    else if (is_writable(sb))
-        record_access(&g_writable, path, sb);
-#ifdef RECORD_LESS_INTERESTING
-    else if (is_readable(sb))
-        record_access(&g_readable, path, sb);
-    else if (is_executable(sb))
-        record_access(&g_executable, path, sb);
-#endif
+    printf("    %s: users=", what);
+    who_print_set(pdb->users, pdb->nusers, set);
+    printf(" groups=");
+    who_print_set(pdb->groups, pdb->ngroups, set + pdb->uwords);
+    printf("\n");
 }
 
 
-char *my_stpcpy(char *dst, const char *src)
+int
+who_path(acctdb_t *pdb, const char *arg)
 {
-    char *q = dst;
-    const char *p = src;
+    static const mode_t perms[3] = { S_IROTH, S_IWOTH, S_IXOTH };
+    static const char *names[3] = { "read", "write", "execute" };
+    unsigned long long *reach = pdb->tmp + pdb->words;
+    char path[PATH_MAX+1];
+    const char *pwname, *grname;
+    char tmpu[128], tmpg[128];
+    struct stat sb;
+    size_t len, parent_len, w;
+    int i;
 
-    while (*p)
-        *q++ = *p++;
-    return q;
-}
+    t_stats.realpath_calls++;
+    if (!realpath(arg, path)) {
+        perror_str("[!] Unable to resolve path \"%s\"", arg);
+        return -1;
+    }
+    len = strlen(path);
+    for (parent_len = len; parent_len > 1 && path[parent_len - 1] != '/'; parent_len--)
+        ;
+    if (parent_len > 1)
+        parent_len--;
 
+    if (len == 1)
+        memcpy(reach, pdb->all, pdb->words * 8);
+    else if (who_reach(pdb, path, parent_len, reach) == -1)
+        return -1;
+    STAT_INC(lstat_calls);
+    if (lstat(path, &sb) == -1) {
+        perror_str("[!] Unable to lstat \"%s\"", path);
+        return -1;
+    }
 
-void
-scan_directory(const char *dir)
-{
-    DIR *pd;
-    struct dirent *pe;
-    char canonical_path[PATH_MAX+1] = { 0 };
-    char *end;
-    struct stat sb;
+    pwname = uid_name(sb.st_uid);
+    grname = gid_name(sb.st_gid);
+    if (!pwname)
+        sprintf(tmpu, "%lu", (unsigned long)sb.st_uid);
+    if (!grname)
+        sprintf(tmpg, "%lu", (unsigned long)sb.st_gid);
+    printf("[*] %s (%s %04o %s %s)\n", path, type_name(sb.st_mode), sb.st_mode & ~S_IFMT,
+           pwname ? pwname : tmpu, grname ? grname : tmpg);
+    for (i = 0; i < 3; i++) {
+        unsigned long long *set = pdb->tmp + (2 + i) * pdb->words;
 
-    if (!(pd = opendir(dir))) {
-        perror_str("[!] Unable to open dir \"%s\"", dir);
-        return;
+        who_grant(pdb, sb.st_mode, sb.st_uid, sb.st_gid, perms[i], set);
+        for (w = 0; w < pdb->words; w++)
+            set[w] &= reach[w];
+        who_print(pdb, names[i], set);
     }
+    return 0;
+}
 
-    while ((pe = readdir(pd))) {
-        if (pe->d_name[0] == '.') {
-            if (pe->d_name[1] == '\0')
-                continue;
-            if (pe->d_name[1] == '.' && pe->d_name[2] == '\0')
-                continue;
-        }
 
-        end = my_stpcpy(canonical_path, dir);
-        if (end - canonical_path >= PATH_MAX - 1 - strlen(pe->d_name)) {
-            fprintf(stderr, "[!] name too long \"%s/%s\"\n", dir, pe->d_name);
-            continue;
-        }
-        if (end > canonical_path && *(end - 1) != '/')
-            *end++ = '/';
-        strcpy(end, pe->d_name);
+/*
+ * a path of "-" reads more paths from stdin, one per line
+ */
+int
+who_main(char **paths, int npaths)
+{
+    acctdb_t *pdb = &g_acctdb;
+    int i, ret = 0;
 
-#ifdef DEBUG
-        printf("[*] checking: 0x%x 0x%x 0x%x 0x%x %s ...\n", 
-               (unsigned int)pe->d_ino, (unsigned int)pe->d_off,
-               pe->d_reclen,
-               pe->d_type, canonical_path);
-#endif
+    acct_load(pdb);
+    fprintf(stderr, "[*] Checking against %u users and %u groups\n", pdb->nusers, pdb->ngroups);
 
-        /* decide where to put this one */
-        if (lstat(canonical_path, &sb) == -1) {
-            perror_str("[!] Unable to lstat \"%s\"", canonical_path);
-            continue;
-        }
+    for (i = 0; i < npaths; i++) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t n;
 
-        /* skip symlinks.. */
-        if (S_ISLNK(sb.st_mode))
+        if (strcmp(paths[i], "-")) {
+            if (who_path(pdb, paths[i]) == -1)
+                ret = 1;
             continue;
+        }
+        while ((n = getline(&line, &cap, stdin)) != -1) {
+            if (n > 0 && line[n - 1] == '\n')
+                line[--n] = '\0';
+            if (n && who_path(pdb, line) == -1)
+                ret = 1;
+        }
+        free(line);
+    }
+    return ret;
+}
 
-        record_access_level(canonical_path, &sb);
 
-        /* can the child directory too */
-        if (S_ISDIR(sb.st_mode)
-            && is_executable(&sb))
-            scan_directory(canonical_path);
-    }
+/*
+ * a whole decimal option argument in [min, max], anything else is -1
+ */
+int
+parse_num(const char *str, long min, long max, int *pval)
+{
+    char *end;
+    long val;
 
-    closedir(pd);
+    errno = 0;
+    val = strtol(str, &end, 10);
+    if (end == str || *end || errno || val < min || val > max)
+        return -1;
+    *pval = val;
+    return 0;
 }
 
 
@@ -535,5 +5671,54 @@ usage(char *argv[])
         "         \tspecified, groups are inherited from the current user.\n"
         "-g <gid> \tadd the specified group name or id to the supplementary group list\n"
         "         \tNOTE: separate multiple groups with a comma.\n"
+        "-s       \t(--stats) print syscall counters and phase timings to stderr\n"
+        "         \tas \"stats.<key>=<value>\" lines when done.\n"
+        "-l[N]    \t(--latency[=N]) like -s, plus lstat/getdents latency histograms\n"
+        "         \tand the N (default 10) slowest directories and entries.\n"
+        "-p[MS]   \t(--progress[=MS]) print a progress line to stderr every MS\n"
+        "         \tmilliseconds (default 1000, 0 means only on SIGUSR1.)\n"
+        "-t <file>\t(--trace=<file>) write a Chrome trace JSON timeline of the walk\n"
+        "         \t(load it in chrome://tracing or ui.perfetto.dev.)\n"
+        "-P       \t(--perf-counters) count cycles, instructions, cache and branch\n"
+        "         \tmisses per phase using perf_event_open (classification is\n"
+        "         \tsampled and taken out of the walk, not with -j or -e.)\n"
+        "-R <dir> \t(--names-root=<dir>) resolve owner and group names from\n"
+        "         \t<dir>/etc/passwd and <dir>/etc/group instead of NSS.\n"
+        "-v       \t(--verbose) print every error as it happens instead of a\n"
+        "         \tsummary at the end.\n"
+        "-S <sock>\t(--serve=<sock>) index the paths once and answer queries\n"
+        "         \tfor any identity on the unix socket <sock> (mode 0600.)\n"
+        "-r <secs>\t(--rescan=<secs>) with -S, rebuild the index in the background\n"
+        "         \tevery <secs> seconds (default 300, 0 never.)\n"
+        "-q <sock>\t(--query=<sock>) ask a -S instance what -u/-g can do to each\n"
+        "         \tpath instead of scanning.\n"
+        "-Q <sock>\t(--query-prefix=<sock>) like -q, but report the findings below\n"
+        "         \teach path like a scan would.\n"
+        "-w       \t(--who) list the users and groups that can read, write or\n"
+        "         \texecute each path instead of scanning. a path of - reads\n"
+        "         \tmore paths from stdin, one per line.\n"
+        "-o <file>\t(--save-snapshot=<file>) save the tree's names, modes and\n"
+        "         \towners to <file> while scanning.\n"
+        "-i <file>\t(--snapshot=<file>) answer for -u/-g from a saved snapshot\n"
+        "         \tinstead of the file system (paths pick subtrees of it.) with\n"
+        "         \t-S, serve the snapshot.\n"
+        "-W [+-]<gid>\t(--what-if=[+-]<gid>) report only what -u/-g would gain\n"
+        "         \t(+) or lose (-) with the group added or dropped.\n"
+        "-j <n>   \t(--jobs=<n|auto>) walk with n threads (default 1.) auto starts\n"
+        "         \twith 2 and tunes the count to the entries/s it gets, within the\n"
+        "         \tcpu quota and fd limit. the order of the findings differs\n"
+        "         \tfrom run to run.\n"
+        "-b[file] \t(--priority[=<file>]) visit the most promising directories\n"
+        "         \tfirst (bin, dev, run, writable..), or with a snapshot the ones\n"
+        "         \tthat held findings for -u/-g then.\n"
+        "-F       \t(--stream) print each finding as it is found, prefixed by its\n"
+        "         \tclass, instead of grouped by class at the end.\n"
+        "-d <secs>\t(--deadline=<secs>) stop walking after <secs> seconds, report\n"
+        "         \twhat was found and list the directories left with their\n"
+        "         \testimated sizes.\n"
+        "-m <n>   \t(--max-entries=<n>) like -d, after <n> entries.\n"
+        "-e[n]    \t(--estimate[=<n>]) estimate the findings from <n> random\n"
+        "         \tdescents (default 1000, or until -d/-m) instead of walking\n"
+        "         \teverything, with a few examples of each.\n"
         , cmd);
 }
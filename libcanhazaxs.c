@@ -0,0 +1,2613 @@
+/*
+ * libcanhazaxs - the scanning engine behind canhazaxs
+ *
+ * Joshua J. Drake <jduck> of droidsec
+ * (c) 2014
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "libcanhazaxs.h"
+
+
+/*
+ * on linux we pull directory entries with getdents64 directly. this lets us
+ * use a bigger buffer than some libcs do and see (and time) each batch.
+ */
+#if defined(__linux__) && defined(SYS_getdents64)
+# define USE_GETDENTS64
+# define DIRBUF_SIZE 32768
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+typedef struct linux_dirent64 dirent_rec_t;
+#else
+typedef struct dirent dirent_rec_t;
+#endif
+
+typedef struct __stru_dirreader {
+    int err;
+#ifdef USE_GETDENTS64
+    int fd;
+    char *buf;
+    long pos;
+    long len;
+#else
+    DIR *pd;
+#endif
+} dirreader_t;
+
+
+/*
+ * the walk keeps an explicit stack of directories instead of recursing.
+ * each directory is read in full when it is pushed, so its fd is closed
+ * before we descend and the pending work can be inspected (see
+ * chax_progress()).
+ *
+ * names are stored as "<d_type byte><name>\0" records.
+ */
+#define WALK_HIST_DEPTH 64
+
+typedef struct __stru_frame {
+    size_t path_len;
+    char *names;
+    size_t names_len;
+    size_t names_size;
+    size_t cursor;
+    unsigned int left;
+    unsigned int dirs_left;
+    /* DT_UNKNOWN names, any of which may be a directory */
+    unsigned int unknown_left;
+    unsigned long long entries_at_push;
+    unsigned long long own_ns;
+    unsigned int parent;
+} frame_t;
+
+typedef struct __stru_walk {
+    char path[PATH_MAX+1];
+    frame_t *frames;
+    int depth;
+    int size;
+    unsigned long long entries;
+    /* historical subtree sizes by depth, used to estimate the pending work */
+    unsigned long long subtree_sum[WALK_HIST_DEPTH];
+    unsigned long long subtree_cnt[WALK_HIST_DEPTH];
+    /* directories read by depth, and the names and subdirectories in them */
+    unsigned long long read_cnt[WALK_HIST_DEPTH];
+    unsigned long long read_names[WALK_HIST_DEPTH];
+    unsigned long long read_dirs[WALK_HIST_DEPTH];
+    /* the DT_UNKNOWN names lstat'ed so far, and the directories among them */
+    unsigned long long unknown_seen;
+    unsigned long long unknown_dirs;
+    /* how deep the first directory is below where the walk started, less 1 */
+    int base;
+    /* what the entry hook returned for the last directory */
+    unsigned int parent;
+} walk_t;
+
+/*
+ * the parallel walk. directories waiting for a worker are kept in a heap
+ * per device, highest priority first and among equals the one queued last,
+ * so without CHAX_OPT_PRIORITY it is a LIFO and the walk stays mostly
+ * depth first. a worker walks its job like the serial walk does and only
+ * hands a subdirectory over when another worker sits idle with nothing
+ * queued, when it is over the allowed count and should wind down, or when
+ * the subdirectory is on another device. each device has its own limit on
+ * the workers in it, lowered when its latency climbs, so a slow mount
+ * holds up only the workers it is allowed rather than all of them.
+ *
+ * with CHAX_OPT_PRIORITY every subdirectory is handed over, each job is a
+ * single directory and the walk goes best first.
+ */
+#define TUNE_PERIOD_NS 50000000ULL
+/* devices beyond this share the queue of the one they were found on */
+#define PAR_DEVS_MAX 64
+
+typedef struct __stru_job {
+    unsigned long long seq;
+    int prio;
+    int root;
+    int depth;
+    size_t len;
+    char path[];
+} job_t;
+
+typedef struct __stru_devq {
+    dev_t dev;
+    job_t **jobs;
+    unsigned int jobs_size;
+    unsigned int queued;
+    unsigned int busy;
+    /* workers allowed in the device at once */
+    unsigned int limit;
+    /* lstat/getdents latency in ns, moving average and best of it */
+    double lat;
+    double lat_best;
+} devq_t;
+
+typedef struct __stru_par {
+    pthread_mutex_t lock;
+    /* a job was queued, the allowed count went up or the walk is over */
+    pthread_cond_t work;
+    /* the walk is over, for the thread tuning the count */
+    pthread_cond_t over;
+    devq_t devs[PAR_DEVS_MAX];
+    unsigned int ndevs;
+    unsigned int queued;
+    unsigned long long seq;
+    unsigned int busy;
+    unsigned int idle;
+    /* workers with an index below this may take jobs */
+    unsigned int active;
+    int done;
+    int root_failed;
+    chax_t *owner;
+} par_t;
+
+struct __stru_chax {
+    uid_t uid;
+    int ngroups;
+    int groups_size;
+    /* as added, and sorted for the lookups */
+    gid_t *groups;
+    gid_t *sorted;
+    int less_interesting;
+    int priority;
+    int timing;
+    int latency;
+    int slow_max;
+    int progress;
+    /*
+     * the budget of all walks of the context. the deadline starts with the
+     * first walk. workers count into the context the walk was started on,
+     * BUDGET_BATCH entries at a time.
+     */
+    unsigned long long deadline_ms;
+    unsigned long long deadline_ns;
+    unsigned long long max_entries;
+    unsigned long long budget_used;
+    unsigned int budget_batch;
+    int stopped;
+    chax_hooks_t hooks;
+    chax_stats_t stats;
+    /* only ever updated with relaxed atomics, see chax_progress() */
+    chax_progress_t prog;
+    walk_t walk;
+    int threads;
+    /*
+     * the workers of a parallel walk are copies of the context with their
+     * own walk and stats. they share the identity, hooks and progress
+     * counters with the one the walk was started on.
+     */
+    par_t *par;
+    unsigned int worker;
+    chax_progress_t *pprog;
+    /* the device of the job being walked, its queue and its priority */
+    dev_t dev;
+    unsigned int dev_idx;
+    int prio;
+    /* only written by the worker, read by the tuning thread */
+    unsigned long long tune_entries;
+    unsigned long long tune_ns;
+    unsigned long long tune_ops;
+    /* when the syscall in progress started, 0 outside of one */
+    unsigned long long tune_since;
+};
+
+#define BUDGET_BATCH 64
+
+#define PROGRESS_ADD(pc, field, n) __atomic_fetch_add(&(pc)->pprog->field, (n), __ATOMIC_RELAXED)
+#define PROGRESS_SET(pc, field, v) __atomic_store_n(&(pc)->pprog->field, (v), __ATOMIC_RELAXED)
+#define PROGRESS_GET(pc, field) __atomic_load_n(&(pc)->pprog->field, __ATOMIC_RELAXED)
+#define TUNE_ADD(pc, field, n) \
+    __atomic_store_n(&(pc)->field, (pc)->field + (n), __ATOMIC_RELAXED)
+#define TUNE_SET(pc, field, v) __atomic_store_n(&(pc)->field, (v), __ATOMIC_RELAXED)
+#define TUNE_GET(pc, field) __atomic_load_n(&(pc)->field, __ATOMIC_RELAXED)
+
+static const char *class_names[CHAX_CLASSES] = {
+    "set-uid executable", "set-gid executable", "writable", "readable", "only executable"
+};
+
+
+static void
+mem_account(chax_stats_t *ps, int cat, long long delta)
+{
+    chax_mem_t *pm = ps->mem + cat;
+    unsigned long long cur, peak;
+
+    cur = __atomic_add_fetch(&pm->cur, delta, __ATOMIC_RELAXED);
+    if (delta > 0)
+        __atomic_fetch_add(&pm->total, delta, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&pm->peak, __ATOMIC_RELAXED);
+    while (cur > peak
+           && !__atomic_compare_exchange_n(&pm->peak, &peak, cur, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+/*
+ * unlike the program, a library can't just exit when memory runs out.
+ * these return NULL and the walk skips whatever needed the memory.
+ */
+static void *
+mem_alloc(chax_stats_t *ps, int cat, size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (ptr)
+        mem_account(ps, cat, size);
+    return ptr;
+}
+
+
+static void *
+mem_realloc(chax_stats_t *ps, int cat, void *ptr, size_t old_size, size_t new_size)
+{
+    void *new_ptr = realloc(ptr, new_size);
+
+    if (new_ptr)
+        mem_account(ps, cat, (long long)new_size - (long long)old_size);
+    return new_ptr;
+}
+
+
+static void
+mem_free(chax_stats_t *ps, int cat, void *ptr, size_t size)
+{
+    free(ptr);
+    mem_account(ps, cat, -(long long)size);
+}
+
+
+unsigned long long
+chax_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+int
+chax_etype(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+        case S_IFREG:
+            return CHAX_ETYPE_FILE;
+        case S_IFDIR:
+            return CHAX_ETYPE_DIR;
+        case S_IFLNK:
+            return CHAX_ETYPE_LINK;
+        case S_IFCHR:
+            return CHAX_ETYPE_CHR;
+        case S_IFBLK:
+            return CHAX_ETYPE_BLK;
+        case S_IFIFO:
+            return CHAX_ETYPE_FIFO;
+        case S_IFSOCK:
+            return CHAX_ETYPE_SOCK;
+    }
+    return CHAX_ETYPE_UNKNOWN;
+}
+
+
+const char *
+chax_class_name(int cls)
+{
+    if (cls < 0 || cls >= CHAX_CLASSES)
+        return "unknown";
+    return class_names[cls];
+}
+
+
+static void
+lathist_add(chax_lathist_t *ph, unsigned long long ns)
+{
+    int idx, msb;
+
+    ph->count++;
+    ph->sum += ns;
+    if (ns > ph->max)
+        ph->max = ns;
+
+    if (ns < CHAX_LATHIST_SUB)
+        idx = ns;
+    else {
+        msb = 63 - __builtin_clzll(ns);
+        idx = (msb - CHAX_LATHIST_SUB_BITS + 1) * CHAX_LATHIST_SUB
+            + (int)((ns >> (msb - CHAX_LATHIST_SUB_BITS)) & (CHAX_LATHIST_SUB - 1));
+    }
+    ph->buckets[idx]++;
+}
+
+
+/*
+ * keep the slow_max slowest items. the path is only copied once we know
+ * the item makes the cut.
+ */
+static void
+slowlist_add(chax_stats_t *ps, chax_slowlist_t *pl, int slow_max, unsigned long long ns,
+             const char *path)
+{
+    size_t len;
+    char *copy;
+    int i;
+
+    if (pl->len == slow_max) {
+        if (!slow_max || ns <= pl->items[pl->len - 1].ns)
+            return;
+    }
+    len = strlen(path) + 1;
+    if (!(copy = (char *)mem_alloc(ps, CHAX_MEM_SLOWLIST, len)))
+        return;
+    memcpy(copy, path, len);
+
+    if (pl->len == slow_max) {
+        char *evicted = pl->items[pl->len - 1].path;
+
+        mem_free(ps, CHAX_MEM_SLOWLIST, evicted, strlen(evicted) + 1);
+        pl->len--;
+    }
+    for (i = pl->len; i > 0 && pl->items[i - 1].ns < ns; i--)
+        pl->items[i] = pl->items[i - 1];
+    pl->items[i].ns = ns;
+    pl->items[i].path = copy;
+    pl->len++;
+}
+
+
+/*
+ * the identity
+ */
+static int
+gid_cmp(const void *a, const void *b)
+{
+    gid_t ga = *(const gid_t *)a, gb = *(const gid_t *)b;
+
+    return ga < gb ? -1 : ga > gb;
+}
+
+
+int
+chax_set_identity(chax_t *pc, uid_t uid, const gid_t *groups, int ngroups)
+{
+    if (ngroups < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ngroups > pc->groups_size) {
+        gid_t *g = (gid_t *)realloc(pc->groups, ngroups * sizeof(gid_t));
+        gid_t *s;
+
+        if (!g)
+            return -1;
+        pc->groups = g;
+        if (!(s = (gid_t *)realloc(pc->sorted, ngroups * sizeof(gid_t))))
+            return -1;
+        pc->sorted = s;
+        pc->groups_size = ngroups;
+    }
+    pc->uid = uid;
+    pc->ngroups = ngroups;
+    if (ngroups) {
+        memcpy(pc->groups, groups, ngroups * sizeof(gid_t));
+        memcpy(pc->sorted, groups, ngroups * sizeof(gid_t));
+        qsort(pc->sorted, ngroups, sizeof(gid_t), gid_cmp);
+    }
+    return 0;
+}
+
+
+int
+chax_add_group(chax_t *pc, gid_t gid)
+{
+    gid_t *groups;
+    int ret;
+
+    if (chax_in_group(pc, gid))
+        return 0;
+    if (!(groups = (gid_t *)malloc((pc->ngroups + 1) * sizeof(gid_t))))
+        return -1;
+    if (pc->ngroups)
+        memcpy(groups, pc->groups, pc->ngroups * sizeof(gid_t));
+    groups[pc->ngroups] = gid;
+    ret = chax_set_identity(pc, pc->uid, groups, pc->ngroups + 1);
+    free(groups);
+    return ret;
+}
+
+
+/*
+ * account lookups for chax_set_user(). a static build has no NSS
+ * (CHAX_NO_NSS), there the users and groups come straight from the files,
+ * with the reentrant readers since other threads may have a chax_t too.
+ * the strings end up in buf either way.
+ */
+static struct passwd *
+user_lookup(const char *name, uid_t uid, struct passwd *pwd, char *buf, size_t len)
+{
+    struct passwd *pw = NULL;
+#ifdef CHAX_NO_NSS
+    FILE *fp = fopen("/etc/passwd", "re");
+
+    if (!fp)
+        return NULL;
+    while (!fgetpwent_r(fp, pwd, buf, len, &pw) && pw
+           && (name ? strcmp(pw->pw_name, name) != 0 : pw->pw_uid != uid))
+        ;
+    fclose(fp);
+#else
+    if (name ? getpwnam_r(name, pwd, buf, len, &pw) : getpwuid_r(uid, pwd, buf, len, &pw))
+        pw = NULL;
+#endif
+    return pw;
+}
+
+
+/* same contract as getgrouplist(3) */
+static int
+user_groups(const char *user, gid_t group, gid_t *groups, int *ngroups)
+{
+#ifdef CHAX_NO_NSS
+    FILE *fp = fopen("/etc/group", "re");
+    struct group grp, *pg;
+    size_t len = 4096;
+    char *buf = (char *)malloc(len);
+    int n = 0, max = *ngroups, err;
+
+    if (max > 0)
+        groups[0] = group;
+    n++;
+    while (fp && buf) {
+        char **pm;
+        int i;
+
+        /* on ERANGE the stream is back at the start of the line */
+        if ((err = fgetgrent_r(fp, &grp, buf, len, &pg)) == ERANGE) {
+            char *bigger = (char *)realloc(buf, len * 2);
+
+            if (!bigger)
+                break;
+            buf = bigger;
+            len *= 2;
+            continue;
+        }
+        if (err || !pg)
+            break;
+
+        if (pg->gr_gid == group)
+            continue;
+        for (pm = pg->gr_mem; pm && *pm && strcmp(*pm, user); pm++)
+            ;
+        if (!pm || !*pm)
+            continue;
+        for (i = 0; i < n && i < max && groups[i] != pg->gr_gid; i++)
+            ;
+        if (i < n && i < max)
+            continue;
+        if (n < max)
+            groups[n] = pg->gr_gid;
+        n++;
+    }
+    free(buf);
+    if (fp)
+        fclose(fp);
+    *ngroups = n;
+    return n > max ? -1 : n;
+#else
+    return getgrouplist(user, group, groups, ngroups);
+#endif
+}
+
+
+int
+chax_set_user(chax_t *pc, const char *user)
+{
+    struct passwd pwd, *pw;
+    char buf[4096], *endptr;
+    gid_t *groups;
+    unsigned long uid;
+    int ngroups = 64, ret;
+
+    if (!(pw = user_lookup(user, 0, &pwd, buf, sizeof(buf)))) {
+        uid = strtoul(user, &endptr, 0);
+        if (!*user || *endptr != '\0' || uid == ULONG_MAX) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (!(pw = user_lookup(NULL, uid, &pwd, buf, sizeof(buf))))
+            return chax_set_identity(pc, uid, NULL, 0);
+    }
+
+    for (;;) {
+        int n = ngroups;
+
+        if (!(groups = (gid_t *)malloc(ngroups * sizeof(gid_t))))
+            return -1;
+        if (user_groups(pw->pw_name, pw->pw_gid, groups, &n) != -1) {
+            ngroups = n;
+            break;
+        }
+        free(groups);
+        ngroups = n > ngroups ? n : ngroups * 2;
+    }
+    ret = chax_set_identity(pc, pw->pw_uid, groups, ngroups);
+    free(groups);
+    return ret;
+}
+
+
+int
+chax_identity(chax_t *pc, uid_t *puid, const gid_t **pgroups)
+{
+    if (puid)
+        *puid = pc->uid;
+    if (pgroups)
+        *pgroups = pc->groups;
+    return pc->ngroups;
+}
+
+
+int
+chax_in_group(chax_t *pc, gid_t gid)
+{
+    int lo = 0, hi = pc->ngroups;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (pc->sorted[mid] == gid)
+            return 1;
+        if (pc->sorted[mid] < gid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+
+/*
+ * root can read and write anything, but it doesn't help us to show that
+ */
+static int
+is_executable(chax_t *pc, const struct stat *sb)
+{
+    if (pc->uid == 0)
+        return 1;
+    if (sb->st_mode & S_IXOTH)
+        return 1;
+    if ((sb->st_mode & S_IXUSR) && sb->st_uid == pc->uid)
+        return 1;
+    if ((sb->st_mode & S_IXGRP) && chax_in_group(pc, sb->st_gid))
+        return 1;
+    return 0;
+}
+
+
+static int
+is_writable(chax_t *pc, const struct stat *sb)
+{
+    if (sb->st_mode & S_IWOTH)
+        return 1;
+    if ((sb->st_mode & S_IWUSR) && sb->st_uid == pc->uid)
+        return 1;
+    if ((sb->st_mode & S_IWGRP) && chax_in_group(pc, sb->st_gid))
+        return 1;
+    return 0;
+}
+
+
+static int
+is_readable(chax_t *pc, const struct stat *sb)
+{
+    if (sb->st_mode & S_IROTH)
+        return 1;
+    if ((sb->st_mode & S_IRUSR) && sb->st_uid == pc->uid)
+        return 1;
+    if ((sb->st_mode & S_IRGRP) && chax_in_group(pc, sb->st_gid))
+        return 1;
+    return 0;
+}
+
+
+int
+chax_classify(chax_t *pc, const struct stat *sb)
+{
+    if (S_ISLNK(sb->st_mode))
+        return -1;
+    if ((sb->st_mode & (S_ISUID | S_ISGID)) && is_executable(pc, sb))
+        return (sb->st_mode & S_ISUID) ? CHAX_SETUID : CHAX_SETGID;
+    if (is_writable(pc, sb))
+        return CHAX_WRITABLE;
+    if (!pc->less_interesting)
+        return -1;
+    if (is_readable(pc, sb))
+        return CHAX_READABLE;
+    if (is_executable(pc, sb))
+        return CHAX_EXECUTABLE;
+    return -1;
+}
+
+
+int
+chax_searchable(chax_t *pc, const struct stat *sb)
+{
+    return S_ISDIR(sb->st_mode) && is_executable(pc, sb);
+}
+
+
+/*
+ * the context
+ */
+chax_t *
+chax_new(void)
+{
+    chax_t *pc = (chax_t *)calloc(1, sizeof(chax_t));
+    gid_t *groups;
+    int n;
+
+    if (!pc)
+        return NULL;
+    pc->slow_max = 10;
+    pc->threads = 1;
+    pc->pprog = &pc->prog;
+    if ((n = getgroups(0, NULL)) < 0 || !(groups = (gid_t *)malloc((n + 1) * sizeof(gid_t)))) {
+        free(pc);
+        return NULL;
+    }
+    if ((n = getgroups(n, groups)) < 0 || chax_set_identity(pc, getuid(), groups, n) == -1) {
+        free(groups);
+        chax_free(pc);
+        return NULL;
+    }
+    free(groups);
+    return pc;
+}
+
+
+void
+chax_free(chax_t *pc)
+{
+    walk_t *pw;
+    int i;
+
+    if (!pc)
+        return;
+    pw = &pc->walk;
+    for (i = 0; i < pw->size; i++)
+        mem_free(&pc->stats, CHAX_MEM_WALK_NAMES, pw->frames[i].names, pw->frames[i].names_size);
+    mem_free(&pc->stats, CHAX_MEM_WALK_FRAMES, pw->frames, pw->size * sizeof(frame_t));
+    chax_stats_free(&pc->stats);
+    free(pc->groups);
+    free(pc->sorted);
+    free(pc);
+}
+
+
+int
+chax_set_option(chax_t *pc, int opt, long value)
+{
+    switch (opt) {
+        case CHAX_OPT_LESS_INTERESTING:
+            pc->less_interesting = value != 0;
+            return 0;
+
+        case CHAX_OPT_TIMING:
+            pc->timing = value != 0;
+            return 0;
+
+        case CHAX_OPT_LATENCY:
+            pc->latency = value != 0;
+            return 0;
+
+        case CHAX_OPT_SLOW_MAX:
+            if (value < 0 || value > CHAX_SLOWLIST_MAX)
+                break;
+            pc->slow_max = value;
+            return 0;
+
+        case CHAX_OPT_PROGRESS:
+            pc->progress = value != 0;
+            return 0;
+
+        case CHAX_OPT_PRIORITY:
+            pc->priority = value != 0;
+            return 0;
+
+        case CHAX_OPT_DEADLINE_MS:
+            if (value < 0)
+                break;
+            pc->deadline_ms = value;
+            return 0;
+
+        case CHAX_OPT_MAX_ENTRIES:
+            if (value < 0)
+                break;
+            pc->max_entries = value;
+            return 0;
+
+        case CHAX_OPT_THREADS:
+            if (value < 0 || value > CHAX_THREADS_MAX)
+                break;
+            pc->threads = value;
+            return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+
+void
+chax_set_hooks(chax_t *pc, const chax_hooks_t *ph)
+{
+    if (ph)
+        pc->hooks = *ph;
+    else
+        memset(&pc->hooks, 0, sizeof(pc->hooks));
+}
+
+
+const chax_stats_t *
+chax_stats(chax_t *pc)
+{
+    return &pc->stats;
+}
+
+
+void
+chax_progress(chax_t *pc, chax_progress_t *pp)
+{
+    pp->entries = PROGRESS_GET(pc, entries);
+    pp->dirs = PROGRESS_GET(pc, dirs);
+    pp->pending_dirs = PROGRESS_GET(pc, pending_dirs);
+    pp->est_total = PROGRESS_GET(pc, est_total);
+    pp->depth = PROGRESS_GET(pc, depth);
+}
+
+
+static void
+lathist_merge(chax_lathist_t *dst, const chax_lathist_t *src)
+{
+    int i;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (i = 0; i < CHAX_LATHIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+
+void
+chax_stats_merge(chax_stats_t *dst, const chax_stats_t *src, int slow_max)
+{
+    int i;
+
+    dst->opendir_calls += src->opendir_calls;
+    dst->readdir_calls += src->readdir_calls;
+    dst->getdents_calls += src->getdents_calls;
+    dst->closedir_calls += src->closedir_calls;
+    dst->lstat_calls += src->lstat_calls;
+    dst->visited += src->visited;
+    for (i = 0; i < CHAX_ETYPE_MAX; i++)
+        dst->entries[i] += src->entries[i];
+    dst->dirs_pruned += src->dirs_pruned;
+    for (i = 0; i < CHAX_MAX_ERRNO; i++)
+        dst->errors[i] += src->errors[i];
+    dst->classify_ns += src->classify_ns;
+    lathist_merge(&dst->lstat_lat, &src->lstat_lat);
+    lathist_merge(&dst->getdents_lat, &src->getdents_lat);
+    for (i = 0; i < src->slow_dirs.len; i++)
+        slowlist_add(dst, &dst->slow_dirs, slow_max, src->slow_dirs.items[i].ns,
+                     src->slow_dirs.items[i].path);
+    for (i = 0; i < src->slow_entries.len; i++)
+        slowlist_add(dst, &dst->slow_entries, slow_max, src->slow_entries.items[i].ns,
+                     src->slow_entries.items[i].path);
+    if (src->threads_cpus > dst->threads_cpus)
+        dst->threads_cpus = src->threads_cpus;
+    if (src->threads_nofile > dst->threads_nofile)
+        dst->threads_nofile = src->threads_nofile;
+    if (src->threads_limit > dst->threads_limit)
+        dst->threads_limit = src->threads_limit;
+    if (src->threads_peak > dst->threads_peak)
+        dst->threads_peak = src->threads_peak;
+    if (src->threads_final > dst->threads_final)
+        dst->threads_final = src->threads_final;
+    dst->threads_changes += src->threads_changes;
+    if (src->threads_devices > dst->threads_devices)
+        dst->threads_devices = src->threads_devices;
+    dst->threads_devtunes += src->threads_devtunes;
+    if (src->stopped)
+        dst->stopped = 1;
+    dst->unvisited_dirs += src->unvisited_dirs;
+    dst->unvisited_est += src->unvisited_est;
+    dst->dirs_shared += src->dirs_shared;
+
+    /*
+     * src is usually done by now, so its peak lands on top of what we hold.
+     * the slow list copies above were already accounted to dst.
+     */
+    for (i = 0; i < CHAX_MEM_MAX; i++) {
+        if (i == CHAX_MEM_SLOWLIST)
+            continue;
+        if (dst->mem[i].cur + src->mem[i].peak > dst->mem[i].peak)
+            dst->mem[i].peak = dst->mem[i].cur + src->mem[i].peak;
+        dst->mem[i].cur += src->mem[i].cur;
+        dst->mem[i].total += src->mem[i].total;
+    }
+}
+
+
+void
+chax_stats_free(chax_stats_t *ps)
+{
+    int i;
+
+    for (i = 0; i < ps->slow_dirs.len; i++)
+        mem_free(ps, CHAX_MEM_SLOWLIST, ps->slow_dirs.items[i].path,
+                 strlen(ps->slow_dirs.items[i].path) + 1);
+    for (i = 0; i < ps->slow_entries.len; i++)
+        mem_free(ps, CHAX_MEM_SLOWLIST, ps->slow_entries.items[i].path,
+                 strlen(ps->slow_entries.items[i].path) + 1);
+    ps->slow_dirs.len = ps->slow_entries.len = 0;
+}
+
+
+/*
+ * the walk
+ */
+static void walk_run(chax_t *pc);
+static int walk_parallel(chax_t *pc, const char *dir, size_t len);
+static int par_share(chax_t *pc, size_t len, dev_t dev, const struct stat *sb);
+static int walk_serial(chax_t *pc, const char *dir, size_t len, unsigned int parent);
+static int walk_over_budget(chax_t *pc);
+static void walk_abandon(chax_t *pc);
+static void walk_unvisited(chax_t *pc, const char *path, size_t len, unsigned long long est,
+                           int partial);
+
+static void
+walk_error(chax_t *pc, const char *what, const char *parent, size_t parent_len,
+           const char *name, int err)
+{
+    pc->stats.errors[err >= 0 && err < CHAX_MAX_ERRNO ? err : 0]++;
+    if (pc->hooks.error)
+        pc->hooks.error(pc->hooks.arg, what, parent, parent_len, name, err);
+}
+
+
+static int
+dirreader_open(chax_t *pc, dirreader_t *pdr, const char *dir)
+{
+    pc->stats.opendir_calls++;
+    pdr->err = 0;
+#ifdef USE_GETDENTS64
+    pdr->fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (pdr->fd == -1)
+        return -1;
+    if (!(pdr->buf = (char *)mem_alloc(&pc->stats, CHAX_MEM_DIRBUF, DIRBUF_SIZE))) {
+        close(pdr->fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    pdr->pos = pdr->len = 0;
+#else
+    if (!(pdr->pd = opendir(dir)))
+        return -1;
+#endif
+    return 0;
+}
+
+
+/*
+ * returns the next entry, or NULL at the end of the directory (or on error,
+ * in which case errno is set.)
+ */
+static dirent_rec_t *
+dirreader_next(chax_t *pc, dirreader_t *pdr)
+{
+#ifdef USE_GETDENTS64
+    dirent_rec_t *pe;
+
+    if (pdr->pos >= pdr->len) {
+        int timed = pc->latency || pc->hooks.span || pc->par;
+        unsigned long long start = 0, end;
+
+        if (timed)
+            start = chax_now_ns();
+        if (pc->par)
+            TUNE_SET(pc, tune_since, start);
+        pc->stats.getdents_calls++;
+        pdr->len = syscall(SYS_getdents64, pdr->fd, pdr->buf, DIRBUF_SIZE);
+        if (timed) {
+            end = chax_now_ns();
+            if (pc->par) {
+                TUNE_SET(pc, tune_since, 0);
+                TUNE_ADD(pc, tune_ns, end - start);
+                TUNE_ADD(pc, tune_ops, 1);
+            }
+            if (pc->latency)
+                lathist_add(&pc->stats.getdents_lat, end - start);
+            if (pc->hooks.span)
+                pc->hooks.span(pc->hooks.arg, "getdents", start, end,
+                               pdr->len > 0 ? pdr->len : 0, NULL, 0);
+        }
+        pdr->pos = 0;
+        if (pdr->len < 0)
+            pdr->err = errno;
+        if (pdr->len <= 0)
+            return NULL;
+    }
+    pe = (dirent_rec_t *)(pdr->buf + pdr->pos);
+    pdr->pos += pe->d_reclen;
+    return pe;
+#else
+    dirent_rec_t *pe;
+
+    pc->stats.readdir_calls++;
+    errno = 0;
+    if (!(pe = readdir(pdr->pd)) && errno)
+        pdr->err = errno;
+    return pe;
+#endif
+}
+
+
+static void
+dirreader_close(chax_t *pc, dirreader_t *pdr)
+{
+    pc->stats.closedir_calls++;
+#ifdef USE_GETDENTS64
+    close(pdr->fd);
+    mem_free(&pc->stats, CHAX_MEM_DIRBUF, pdr->buf, DIRBUF_SIZE);
+#else
+    closedir(pdr->pd);
+#endif
+}
+
+
+/*
+ * guess how many entries are left: everything still queued in the frames,
+ * plus for each pending directory the size of a subtree at that depth.
+ * while directories a level down have been read that is the names in the
+ * ones read at the depth plus their subdirectories, each sized the same
+ * way a level down. the subtrees that were finished come only after that:
+ * the small ones finish first, so they run low near the top. failing
+ * both it goes by all depths, then nothing.
+ */
+static unsigned long long
+walk_subtree_avg(walk_t *pw, int depth)
+{
+    unsigned long long all_sum = 0, all_cnt = 0;
+    int i, d = depth < WALK_HIST_DEPTH ? depth : WALK_HIST_DEPTH - 1;
+
+    if (pw->read_cnt[d] && d + 1 < WALK_HIST_DEPTH && pw->read_cnt[d + 1])
+        return (pw->read_names[d] + pw->read_dirs[d] * walk_subtree_avg(pw, d + 1))
+               / pw->read_cnt[d];
+    if (pw->subtree_cnt[d])
+        return pw->subtree_sum[d] / pw->subtree_cnt[d];
+    for (i = 0; i < WALK_HIST_DEPTH; i++) {
+        all_sum += pw->subtree_sum[i];
+        all_cnt += pw->subtree_cnt[i];
+    }
+    return all_cnt ? all_sum / all_cnt : 0;
+}
+
+
+/*
+ * the directories among n DT_UNKNOWN names, going by the share of the
+ * ones already lstat'ed
+ */
+static unsigned long long
+walk_unknown_dirs(walk_t *pw, unsigned long long n)
+{
+    return pw->unknown_seen ? n * pw->unknown_dirs / pw->unknown_seen : 0;
+}
+
+
+static void
+walk_estimate(chax_t *pc)
+{
+    walk_t *pw = &pc->walk;
+    unsigned long long est = 0;
+    int i;
+
+    for (i = 0; i < pw->depth; i++) {
+        frame_t *pf = pw->frames + i;
+
+        est += pf->left + (pf->dirs_left + walk_unknown_dirs(pw, pf->unknown_left))
+                          * walk_subtree_avg(pw, i + 2);
+    }
+    PROGRESS_SET(pc, est_total, pw->entries + est);
+}
+
+
+/*
+ * read the directory at pw->path[0..path_len] into a new frame.
+ */
+static int
+walk_push(chax_t *pc, size_t path_len)
+{
+    walk_t *pw = &pc->walk;
+    dirreader_t dr;
+    dirent_rec_t *pe;
+    frame_t *pf;
+    unsigned long long start = 0;
+    int d;
+
+    if (pc->latency || pc->hooks.span)
+        start = chax_now_ns();
+
+    pw->path[path_len] = '\0';
+    if (pw->depth == pw->size) {
+        int new_size = pw->size ? pw->size * 2 : 16;
+        frame_t *frames = (frame_t *)mem_realloc(&pc->stats, CHAX_MEM_WALK_FRAMES, pw->frames,
+                                                 pw->size * sizeof(frame_t),
+                                                 new_size * sizeof(frame_t));
+
+        if (!frames) {
+            errno = ENOMEM;
+            goto fail;
+        }
+        pw->frames = frames;
+        memset(pw->frames + pw->size, 0, (new_size - pw->size) * sizeof(frame_t));
+        pw->size = new_size;
+    }
+    if (dirreader_open(pc, &dr, pw->path) == -1)
+        goto fail;
+
+    /* the names buffer of a previously popped frame is reused */
+    pf = pw->frames + pw->depth;
+    pf->path_len = path_len;
+    pf->names_len = 0;
+    pf->cursor = 0;
+    pf->left = 0;
+    pf->dirs_left = 0;
+    pf->unknown_left = 0;
+    pf->entries_at_push = pw->entries;
+    pf->parent = pw->parent;
+
+    while ((pe = dirreader_next(pc, &dr))) {
+        size_t len;
+
+        if (pe->d_name[0] == '.') {
+            if (pe->d_name[1] == '\0')
+                continue;
+            if (pe->d_name[1] == '.' && pe->d_name[2] == '\0')
+                continue;
+        }
+
+        len = strlen(pe->d_name);
+        if (pf->names_len + len + 2 > pf->names_size) {
+            size_t new_size = pf->names_size ? pf->names_size * 2 : 4096;
+            char *names;
+
+            while (pf->names_len + len + 2 > new_size)
+                new_size *= 2;
+            names = (char *)mem_realloc(&pc->stats, CHAX_MEM_WALK_NAMES, pf->names,
+                                        pf->names_size, new_size);
+            if (!names) {
+                dr.err = ENOMEM;
+                break;
+            }
+            pf->names = names;
+            pf->names_size = new_size;
+        }
+        pf->names[pf->names_len] = pe->d_type;
+        memcpy(pf->names + pf->names_len + 1, pe->d_name, len + 1);
+        pf->names_len += len + 2;
+        pf->left++;
+        if (pe->d_type == DT_DIR)
+            pf->dirs_left++;
+        else if (pe->d_type == DT_UNKNOWN)
+            pf->unknown_left++;
+    }
+
+    /* keep whatever was read before the error */
+    if (dr.err)
+        walk_error(pc, "Unable to read dir", pw->path, path_len, "", dr.err);
+    dirreader_close(pc, &dr);
+
+    pw->depth++;
+    d = pw->base + pw->depth < WALK_HIST_DEPTH ? pw->base + pw->depth : WALK_HIST_DEPTH - 1;
+    pw->read_cnt[d]++;
+    pw->read_names[d] += pf->left;
+    pw->read_dirs[d] += pf->dirs_left;
+    if (pc->latency || pc->hooks.span) {
+        unsigned long long end = chax_now_ns();
+
+        pf->own_ns = end - start;
+        if (pc->hooks.span)
+            pc->hooks.span(pc->hooks.arg, "read_dir", start, end, pf->left, pw->path, path_len);
+    }
+    if (pc->progress) {
+        PROGRESS_ADD(pc, dirs, 1);
+        PROGRESS_ADD(pc, pending_dirs, pf->dirs_left + pf->unknown_left);
+        /* each worker only sees its own stack, there's nothing to estimate from */
+        if (!pc->par) {
+            PROGRESS_SET(pc, depth, pw->depth);
+            walk_estimate(pc);
+        }
+    }
+    return 0;
+
+fail:
+    {
+        int err = errno;
+        char *slash = strrchr(pw->path, '/');
+
+        if (!slash)
+            walk_error(pc, "Unable to open dir", "", 0, pw->path, err);
+        else
+            walk_error(pc, "Unable to open dir", pw->path, slash - pw->path, slash + 1, err);
+    }
+    return -1;
+}
+
+
+static void
+walk_pop(chax_t *pc)
+{
+    walk_t *pw = &pc->walk;
+    frame_t *pf = pw->frames + pw->depth - 1;
+    int d = pw->base + pw->depth < WALK_HIST_DEPTH ? pw->base + pw->depth : WALK_HIST_DEPTH - 1;
+
+    pw->subtree_sum[d] += pw->entries - pf->entries_at_push;
+    pw->subtree_cnt[d]++;
+
+    /* charge only the time spent in this directory, not its children */
+    if (pc->latency) {
+        pw->path[pf->path_len] = '\0';
+        slowlist_add(&pc->stats, &pc->stats.slow_dirs, pc->slow_max, pf->own_ns, pw->path);
+    }
+
+    pw->depth--;
+    if (pc->progress && !pc->par) {
+        PROGRESS_SET(pc, depth, pw->depth);
+        walk_estimate(pc);
+    }
+}
+
+
+/* the deadline starts with the first walk, one too far off never comes */
+static void
+budget_start(chax_t *pc)
+{
+    unsigned long long now;
+
+    if (!pc->deadline_ms || pc->deadline_ns)
+        return;
+    now = chax_now_ns();
+    if (pc->deadline_ms < (~0ULL - now) / 1000000)
+        pc->deadline_ns = now + pc->deadline_ms * 1000000ULL;
+    else
+        pc->deadline_ns = ~0ULL;
+}
+
+
+int
+chax_scan(chax_t *pc, const char *dir)
+{
+    return chax_walk(pc, dir, 0);
+}
+
+
+int
+chax_walk(chax_t *pc, const char *dir, unsigned int parent)
+{
+    size_t len = strlen(dir);
+
+    if (len > PATH_MAX) {
+        walk_error(pc, "Unable to open dir", "", 0, dir, ENAMETOOLONG);
+        return -1;
+    }
+    budget_start(pc);
+    if (pc->stopped) {
+        walk_unvisited(pc, dir, len, 0, 0);
+        return 0;
+    }
+    if ((pc->threads != 1 || pc->priority) && !pc->hooks.entry)
+        return walk_parallel(pc, dir, len);
+    return walk_serial(pc, dir, len, parent);
+}
+
+
+static int
+walk_serial(chax_t *pc, const char *dir, size_t len, unsigned int parent)
+{
+    walk_t *pw = &pc->walk;
+
+    memcpy(pw->path, dir, len + 1);
+    pw->parent = parent;
+    if (walk_push(pc, len) == -1)
+        return -1;
+    walk_run(pc);
+    return 0;
+}
+
+
+/*
+ * count the entry about to be visited against the budget. a serial walk
+ * stops right at max_entries, workers may go over by a batch each.
+ */
+static int
+walk_over_budget(chax_t *pc)
+{
+    chax_t *po = pc->par ? pc->par->owner : pc;
+    unsigned long long used;
+
+    if (__atomic_load_n(&po->stopped, __ATOMIC_RELAXED))
+        return 1;
+    if (!pc->par)
+        used = ++pc->budget_used;
+    else if (++pc->budget_batch == BUDGET_BATCH) {
+        used = __atomic_add_fetch(&po->budget_used, BUDGET_BATCH, __ATOMIC_RELAXED);
+        pc->budget_batch = 0;
+    }
+    else
+        return 0;
+
+    if ((po->max_entries && used > po->max_entries)
+        || (po->deadline_ns && used % BUDGET_BATCH == 0 && chax_now_ns() >= po->deadline_ns)) {
+        __atomic_store_n(&po->stopped, 1, __ATOMIC_RELAXED);
+        pc->stats.stopped = 1;
+        return 1;
+    }
+    return 0;
+}
+
+
+static void
+walk_unvisited(chax_t *pc, const char *path, size_t len, unsigned long long est, int partial)
+{
+    if (!partial)
+        pc->stats.unvisited_dirs++;
+    pc->stats.unvisited_est += est;
+    if (pc->hooks.unvisited)
+        pc->hooks.unvisited(pc->hooks.arg, path, len, est, partial);
+}
+
+
+/*
+ * the budget ran out: hand every directory still on the stack over as not
+ * visited, and the ones that were only partly visited with the count of
+ * entries left in them, the directories among those included.
+ *
+ * a subtree is sized like the ones seen at the same depth, or like the
+ * sibling that was being walked if that one is bigger already: near the
+ * top nothing has been finished to go by.
+ *
+ * a pending directory is only reported on its own once an lstat shows the
+ * identity may search it, or a later run would go where this one couldn't.
+ * that is all the work done past the budget, so it stops after
+ * ABANDON_CHECKS of them or ABANDON_NS. the directories left unchecked
+ * are sized into the partly visited one they are in, a later run of that
+ * one covers them.
+ */
+#define ABANDON_CHECKS 64
+#define ABANDON_NS 10000000ULL
+
+static void
+walk_abandon(chax_t *pc)
+{
+    walk_t *pw = &pc->walk;
+    unsigned long long sibling = 0, give_up = chax_now_ns() + ABANDON_NS;
+    unsigned int checks = 0;
+    struct stat sb;
+
+    while (pw->depth > 0) {
+        frame_t *pf = pw->frames + pw->depth - 1;
+        char *end = pw->path + pf->path_len;
+        unsigned long long avg = walk_subtree_avg(pw, pw->base + pw->depth + 1),
+                           left = 0, folded = 0, unknown_folded = 0;
+
+        if (sibling > avg)
+            avg = sibling;
+        sibling = pw->entries - pf->entries_at_push;
+
+        if (end > pw->path && *(end - 1) != '/')
+            *end++ = '/';
+        for (; pf->left > 0; pf->left--) {
+            unsigned char d_type = pf->names[pf->cursor];
+            const char *name = pf->names + pf->cursor + 1;
+            size_t name_len = strlen(name);
+
+            pf->cursor += name_len + 2;
+            left++;
+            if ((d_type != DT_DIR && d_type != DT_UNKNOWN) || pf->path_len >= PATH_MAX - 1 - name_len)
+                continue;
+            if (checks == ABANDON_CHECKS || chax_now_ns() >= give_up) {
+                checks = ABANDON_CHECKS;
+                if (d_type == DT_DIR)
+                    folded++;
+                else
+                    unknown_folded++;
+                continue;
+            }
+            /* the walk would have pruned it, a later run mustn't go in either */
+            checks++;
+            memcpy(end, name, name_len + 1);
+            if (lstat(pw->path, &sb) == -1 || !S_ISDIR(sb.st_mode) || !is_executable(pc, &sb))
+                continue;
+            walk_unvisited(pc, pw->path, end - pw->path + name_len, avg, 0);
+        }
+        if (pc->progress)
+            PROGRESS_ADD(pc, pending_dirs, -(long long)(pf->dirs_left + pf->unknown_left));
+        pf->dirs_left = 0;
+        pf->unknown_left = 0;
+        folded += walk_unknown_dirs(pw, unknown_folded);
+        if (left) {
+            pw->path[pf->path_len] = '\0';
+            walk_unvisited(pc, pw->path, pf->path_len, left + folded * avg, 1);
+        }
+        pw->depth--;
+    }
+    if (pc->progress && !pc->par)
+        PROGRESS_SET(pc, depth, 0);
+}
+
+
+/*
+ * walk until the stack is empty
+ */
+static void
+walk_run(chax_t *pc)
+{
+    walk_t *pw = &pc->walk;
+    chax_hooks_t *ph = &pc->hooks;
+    struct stat sb;
+    /* consecutive entries handled in one frame form a "stat_batch" span */
+    unsigned long long batch_start = 0, batch_len = 0;
+
+    while (pw->depth > 0) {
+        frame_t *pf = pw->frames + pw->depth - 1;
+        char *end = pw->path + pf->path_len;
+        unsigned char d_type;
+        const char *name;
+        size_t name_len;
+        unsigned long long start = 0;
+        int ret, cls;
+
+        if (!pf->left) {
+            if (batch_len) {
+                ph->span(ph->arg, "stat_batch", batch_start, chax_now_ns(), batch_len,
+                         pw->path, pf->path_len);
+                batch_len = 0;
+            }
+            walk_pop(pc);
+            continue;
+        }
+        if ((pc->deadline_ns || pc->max_entries) && walk_over_budget(pc)) {
+            if (batch_len)
+                ph->span(ph->arg, "stat_batch", batch_start, chax_now_ns(), batch_len,
+                         pw->path, pf->path_len);
+            walk_abandon(pc);
+            break;
+        }
+        if (ph->span && !batch_len++)
+            batch_start = chax_now_ns();
+
+        d_type = pf->names[pf->cursor];
+        name = pf->names + pf->cursor + 1;
+        name_len = strlen(name);
+        pf->cursor += name_len + 2;
+        pf->left--;
+        if (d_type == DT_DIR) {
+            pf->dirs_left--;
+            if (pc->progress)
+                PROGRESS_ADD(pc, pending_dirs, -1);
+        }
+        else if (d_type == DT_UNKNOWN) {
+            pf->unknown_left--;
+            if (pc->progress)
+                PROGRESS_ADD(pc, pending_dirs, -1);
+        }
+        pw->entries++;
+        pc->stats.visited++;
+        if (pc->progress)
+            PROGRESS_ADD(pc, entries, 1);
+        if (pc->par)
+            TUNE_ADD(pc, tune_entries, 1);
+
+        if (pf->path_len >= PATH_MAX - 1 - name_len) {
+            walk_error(pc, "Name too long", pw->path, pf->path_len, name, ENAMETOOLONG);
+            continue;
+        }
+        if (end > pw->path && *(end - 1) != '/')
+            *end++ = '/';
+        memcpy(end, name, name_len + 1);
+
+        /* decide where to put this one */
+        pc->stats.lstat_calls++;
+        if (pc->timing || pc->latency || pc->par)
+            start = chax_now_ns();
+        if (pc->par)
+            TUNE_SET(pc, tune_since, start);
+        ret = lstat(pw->path, &sb);
+        if (pc->latency || pc->par) {
+            unsigned long long ns = chax_now_ns() - start;
+
+            if (pc->latency) {
+                lathist_add(&pc->stats.lstat_lat, ns);
+                slowlist_add(&pc->stats, &pc->stats.slow_entries, pc->slow_max, ns, pw->path);
+            }
+            if (pc->par) {
+                TUNE_SET(pc, tune_since, 0);
+                TUNE_ADD(pc, tune_ns, ns);
+                TUNE_ADD(pc, tune_ops, 1);
+            }
+        }
+        if (ret == -1) {
+            walk_error(pc, "Unable to lstat", pw->path, pf->path_len, name, errno);
+            continue;
+        }
+        pc->stats.entries[chax_etype(sb.st_mode)]++;
+        /* now it's known, size the directories that are still unread by it */
+        if (d_type == DT_UNKNOWN) {
+            pw->unknown_seen++;
+            if (S_ISDIR(sb.st_mode)) {
+                int d = pw->base + pw->depth;
+
+                pw->unknown_dirs++;
+                pw->read_dirs[d < WALK_HIST_DEPTH ? d : WALK_HIST_DEPTH - 1]++;
+            }
+        }
+
+        /* the entry hook gets everything and we go wherever we can */
+        if (ph->entry) {
+            pw->parent = ph->entry(ph->arg, pf->parent, pw->path, end - pw->path + name_len,
+                                   end - pw->path, &sb);
+            if (S_ISDIR(sb.st_mode)) {
+                if (batch_len) {
+                    ph->span(ph->arg, "stat_batch", batch_start, chax_now_ns(), batch_len,
+                             pw->path, pf->path_len);
+                    batch_len = 0;
+                }
+                walk_push(pc, end - pw->path + name_len);
+            }
+            continue;
+        }
+
+        /* skip symlinks.. */
+        if (S_ISLNK(sb.st_mode))
+            continue;
+
+        if (ph->classify)
+            ph->classify(ph->arg, 1);
+        if (pc->timing) {
+            unsigned long long classify_start = chax_now_ns();
+
+            cls = chax_classify(pc, &sb);
+            pc->stats.classify_ns += chax_now_ns() - classify_start;
+        }
+        else
+            cls = chax_classify(pc, &sb);
+        if (ph->classify)
+            ph->classify(ph->arg, 0);
+        /* whatever the hook does to keep it is not classification */
+        if (cls >= 0 && ph->finding)
+            ph->finding(ph->arg, cls, pw->path, &sb);
+        if (pc->timing && pc->latency)
+            pf->own_ns += chax_now_ns() - start;
+
+        /* can the child directory too */
+        if (S_ISDIR(sb.st_mode)) {
+            if (!is_executable(pc, &sb))
+                pc->stats.dirs_pruned++;
+            else if (!pc->par || !par_share(pc, end - pw->path + name_len, sb.st_dev, &sb)) {
+                if (batch_len) {
+                    ph->span(ph->arg, "stat_batch", batch_start, chax_now_ns(), batch_len,
+                             pw->path, pf->path_len);
+                    batch_len = 0;
+                }
+                walk_push(pc, end - pw->path + name_len);
+            }
+        }
+    }
+}
+
+
+/*
+ * how many cpus we may keep busy: the affinity mask, or fewer if a cgroup
+ * (v2 cpu.max, v1 cfs quota) limits us to less time than that.
+ */
+static int
+read_small(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd == -1)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+
+static unsigned int
+cgroup_cpus(void)
+{
+    char buf[4096], path[PATH_MAX], *line, *cg = NULL, *v1 = NULL;
+    unsigned long long quota = 0, period = 0;
+
+    if (read_small("/proc/self/cgroup", buf, sizeof(buf)) == -1)
+        return 0;
+    for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+        char *ctl = strchr(line, ':'), *where = ctl ? strchr(ctl + 1, ':') : NULL;
+
+        if (!where)
+            continue;
+        *where++ = '\0';
+        if (!strcmp(ctl, ":"))
+            cg = where;
+        else if (strstr(ctl, "cpu,") || !strcmp(ctl, ":cpu") || strstr(ctl, ",cpu"))
+            v1 = where;
+    }
+    if (cg) {
+        char val[64];
+
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cg);
+        if (read_small(path, val, sizeof(val)) == -1
+            && read_small("/sys/fs/cgroup/cpu.max", val, sizeof(val)) == -1)
+            return 0;
+        if (sscanf(val, "%llu %llu", &quota, &period) != 2)
+            return 0;
+    }
+    else if (v1) {
+        char val[64];
+
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_quota_us", v1);
+        if (read_small(path, val, sizeof(val)) == -1 || sscanf(val, "%llu", &quota) != 1)
+            return 0;
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_period_us", v1);
+        if (read_small(path, val, sizeof(val)) == -1 || sscanf(val, "%llu", &period) != 1)
+            return 0;
+    }
+    if (!quota || !period)
+        return 0;
+    return (quota + period - 1) / period;
+}
+
+
+static unsigned int
+cpu_limit(void)
+{
+    unsigned int cpus = 0, quota = cgroup_cpus();
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        cpus = CPU_COUNT(&set);
+#endif
+    if (!cpus) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        cpus = n > 0 ? n : 1;
+    }
+    if (quota && quota < cpus)
+        cpus = quota;
+    return cpus;
+}
+
+
+/*
+ * every worker holds one directory open at a time, leave some for the
+ * rest of the program
+ */
+static unsigned int
+nofile_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY
+        || rl.rlim_cur > 16 + CHAX_THREADS_MAX)
+        return CHAX_THREADS_MAX;
+    return rl.rlim_cur > 17 ? rl.rlim_cur - 16 : 1;
+}
+
+
+static void
+par_set_active(par_t *par, unsigned int active)
+{
+    pthread_mutex_lock(&par->lock);
+    __atomic_store_n(&par->active, active, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&par->work);
+    pthread_mutex_unlock(&par->lock);
+}
+
+
+/*
+ * the queue for dev, a new one if there's room. called with the lock held.
+ */
+static devq_t *
+par_devq(par_t *par, dev_t dev, unsigned int fallback)
+{
+    devq_t *dq;
+    unsigned int i;
+
+    for (i = 0; i < par->ndevs; i++) {
+        if (par->devs[i].dev == dev)
+            return par->devs + i;
+    }
+    if (par->ndevs == PAR_DEVS_MAX)
+        return par->devs + fallback;
+    dq = par->devs + par->ndevs;
+    dq->dev = dev;
+    dq->limit = par->devs[0].limit;
+    __atomic_store_n(&par->ndevs, par->ndevs + 1, __ATOMIC_RELAXED);
+    return dq;
+}
+
+
+/*
+ * the job heap of a device. called with the lock held.
+ */
+static int
+job_before(const job_t *a, const job_t *b)
+{
+    return a->prio > b->prio || (a->prio == b->prio && a->seq > b->seq);
+}
+
+
+static int
+devq_push(par_t *par, devq_t *dq, job_t *pj)
+{
+    unsigned int i = dq->queued;
+
+    if (dq->queued == dq->jobs_size) {
+        unsigned int size = dq->jobs_size ? dq->jobs_size * 2 : 64;
+        job_t **jobs = (job_t **)mem_realloc(&par->owner->stats, CHAX_MEM_WALK_NAMES, dq->jobs,
+                                             dq->jobs_size * sizeof(job_t *),
+                                             size * sizeof(job_t *));
+
+        if (!jobs)
+            return -1;
+        dq->jobs = jobs;
+        dq->jobs_size = size;
+    }
+    pj->seq = par->seq++;
+    while (i > 0 && job_before(pj, dq->jobs[(i - 1) / 2])) {
+        dq->jobs[i] = dq->jobs[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    dq->jobs[i] = pj;
+    __atomic_store_n(&dq->queued, dq->queued + 1, __ATOMIC_RELAXED);
+    par->queued++;
+    return 0;
+}
+
+
+static job_t *
+devq_pop(par_t *par, devq_t *dq)
+{
+    job_t *top = dq->jobs[0], *last = dq->jobs[dq->queued - 1];
+    unsigned int i = 0, n = dq->queued - 1;
+
+    for (;;) {
+        unsigned int c = 2 * i + 1;
+
+        if (c >= n)
+            break;
+        if (c + 1 < n && job_before(dq->jobs[c + 1], dq->jobs[c]))
+            c++;
+        if (!job_before(dq->jobs[c], last))
+            break;
+        dq->jobs[i] = dq->jobs[c];
+        i = c;
+    }
+    dq->jobs[i] = last;
+    __atomic_store_n(&dq->queued, n, __ATOMIC_RELAXED);
+    par->queued--;
+    return top;
+}
+
+
+/*
+ * the device a worker should take a job from: one nobody is walking yet,
+ * else the one with the best job when going by priority, else the one
+ * with the lowest latency. -1 if all queues are empty or at their limit.
+ * called with the lock held.
+ */
+static int
+par_pick(par_t *par, int priority)
+{
+    int i, best = -1;
+
+    for (i = 0; i < (int)par->ndevs; i++) {
+        devq_t *dq = par->devs + i;
+
+        if (!dq->queued || dq->busy >= dq->limit)
+            continue;
+        if (!dq->busy)
+            return i;
+        if (best == -1)
+            best = i;
+        else if (priority && dq->jobs[0]->prio != par->devs[best].jobs[0]->prio) {
+            if (dq->jobs[0]->prio > par->devs[best].jobs[0]->prio)
+                best = i;
+        }
+        else if (dq->lat < par->devs[best].lat)
+            best = i;
+    }
+    return best;
+}
+
+
+/*
+ * how promising a directory is, higher first: the names that tend to hold
+ * set-id binaries, device nodes and sockets, then what the identity may do
+ * to it. trees that are huge and hold nothing of interest go last.
+ */
+static const struct {
+    const char *name;
+    int prio;
+} prio_names[] = {
+    { "bin", 40 }, { "sbin", 40 }, { "xbin", 40 }, { "dev", 40 },
+    { "libexec", 30 }, { "run", 25 }, { "socket", 25 }, { "sockets", 25 },
+    { "tmp", 20 }, { "local", 10 }, { "etc", 10 },
+    { "share", -10 }, { "cache", -10 }, { "src", -10 }, { "doc", -20 },
+    { "man", -20 }, { "include", -20 }, { "locale", -20 },
+    { "proc", -60 }, { "sys", -60 }
+};
+
+int
+chax_priority(chax_t *pc, const char *path, size_t len, const struct stat *sb)
+{
+    const char *name = path + len;
+    size_t name_len;
+    unsigned int i;
+    int prio = 0;
+
+    while (name > path && name[-1] != '/')
+        name--;
+    name_len = path + len - name;
+    for (i = 0; i < sizeof(prio_names) / sizeof(prio_names[0]); i++) {
+        if (strlen(prio_names[i].name) == name_len
+            && !memcmp(prio_names[i].name, name, name_len)) {
+            prio = prio_names[i].prio;
+            break;
+        }
+    }
+    if (is_writable(pc, sb))
+        prio += 30;
+    if (pc->uid && sb->st_uid == pc->uid)
+        prio += 15;
+    if (sb->st_mode & S_ISGID)
+        prio += 10;
+    return prio;
+}
+
+
+/*
+ * hand pw->path[0..len] to an idle worker instead of descending into it.
+ * a worker over the allowed count, or in a device over its limit, gives
+ * everything away so it can stop. other devices always go to their queue.
+ */
+static int
+par_share(chax_t *pc, size_t len, dev_t dev, const struct stat *sb)
+{
+    par_t *par = pc->par;
+    devq_t *dq = par->devs + pc->dev_idx;
+    job_t *pj;
+    int prio = 0;
+
+    if (pc->priority) {
+        /* half of the parent's counts, a good tree stays good a while */
+        prio = pc->prio / 2 + (pc->hooks.priority
+                               ? pc->hooks.priority(pc->hooks.arg, pc->walk.path, len, sb)
+                               : chax_priority(pc, pc->walk.path, len, sb));
+    }
+    else if (dev == pc->dev && pc->worker < __atomic_load_n(&par->active, __ATOMIC_RELAXED)
+        && __atomic_load_n(&dq->busy, __ATOMIC_RELAXED)
+           <= __atomic_load_n(&dq->limit, __ATOMIC_RELAXED)
+        && (__atomic_load_n(&dq->queued, __ATOMIC_RELAXED)
+            || !__atomic_load_n(&par->idle, __ATOMIC_RELAXED)
+            || __atomic_load_n(&dq->busy, __ATOMIC_RELAXED)
+               == __atomic_load_n(&dq->limit, __ATOMIC_RELAXED)))
+        return 0;
+    /* the queue's memory is accounted to the owner, under the lock */
+    pthread_mutex_lock(&par->lock);
+    if (!(pj = (job_t *)mem_alloc(&par->owner->stats, CHAX_MEM_WALK_NAMES,
+                                  sizeof(job_t) + len + 1))) {
+        pthread_mutex_unlock(&par->lock);
+        return 0;
+    }
+    pj->len = len;
+    pj->prio = prio;
+    pj->root = 0;
+    pj->depth = pc->walk.base + pc->walk.depth + 1;
+    memcpy(pj->path, pc->walk.path, len);
+    pj->path[len] = '\0';
+    dq = par_devq(par, dev, pc->dev_idx);
+    if (devq_push(par, dq, pj) == -1) {
+        mem_free(&par->owner->stats, CHAX_MEM_WALK_NAMES, pj, sizeof(job_t) + len + 1);
+        pthread_mutex_unlock(&par->lock);
+        return 0;
+    }
+    /* not signal, the one woken might not be allowed to take it */
+    pthread_cond_broadcast(&par->work);
+    pthread_mutex_unlock(&par->lock);
+    pc->stats.dirs_shared++;
+    return 1;
+}
+
+
+static void *
+par_worker(void *arg)
+{
+    chax_t *pc = (chax_t *)arg;
+    par_t *par = pc->par;
+    walk_t *pw = &pc->walk;
+
+    pthread_mutex_lock(&par->lock);
+    for (;;) {
+        devq_t *dq;
+        job_t *pj;
+        int d = -1;
+
+        while (!par->done
+               && (pc->worker >= par->active || __atomic_load_n(&par->owner->stopped,
+                                                                __ATOMIC_RELAXED)
+                   || (d = par_pick(par, pc->priority)) == -1)) {
+            __atomic_store_n(&par->idle, par->idle + 1, __ATOMIC_RELAXED);
+            pthread_cond_wait(&par->work, &par->lock);
+            __atomic_store_n(&par->idle, par->idle - 1, __ATOMIC_RELAXED);
+        }
+        if (par->done)
+            break;
+        dq = par->devs + d;
+        pj = devq_pop(par, dq);
+        __atomic_store_n(&dq->busy, dq->busy + 1, __ATOMIC_RELAXED);
+        par->busy++;
+        pc->dev = dq->dev;
+        pc->prio = pj->prio;
+        TUNE_SET(pc, dev_idx, d);
+        pthread_mutex_unlock(&par->lock);
+
+        memcpy(pw->path, pj->path, pj->len + 1);
+        pw->parent = 0;
+        pw->base = pj->depth - 1;
+        if (walk_push(pc, pj->len) == 0)
+            walk_run(pc);
+        else if (pj->root)
+            par->root_failed = 1;
+
+        pthread_mutex_lock(&par->lock);
+        mem_free(&par->owner->stats, CHAX_MEM_WALK_NAMES, pj, sizeof(job_t) + pj->len + 1);
+        __atomic_store_n(&dq->busy, dq->busy - 1, __ATOMIC_RELAXED);
+        if (!--par->busy
+            && (!par->queued || __atomic_load_n(&par->owner->stopped, __ATOMIC_RELAXED))) {
+            par->done = 1;
+            pthread_cond_broadcast(&par->work);
+            pthread_cond_signal(&par->over);
+        }
+        else if (dq->queued)
+            pthread_cond_broadcast(&par->work);
+    }
+    pthread_mutex_unlock(&par->lock);
+    return NULL;
+}
+
+
+/*
+ * a device's limit follows its latency: a quarter less while it is at 4x
+ * the best seen, one more while it is back under 2x. a worker stuck in a
+ * syscall counts with the time it has been waiting so far, a hung mount
+ * never completes an operation to measure. called with the lock held.
+ */
+static int
+dev_tune(devq_t *dq, double lat, unsigned int max)
+{
+    unsigned int limit = dq->limit;
+
+    if (lat <= 0)
+        return 0;
+    dq->lat = dq->lat ? (3 * dq->lat + lat) / 4 : lat;
+    if (!dq->lat_best || dq->lat < dq->lat_best)
+        dq->lat_best = dq->lat;
+    if (dq->lat > 4 * dq->lat_best && limit > 1)
+        limit -= limit / 4 ? limit / 4 : 1;
+    else if (dq->lat < 2 * dq->lat_best && limit < max)
+        limit++;
+    if (limit == dq->limit)
+        return 0;
+    __atomic_store_n(&dq->limit, limit, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+/*
+ * hill climbing on entries/s, once per period. start at two and double
+ * while a step buys at least 10% more, then move one at a time. a step
+ * that doesn't pay off is taken back and the next probe waits a while.
+ * latency at 4x the best seen without a gain in throughput means the
+ * device is saturated, so back off by a quarter.
+ */
+typedef struct __stru_tuner {
+    unsigned int active;
+    unsigned int prev_active;
+    int slow_start;
+    int hold;
+    double prev_rate;
+    double best_lat;
+} tuner_t;
+
+static unsigned int
+tune_step(tuner_t *pt, unsigned int limit, double rate, double lat)
+{
+    unsigned int next = pt->active;
+
+    if (lat > 0 && (pt->best_lat == 0 || lat < pt->best_lat))
+        pt->best_lat = lat;
+
+    if (pt->active > 1 && lat > 4 * pt->best_lat && rate <= pt->prev_rate * 1.1) {
+        next = pt->active - (pt->active / 4 ? pt->active / 4 : 1);
+        pt->slow_start = 0;
+        pt->hold = 4;
+    }
+    else if (pt->active > pt->prev_active && rate < pt->prev_rate * 1.1) {
+        /* the last step up didn't help */
+        next = pt->prev_active;
+        pt->slow_start = 0;
+        pt->hold = 8;
+    }
+    else if (pt->hold > 0)
+        pt->hold--;
+    else if (pt->active < limit)
+        next = pt->slow_start ? pt->active * 2 : pt->active + 1;
+    if (next > limit)
+        next = limit;
+
+    pt->prev_active = pt->active;
+    pt->prev_rate = rate;
+    pt->active = next;
+    return next;
+}
+
+
+/*
+ * one tick of the device limits. what a worker did since the last tick is
+ * put down to the device it is in now. called with the lock held.
+ */
+static void
+par_tune_devs(chax_t *pc, par_t *par, chax_t *workers, unsigned int nworkers,
+              unsigned long long *seen, unsigned long long now)
+{
+    double ns[PAR_DEVS_MAX] = { 0 }, ops[PAR_DEVS_MAX] = { 0 }, stall[PAR_DEVS_MAX] = { 0 };
+    unsigned int i, d, changed = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        chax_t *pw = workers + i;
+        unsigned long long wns = TUNE_GET(pw, tune_ns), wops = TUNE_GET(pw, tune_ops);
+        unsigned long long since = TUNE_GET(pw, tune_since);
+
+        d = TUNE_GET(pw, dev_idx);
+        ns[d] += wns - seen[2 * i];
+        ops[d] += wops - seen[2 * i + 1];
+        seen[2 * i] = wns;
+        seen[2 * i + 1] = wops;
+        if (since && since < now && now - since > stall[d])
+            stall[d] = now - since;
+    }
+    for (d = 0; d < par->ndevs; d++) {
+        devq_t *dq = par->devs + d;
+        double lat = ops[d] ? ns[d] / ops[d] : 0;
+
+        if (stall[d] > lat && stall[d] > dq->lat)
+            lat = stall[d];
+        if (!dev_tune(dq, lat, nworkers))
+            continue;
+        changed = 1;
+        pc->stats.threads_devtunes++;
+        if (pc->hooks.span) {
+            char name[32];
+
+            snprintf(name, sizeof(name), "%u:%u", major(dq->dev), minor(dq->dev));
+            pc->hooks.span(pc->hooks.arg, "device_limit", now, now, dq->limit, name,
+                           strlen(name));
+        }
+    }
+    if (changed)
+        pthread_cond_broadcast(&par->work);
+}
+
+
+static int
+walk_parallel(chax_t *pc, const char *dir, size_t len)
+{
+    chax_stats_t *ps = &pc->stats;
+    unsigned int cpus = cpu_limit(), nofile = nofile_limit(), limit, n, i;
+    unsigned long long last_ns, last_entries = 0, last_ns_sum = 0, last_ops = 0;
+    /* what each worker had done at the last tick, for the device it is in */
+    unsigned long long *seen;
+    pthread_condattr_t attr;
+    struct stat sb;
+    chax_t *workers;
+    pthread_t *tids;
+    tuner_t tuner;
+    par_t par;
+    job_t *pj;
+
+    limit = pc->threads ? (unsigned int)pc->threads : 4 * cpus;
+    if (limit > nofile)
+        limit = nofile;
+    if (limit > CHAX_THREADS_MAX)
+        limit = CHAX_THREADS_MAX;
+
+    workers = (chax_t *)calloc(limit, sizeof(chax_t));
+    tids = (pthread_t *)calloc(limit, sizeof(pthread_t));
+    seen = (unsigned long long *)calloc(2 * limit, sizeof(unsigned long long));
+    pj = (job_t *)mem_alloc(ps, CHAX_MEM_WALK_NAMES, sizeof(job_t) + len + 1);
+    if (!workers || !tids || !seen || !pj) {
+        free(workers);
+        free(tids);
+        free(seen);
+        if (pj)
+            mem_free(ps, CHAX_MEM_WALK_NAMES, pj, sizeof(job_t) + len + 1);
+        walk_error(pc, "Unable to open dir", "", 0, dir, ENOMEM);
+        return -1;
+    }
+    pj->len = len;
+    pj->prio = 0;
+    pj->root = 1;
+    pj->depth = 1;
+    memcpy(pj->path, dir, len + 1);
+
+    memset(&par, 0, sizeof(par));
+    pthread_mutex_init(&par.lock, NULL);
+    pthread_cond_init(&par.work, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&par.over, &attr);
+    pthread_condattr_destroy(&attr);
+    par.devs[0].dev = lstat(dir, &sb) == 0 ? sb.st_dev : 0;
+    par.devs[0].limit = limit;
+    par.ndevs = 1;
+    par.owner = pc;
+    if (devq_push(&par, par.devs, pj) == -1) {
+        free(workers);
+        free(tids);
+        free(seen);
+        mem_free(ps, CHAX_MEM_WALK_NAMES, pj, sizeof(job_t) + len + 1);
+        pthread_cond_destroy(&par.over);
+        pthread_cond_destroy(&par.work);
+        pthread_mutex_destroy(&par.lock);
+        walk_error(pc, "Unable to open dir", "", 0, dir, ENOMEM);
+        return -1;
+    }
+
+    memset(&tuner, 0, sizeof(tuner));
+    tuner.active = pc->threads ? limit : (limit < 2 ? limit : 2);
+    tuner.prev_active = tuner.active;
+    tuner.slow_start = 1;
+    par.active = tuner.active;
+
+    /* all copies first, the running workers update pc's progress counters */
+    for (i = 0; i < limit; i++) {
+        chax_t *pw = workers + i;
+
+        *pw = *pc;
+        memset(&pw->walk, 0, sizeof(pw->walk));
+        memset(&pw->stats, 0, sizeof(pw->stats));
+        pw->par = &par;
+        pw->worker = i;
+        pw->budget_batch = 0;
+        pw->tune_entries = pw->tune_ns = pw->tune_ops = 0;
+    }
+    /* a single worker (CHAX_OPT_PRIORITY alone) keeps the hooks on our thread */
+    for (n = 0; n < limit && pc->threads != 1; n++) {
+        if (pthread_create(tids + n, NULL, par_worker, workers + n) != 0)
+            break;
+    }
+    if (pc->threads == 1)
+        n = 1;
+    else if (!n) {
+        /* no threads to be had, walk it here */
+        free(workers);
+        free(tids);
+        free(seen);
+        mem_free(ps, CHAX_MEM_WALK_NAMES, pj, sizeof(job_t) + len + 1);
+        mem_free(ps, CHAX_MEM_WALK_NAMES, par.devs[0].jobs,
+                 par.devs[0].jobs_size * sizeof(job_t *));
+        pthread_cond_destroy(&par.over);
+        pthread_cond_destroy(&par.work);
+        pthread_mutex_destroy(&par.lock);
+        return walk_serial(pc, dir, len, 0);
+    }
+    if (n < limit) {
+        limit = n;
+        if (tuner.active > limit)
+            par_set_active(&par, tuner.active = limit);
+        pthread_mutex_lock(&par.lock);
+        par.devs[0].limit = limit;
+        pthread_mutex_unlock(&par.lock);
+    }
+    ps->threads_cpus = cpus;
+    ps->threads_nofile = nofile;
+    ps->threads_limit = limit;
+    ps->threads_peak = tuner.active;
+
+    if (pc->threads == 1)
+        par_worker(workers);
+
+    last_ns = chax_now_ns();
+    pthread_mutex_lock(&par.lock);
+    while (!par.done) {
+        unsigned long long now, entries = 0, ns_sum = 0, ops = 0;
+        unsigned int next;
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += TUNE_PERIOD_NS;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&par.over, &par.lock, &ts);
+        if (par.done)
+            continue;
+        now = chax_now_ns();
+        par_tune_devs(pc, &par, workers, limit, seen, now);
+        if (pc->threads)
+            continue;
+        pthread_mutex_unlock(&par.lock);
+
+        for (i = 0; i < limit; i++) {
+            entries += TUNE_GET(workers + i, tune_entries);
+            ns_sum += TUNE_GET(workers + i, tune_ns);
+            ops += TUNE_GET(workers + i, tune_ops);
+        }
+        next = tune_step(&tuner, limit, (entries - last_entries) * 1e9 / (now - last_ns),
+                         ops > last_ops ? (double)(ns_sum - last_ns_sum) / (ops - last_ops) : 0);
+        last_ns = now;
+        last_entries = entries;
+        last_ns_sum = ns_sum;
+        last_ops = ops;
+        if (next != par.active) {
+            par_set_active(&par, next);
+            ps->threads_changes++;
+            if (next > ps->threads_peak)
+                ps->threads_peak = next;
+            if (pc->hooks.span)
+                pc->hooks.span(pc->hooks.arg, "threads", now, now, next, NULL, 0);
+        }
+        pthread_mutex_lock(&par.lock);
+    }
+    pthread_mutex_unlock(&par.lock);
+    ps->threads_final = par.active;
+    ps->threads_devices = par.ndevs;
+
+    for (i = 0; i < n; i++) {
+        chax_t *pw = workers + i;
+        int j;
+
+        if (pc->threads != 1)
+            pthread_join(tids[i], NULL);
+        for (j = 0; j < WALK_HIST_DEPTH; j++) {
+            pc->walk.subtree_sum[j] += pw->walk.subtree_sum[j];
+            pc->walk.subtree_cnt[j] += pw->walk.subtree_cnt[j];
+            pc->walk.read_cnt[j] += pw->walk.read_cnt[j];
+            pc->walk.read_names[j] += pw->walk.read_names[j];
+            pc->walk.read_dirs[j] += pw->walk.read_dirs[j];
+        }
+        for (j = 0; j < pw->walk.size; j++)
+            mem_free(&pw->stats, CHAX_MEM_WALK_NAMES, pw->walk.frames[j].names,
+                     pw->walk.frames[j].names_size);
+        mem_free(&pw->stats, CHAX_MEM_WALK_FRAMES, pw->walk.frames,
+                 pw->walk.size * sizeof(frame_t));
+        chax_stats_merge(ps, &pw->stats, pc->slow_max);
+        chax_stats_free(&pw->stats);
+    }
+    /* the budget ran out with these still queued, sized by their depth */
+    for (i = 0; i < par.ndevs; i++) {
+        devq_t *dq = par.devs + i;
+
+        while (dq->queued) {
+            pj = devq_pop(&par, dq);
+            walk_unvisited(pc, pj->path, pj->len, walk_subtree_avg(&pc->walk, pj->depth), 0);
+            mem_free(ps, CHAX_MEM_WALK_NAMES, pj, sizeof(job_t) + pj->len + 1);
+        }
+        mem_free(ps, CHAX_MEM_WALK_NAMES, dq->jobs, dq->jobs_size * sizeof(job_t *));
+    }
+    free(workers);
+    free(tids);
+    free(seen);
+    pthread_cond_destroy(&par.over);
+    pthread_cond_destroy(&par.work);
+    pthread_mutex_destroy(&par.lock);
+    return par.root_failed ? -1 : 0;
+}
+
+
+/*
+ * sampling. the directories read are kept as a tree, so the ones near the
+ * top are read once rather than on every descent. a directory is complete
+ * once it and everything below it was read, its totals are exact from then
+ * on and descents only choose between the children that aren't complete.
+ */
+typedef struct __stru_snode {
+    struct __stru_snode *parent;
+    struct __stru_snode **kids;
+    unsigned int nkids;
+    unsigned int kids_size;
+    /* kids not complete yet */
+    unsigned int incomplete;
+    int read;
+    /* its own entries plus those of the complete kids */
+    unsigned long long tot[CHAX_ESTIMATES];
+    /* entries below it according to the descents that went through */
+    double est_sum;
+    unsigned int est_n;
+    /* what its own size and link count say about that, see sample_hint() */
+    double hint;
+    /* the weight and total entries of the descent in progress on the way in */
+    double w;
+    double x;
+    size_t name_len;
+    char name[];
+} snode_t;
+
+static snode_t *
+sample_node(chax_t *pc, snode_t *parent, const char *name, size_t name_len)
+{
+    snode_t *pn = (snode_t *)mem_alloc(&pc->stats, CHAX_MEM_SAMPLE,
+                                       sizeof(snode_t) + name_len + 1);
+
+    if (!pn)
+        return NULL;
+    memset(pn, 0, sizeof(snode_t));
+    pn->parent = parent;
+    pn->name_len = name_len;
+    memcpy(pn->name, name, name_len + 1);
+    return pn;
+}
+
+
+static void
+sample_free(chax_t *pc, snode_t *pn)
+{
+    unsigned int i;
+
+    for (i = 0; i < pn->nkids; i++)
+        sample_free(pc, pn->kids[i]);
+    mem_free(&pc->stats, CHAX_MEM_SAMPLE, pn->kids, pn->kids_size * sizeof(snode_t *));
+    mem_free(&pc->stats, CHAX_MEM_SAMPLE, pn, sizeof(snode_t) + pn->name_len + 1);
+}
+
+
+/*
+ * before a directory is read all there is to go by is its lstat: st_size
+ * grows with the entries on most file systems and st_nlink with the
+ * subdirectories on most others. how that translates to entries below it
+ * is learnt from its siblings, see sample_pick().
+ */
+static double
+sample_hint(const struct stat *sb)
+{
+    return (1 + sb->st_size / 512) * (sb->st_nlink > 2 ? sb->st_nlink - 1 : 1);
+}
+
+
+/*
+ * read and classify the directory at pw->path[0..path_len], the
+ * subdirectories we may search become its kids
+ */
+static int
+sample_read(chax_t *pc, snode_t *pn, size_t path_len, unsigned long long *seen)
+{
+    char *path = pc->walk.path, *end = path + path_len;
+    dirreader_t dr;
+    dirent_rec_t *pe;
+    struct stat sb;
+    int cls;
+
+    pn->read = 1;
+    path[path_len] = '\0';
+    if (dirreader_open(pc, &dr, path) == -1) {
+        int err = errno;
+        char *slash = strrchr(path, '/');
+
+        if (!slash)
+            walk_error(pc, "Unable to open dir", "", 0, path, err);
+        else
+            walk_error(pc, "Unable to open dir", path, slash - path, slash + 1, err);
+        return -1;
+    }
+    if (pc->progress)
+        PROGRESS_ADD(pc, dirs, 1);
+    if (end > path && *(end - 1) != '/')
+        *end++ = '/';
+
+    while ((pe = dirreader_next(pc, &dr))) {
+        size_t len;
+
+        if (pe->d_name[0] == '.') {
+            if (pe->d_name[1] == '\0')
+                continue;
+            if (pe->d_name[1] == '.' && pe->d_name[2] == '\0')
+                continue;
+        }
+        len = strlen(pe->d_name);
+        pc->stats.visited++;
+        if (pc->progress)
+            PROGRESS_ADD(pc, entries, 1);
+        if (path_len >= PATH_MAX - 1 - len) {
+            walk_error(pc, "Name too long", path, path_len, pe->d_name, ENAMETOOLONG);
+            continue;
+        }
+        memcpy(end, pe->d_name, len + 1);
+
+        pc->stats.lstat_calls++;
+        if (lstat(path, &sb) == -1) {
+            walk_error(pc, "Unable to lstat", path, path_len, pe->d_name, errno);
+            continue;
+        }
+        pc->stats.entries[chax_etype(sb.st_mode)]++;
+        pn->tot[CHAX_CLASSES]++;
+        seen[CHAX_CLASSES]++;
+        if (S_ISLNK(sb.st_mode))
+            continue;
+
+        cls = chax_classify(pc, &sb);
+        if (cls >= 0) {
+            pn->tot[cls]++;
+            seen[cls]++;
+            if (pc->hooks.finding)
+                pc->hooks.finding(pc->hooks.arg, cls, path, &sb);
+        }
+        if (!S_ISDIR(sb.st_mode))
+            continue;
+        if (!is_executable(pc, &sb)) {
+            pc->stats.dirs_pruned++;
+            continue;
+        }
+        if (pn->nkids == pn->kids_size) {
+            unsigned int size = pn->kids_size ? pn->kids_size * 2 : 8;
+            snode_t **kids = (snode_t **)mem_realloc(&pc->stats, CHAX_MEM_SAMPLE, pn->kids,
+                                                     pn->kids_size * sizeof(snode_t *),
+                                                     size * sizeof(snode_t *));
+
+            if (!kids) {
+                dr.err = ENOMEM;
+                break;
+            }
+            pn->kids = kids;
+            pn->kids_size = size;
+        }
+        if (!(pn->kids[pn->nkids] = sample_node(pc, pn, pe->d_name, len))) {
+            dr.err = ENOMEM;
+            break;
+        }
+        pn->kids[pn->nkids++]->hint = sample_hint(&sb);
+    }
+
+    path[path_len] = '\0';
+    if (dr.err)
+        walk_error(pc, "Unable to read dir", path, path_len, "", dr.err);
+    dirreader_close(pc, &dr);
+    pn->incomplete = pn->nkids;
+    return 0;
+}
+
+
+/* hand the totals of pn up for as long as directories become complete */
+static void
+sample_complete(snode_t *pn)
+{
+    int i;
+
+    while (pn->read && !pn->incomplete && pn->parent) {
+        snode_t *pp = pn->parent;
+
+        for (i = 0; i < CHAX_ESTIMATES; i++)
+            pp->tot[i] += pn->tot[i];
+        pp->incomplete--;
+        pn = pp;
+    }
+}
+
+
+/* xorshift64*, uniform in [0, 1) */
+static double
+sample_random(unsigned long long *state)
+{
+    unsigned long long x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return ((x * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/*
+ * pick one of the kids that aren't complete. half the odds are spread
+ * evenly so no subtree is ever left out, the other half go by how many
+ * entries are below each: what earlier descents found, or for a kid not
+ * descended into yet its hint, scaled by how the hints of its siblings
+ * turned out. returns the kid, *pp its odds.
+ */
+static double
+sample_weight(const snode_t *pk, double scale)
+{
+    return 1 + (pk->est_n ? pk->est_sum / pk->est_n : scale * pk->hint);
+}
+
+static snode_t *
+sample_pick(snode_t *pn, unsigned long long *rng, double *pp)
+{
+    double scale = 0, sum = 0, r, acc = 0, p = 0;
+    unsigned int i, nscale = 0, last = 0;
+    snode_t *pk = NULL;
+
+    for (i = 0; i < pn->nkids; i++) {
+        pk = pn->kids[i];
+        if (pk->read && !pk->incomplete)
+            scale += pk->tot[CHAX_CLASSES] / pk->hint;
+        else if (pk->est_n)
+            scale += pk->est_sum / pk->est_n / pk->hint;
+        else
+            continue;
+        nscale++;
+    }
+    scale = nscale ? scale / nscale : 1;
+    for (i = 0; i < pn->nkids; i++) {
+        pk = pn->kids[i];
+        if (pk->read && !pk->incomplete)
+            continue;
+        sum += sample_weight(pk, scale);
+        last = i;
+    }
+
+    r = sample_random(rng);
+    for (i = 0; i <= last; i++) {
+        pk = pn->kids[i];
+        if (pk->read && !pk->incomplete)
+            continue;
+        p = 0.5 / pn->incomplete + 0.5 * sample_weight(pk, scale) / sum;
+        acc += p;
+        if (r < acc)
+            break;
+    }
+    if (i > last)
+        pk = pn->kids[last];
+    *pp = p;
+    return pk;
+}
+
+
+/*
+ * one descent from root, x gets what it makes of the whole tree. each
+ * directory on the way adds its totals times the inverse odds of getting
+ * there, so on average x is what a full walk would count.
+ */
+static void
+sample_descend(chax_t *pc, snode_t *root, size_t root_len, unsigned long long *seen,
+               unsigned long long *rng, double *x)
+{
+    char *path = pc->walk.path;
+    snode_t *pn = root;
+    size_t len = root_len;
+    double w = 1, p;
+    int i;
+
+    for (i = 0; i < CHAX_ESTIMATES; i++)
+        x[i] = 0;
+    for (;;) {
+        if (!pn->read) {
+            sample_read(pc, pn, len, seen);
+            sample_complete(pn);
+        }
+        pn->w = w;
+        pn->x = x[CHAX_CLASSES];
+        for (i = 0; i < CHAX_ESTIMATES; i++)
+            x[i] += w * pn->tot[i];
+        if (!pn->incomplete)
+            break;
+
+        pn = sample_pick(pn, rng, &p);
+        w /= p;
+        if (len > 0 && path[len - 1] != '/')
+            path[len++] = '/';
+        memcpy(path + len, pn->name, pn->name_len + 1);
+        len += pn->name_len;
+    }
+
+    /* what this descent says about the size of each directory on the way */
+    for (;; pn = pn->parent) {
+        pn->est_sum += (x[CHAX_CLASSES] - pn->x) / pn->w;
+        pn->est_n++;
+        if (pn == root)
+            break;
+    }
+}
+
+
+int
+chax_sample(chax_t *pc, const char *dir, unsigned long long descents, chax_estimate_t *pe)
+{
+    size_t len = strlen(dir);
+    double x[CHAX_ESTIMATES], mean[CHAX_ESTIMATES], m2[CHAX_ESTIMATES];
+    unsigned long long rng = (chax_now_ns() ^ (unsigned long long)(size_t)pc) | 1, n = 0;
+    snode_t *root;
+    int i, ret;
+
+    memset(pe, 0, sizeof(*pe));
+    if (len > PATH_MAX) {
+        walk_error(pc, "Unable to open dir", "", 0, dir, ENAMETOOLONG);
+        return -1;
+    }
+    budget_start(pc);
+    if (!(root = sample_node(pc, NULL, "", 0))) {
+        walk_error(pc, "Unable to open dir", "", 0, dir, ENOMEM);
+        return -1;
+    }
+    memcpy(pc->walk.path, dir, len + 1);
+    ret = sample_read(pc, root, len, pe->seen);
+
+    /* Welford's running mean and variance of the descents */
+    for (i = 0; i < CHAX_ESTIMATES; i++)
+        mean[i] = m2[i] = 0;
+    while (root->incomplete && (!descents || n < descents)) {
+        if (pc->deadline_ns && chax_now_ns() >= pc->deadline_ns)
+            break;
+        if (pc->max_entries && pc->stats.visited >= pc->max_entries)
+            break;
+        sample_descend(pc, root, len, pe->seen, &rng, x);
+        n++;
+        for (i = 0; i < CHAX_ESTIMATES; i++) {
+            double d = x[i] - mean[i];
+
+            mean[i] += d / n;
+            m2[i] += d * (x[i] - mean[i]);
+        }
+    }
+
+    pe->descents = n;
+    pe->exact = !root->incomplete;
+    for (i = 0; i < CHAX_ESTIMATES; i++) {
+        if (pe->exact || !n) {
+            pe->count[i] = pe->seen[i];
+            pe->se[i] = pe->exact ? 0 : pe->seen[i];
+            continue;
+        }
+        pe->count[i] = mean[i] > pe->seen[i] ? mean[i] : pe->seen[i];
+        /* one descent says nothing about the spread, call it as big as the count */
+        pe->se[i] = n > 1 ? sqrt(m2[i] / (n - 1) / n) : pe->count[i];
+    }
+    sample_free(pc, root);
+    return ret;
+}
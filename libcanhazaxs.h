@@ -0,0 +1,298 @@
+/*
+ * libcanhazaxs - the canhazaxs scanner as a library
+ *
+ * a context holds an identity, the engine options, the hooks findings and
+ * errors are delivered to and the statistics of everything it scanned.
+ * nothing is shared between contexts, so any number of them can scan at
+ * the same time, one thread each.
+ *
+ *   chax_t *pc = chax_new();
+ *   chax_set_user(pc, "shell");
+ *   chax_set_hooks(pc, &hooks);
+ *   chax_scan(pc, "/data");
+ *   chax_free(pc);
+ */
+#ifndef LIBCANHAZAXS_H
+#define LIBCANHAZAXS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct __stru_chax chax_t;
+
+/* what an entry is to the identity, in the order they are checked */
+enum {
+    CHAX_SETUID,
+    CHAX_SETGID,
+    CHAX_WRITABLE,
+    CHAX_READABLE,
+    CHAX_EXECUTABLE,
+    CHAX_CLASSES
+};
+
+/* engine options, see chax_set_option() */
+enum {
+    CHAX_OPT_LESS_INTERESTING,  /* also report readable and executable entries */
+    CHAX_OPT_TIMING,            /* time the classification, see classify_ns */
+    CHAX_OPT_LATENCY,           /* fill the latency histograms and slow lists */
+    CHAX_OPT_SLOW_MAX,          /* slow list length, 0 to CHAX_SLOWLIST_MAX (default 10) */
+    CHAX_OPT_PROGRESS,          /* keep the chax_progress() counters up to date */
+    CHAX_OPT_THREADS,           /* walker threads, 0 to tune at runtime (default 1) */
+    CHAX_OPT_PRIORITY,          /* visit the most promising directories first */
+    CHAX_OPT_DEADLINE_MS,       /* stop walking this long after the first walk, 0 never */
+    CHAX_OPT_MAX_ENTRIES        /* stop walking after this many entries, 0 never */
+};
+
+/* no more walker threads than this, whatever CHAX_OPT_THREADS says */
+#define CHAX_THREADS_MAX 64
+
+enum {
+    CHAX_ETYPE_FILE,
+    CHAX_ETYPE_DIR,
+    CHAX_ETYPE_LINK,
+    CHAX_ETYPE_CHR,
+    CHAX_ETYPE_BLK,
+    CHAX_ETYPE_FIFO,
+    CHAX_ETYPE_SOCK,
+    CHAX_ETYPE_UNKNOWN,
+    CHAX_ETYPE_MAX
+};
+
+/* memory held by the walk itself */
+enum {
+    CHAX_MEM_WALK_FRAMES,
+    CHAX_MEM_WALK_NAMES,
+    CHAX_MEM_DIRBUF,
+    CHAX_MEM_SLOWLIST,
+    CHAX_MEM_SAMPLE,
+    CHAX_MEM_MAX
+};
+
+#define CHAX_MAX_ERRNO 256
+
+/*
+ * log-bucketed latency histogram. values below 4ns get their own bucket,
+ * after that every power of two is split into 4 sub-buckets, so the
+ * relative error stays under 25%.
+ */
+#define CHAX_LATHIST_SUB_BITS 2
+#define CHAX_LATHIST_SUB (1 << CHAX_LATHIST_SUB_BITS)
+#define CHAX_LATHIST_BUCKETS (64 * CHAX_LATHIST_SUB)
+
+typedef struct __stru_chax_lathist {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[CHAX_LATHIST_BUCKETS];
+} chax_lathist_t;
+
+/* a bounded list of the slowest things seen, sorted slowest first */
+#define CHAX_SLOWLIST_MAX 64
+
+typedef struct __stru_chax_slow {
+    unsigned long long ns;
+    char *path;
+} chax_slow_t;
+
+typedef struct __stru_chax_slowlist {
+    int len;
+    chax_slow_t items[CHAX_SLOWLIST_MAX];
+} chax_slowlist_t;
+
+typedef struct __stru_chax_mem {
+    unsigned long long cur;
+    unsigned long long peak;
+    unsigned long long total;
+} chax_mem_t;
+
+typedef struct __stru_chax_stats {
+    unsigned long long opendir_calls;
+    unsigned long long readdir_calls;
+    unsigned long long getdents_calls;
+    unsigned long long closedir_calls;
+    unsigned long long lstat_calls;
+    /* names taken off the directory frames, including failed ones */
+    unsigned long long visited;
+    unsigned long long entries[CHAX_ETYPE_MAX];
+    unsigned long long dirs_pruned;
+    /* errno 0 collects anything out of range */
+    unsigned long long errors[CHAX_MAX_ERRNO];
+    unsigned long long classify_ns;
+    chax_lathist_t lstat_lat;
+    chax_lathist_t getdents_lat;
+    chax_slowlist_t slow_dirs;
+    chax_slowlist_t slow_entries;
+    chax_mem_t mem[CHAX_MEM_MAX];
+    /* the parallel walk, all 0 for a serial one */
+    unsigned int threads_cpus;      /* cpus the affinity mask and cgroup quota allow */
+    unsigned int threads_nofile;    /* workers RLIMIT_NOFILE leaves room for */
+    unsigned int threads_limit;     /* workers started */
+    unsigned int threads_peak;      /* most allowed to walk at once */
+    unsigned int threads_final;     /* allowed to walk at the end */
+    unsigned int threads_changes;   /* times the count was tuned */
+    unsigned int threads_devices;   /* devices walked, each with its own queue */
+    unsigned int threads_devtunes;  /* times a device's limit was tuned */
+    unsigned long long dirs_shared; /* directories handed to another worker */
+    /* the budget, see CHAX_OPT_DEADLINE_MS */
+    unsigned int stopped;           /* it ran out */
+    unsigned long long unvisited_dirs;  /* subtrees not entered */
+    unsigned long long unvisited_est;   /* estimated entries not visited */
+} chax_stats_t;
+
+/* what chax_sample() makes of a tree, the classes and then all entries */
+#define CHAX_ESTIMATES (CHAX_CLASSES + 1)
+
+typedef struct __stru_chax_estimate {
+    unsigned long long descents;
+    /* everything below dir was read, count is what was seen */
+    int exact;
+    double count[CHAX_ESTIMATES];
+    /* standard error of count, 95% of the time the truth is within 1.96 of these */
+    double se[CHAX_ESTIMATES];
+    /* in the directories that were read, so never more than there are */
+    unsigned long long seen[CHAX_ESTIMATES];
+} chax_estimate_t;
+
+/* a consistent enough view of a running scan for a progress display */
+typedef struct __stru_chax_progress {
+    unsigned long long entries;
+    unsigned long long dirs;
+    unsigned long long pending_dirs;
+    unsigned long long est_total;
+    unsigned int depth;
+} chax_progress_t;
+
+/*
+ * every hook is optional and gets arg as its first argument. they are
+ * called from the thread running chax_scan(), or with CHAX_OPT_THREADS
+ * other than 1 from the walker threads, concurrently.
+ */
+typedef struct __stru_chax_hooks {
+    void *arg;
+    /* an entry the identity has access to, cls is one of CHAX_SETUID.. */
+    void (*finding)(void *arg, int cls, const char *path, const struct stat *sb);
+    /* "<parent>/<name>" could not be opened, read or stat'ed */
+    void (*error)(void *arg, const char *what, const char *parent, size_t parent_len,
+                  const char *name, int err);
+    /*
+     * with this set nothing is classified: every entry is handed over and
+     * every directory entered, with the process's own permissions. what it
+     * returns for a directory comes back as parent for the entries below.
+     * name_off is where the last component of path starts. the entries
+     * come in preorder, so such a walk is never parallel.
+     */
+    unsigned int (*entry)(void *arg, unsigned int parent, const char *path, size_t path_len,
+                          size_t name_off, const struct stat *sb);
+    /* a "read_dir", "getdents" or "stat_batch" span of the walk */
+    void (*span)(void *arg, const char *name, unsigned long long start_ns,
+                 unsigned long long end_ns, unsigned long long n, const char *detail,
+                 size_t detail_len);
+    /* called with 1 before and 0 after classifying each entry, the finding hook comes after */
+    void (*classify)(void *arg, int before);
+    /* with CHAX_OPT_PRIORITY, how promising a directory is instead of chax_priority() */
+    int (*priority)(void *arg, const char *path, size_t len, const struct stat *sb);
+    /*
+     * the budget ran out before path was walked, est is a guess at the
+     * entries below it from the subtrees seen so far (0 when there's
+     * nothing to go by.) partial means path itself was read, only the est
+     * entries right in it and below some of its directories were left.
+     * the directories among those are reported again on their own for what
+     * is below them, as far as there was time to check them.
+     */
+    void (*unvisited)(void *arg, const char *path, size_t len, unsigned long long est,
+                      int partial);
+} chax_hooks_t;
+
+/* returns NULL when out of memory. the identity starts out as our own. */
+chax_t *chax_new(void);
+void chax_free(chax_t *pc);
+
+/*
+ * the identity to test access for. chax_set_user() takes a name or a
+ * number and the groups from the account database, a number nobody has
+ * gets no groups. they return -1 with errno set on failure.
+ */
+int chax_set_identity(chax_t *pc, uid_t uid, const gid_t *groups, int ngroups);
+int chax_set_user(chax_t *pc, const char *user);
+int chax_add_group(chax_t *pc, gid_t gid);
+/* the groups come back in the order they were added */
+int chax_identity(chax_t *pc, uid_t *puid, const gid_t **pgroups);
+int chax_in_group(chax_t *pc, gid_t gid);
+
+int chax_set_option(chax_t *pc, int opt, long value);
+void chax_set_hooks(chax_t *pc, const chax_hooks_t *ph);
+
+/* the class a scan would file sb under, or -1 */
+int chax_classify(chax_t *pc, const struct stat *sb);
+/* would a scan go into this directory */
+int chax_searchable(chax_t *pc, const struct stat *sb);
+/*
+ * how promising a directory is to the identity, higher first: going by its
+ * name (bin, dev, run.. up, proc, sys, doc.. down) and by whether it is
+ * writable, owned by the identity or set-gid
+ */
+int chax_priority(chax_t *pc, const char *path, size_t len, const struct stat *sb);
+
+/*
+ * walk everything below dir, which should be a canonical path. dir itself
+ * is not classified. chax_walk() also gives the entry hook's parent for
+ * the entries right below dir. returns -1 if dir couldn't be read at all.
+ *
+ * with CHAX_OPT_THREADS other than 1 the directories are spread over
+ * worker threads and findings come in no particular order. 0 starts with
+ * two and tunes the count from the entries/s and syscall latency it sees,
+ * up to 4 per cpu we may use (see threads_cpus) and what the fd limit
+ * allows. directories are queued per device and each device gets fewer
+ * workers as its latency climbs, so a slow mount doesn't hold up the rest.
+ *
+ * with CHAX_OPT_PRIORITY, even with one thread, the pending directories are
+ * visited best first instead of depth first. a directory gets its own
+ * score plus half of its parent's. this keeps every pending directory in
+ * memory rather than just the ones on the path being walked. with one
+ * thread the walk still runs on the calling thread, like the serial one.
+ *
+ * with CHAX_OPT_DEADLINE_MS or CHAX_OPT_MAX_ENTRIES a walk stops once the
+ * context is out of budget, see the unvisited hook and stopped. walks
+ * after that only report their dir as unvisited. a walk stopped early
+ * still returns 0.
+ */
+int chax_scan(chax_t *pc, const char *dir);
+int chax_walk(chax_t *pc, const char *dir, unsigned int parent);
+
+/*
+ * estimate what chax_scan() would find below dir from random descents
+ * instead of walking all of it (Knuth's tree size estimator.) each descent
+ * goes from dir down to a leaf, reading every directory on the way in full,
+ * and counts what it sees there once for each directory like it that was
+ * skipped. children are picked more often the bigger earlier descents
+ * found them, which keeps the spread down on lopsided trees. directories
+ * are read only once, and a subtree that was read in full counts exactly
+ * from then on.
+ *
+ * it stops after descents (0 for no limit), at CHAX_OPT_DEADLINE_MS or
+ * CHAX_OPT_MAX_ENTRIES, or once everything was read. the finding hook gets
+ * each finding in the directories read, the entry hook isn't used and it
+ * always runs on one thread. returns -1 if dir couldn't be read at all.
+ */
+int chax_sample(chax_t *pc, const char *dir, unsigned long long descents, chax_estimate_t *pe);
+
+const chax_stats_t *chax_stats(chax_t *pc);
+void chax_progress(chax_t *pc, chax_progress_t *pp);
+/* add src to dst, keeping the slowest items of both. dst starts zeroed. */
+void chax_stats_merge(chax_stats_t *dst, const chax_stats_t *src, int slow_max);
+void chax_stats_free(chax_stats_t *ps);
+
+const char *chax_class_name(int cls);
+int chax_etype(mode_t mode);
+unsigned long long chax_now_ns(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif